@@ -1,4 +1,5 @@
 #include "arch.h"
+#include "exc.h"
 
 // Machine params
 
@@ -17,9 +18,51 @@ unsigned int* const GPIO_UART_CTRL = (unsigned int*)0xbfc0901c;  // UART control
 unsigned int* const GPIO_CURSOR = (unsigned int*)0xbfc09020;     // Cursor 8-bit frequency 8-bit row 8-bit col
 unsigned int* const VGA_MODE = (unsigned int*)0xbfc09024;        // enable graphic mode
 
-// kernel sp
+// kernel sp, the top of the running task's kernel stack
 volatile unsigned int kernel_sp = 0x81000000;
 
+// trap frame to restore from instead of the one just saved, set by the
+// scheduler on a switch and cleared by the exception return path
+volatile unsigned int next_trap_frame = 0;
+
+#if !MACHINE_MMSIZE
+// alias check word for the RAM probe, lives in the kernel image so that
+// writing it clobbers neither the vectors at physical 0 nor kernel text
+static unsigned int mm_probe_scratch;
+static volatile int mm_probe_fault;
+
+// a read from an unpopulated range may raise a data bus error, note it
+// and step over the faulting load (the probe loads are not in delay slots)
+static void mm_probe_bus_error(unsigned int status, unsigned int cause, context* pt_context) {
+    mm_probe_fault = 1;
+    pt_context->epc += 4;
+}
+#endif
+
+// probe every MACHINE_MMSIZE_STEP above the kernel through kseg1 (uncached)
+// a missing step either bus errors, does not hold the pattern or wraps
+// around onto mm_probe_scratch, which is cleared after the pattern is written
+// only used with MACHINE_MMSIZE 0, must run after init_exception
 unsigned int get_phymm_size() {
+#if MACHINE_MMSIZE
     return MACHINE_MMSIZE;
-}
\ No newline at end of file
+#else
+    unsigned int offset = (unsigned int)&mm_probe_scratch & 0x1fffffff;
+    volatile unsigned int* scratch = (volatile unsigned int*)(0xa0000000 + offset);
+    volatile unsigned int* probe;
+    unsigned int saved, size;
+
+    register_exception_handler(7, mm_probe_bus_error);
+    for (size = MACHINE_MMSIZE_MIN; size < MACHINE_MMSIZE_MAX; size += MACHINE_MMSIZE_STEP) {
+        probe = (volatile unsigned int*)(0xa0000000 + size + offset);
+        mm_probe_fault = 0;
+        saved = *probe;
+        *probe = 0x5a5aa5a5;
+        *scratch = 0;
+        if (*probe != 0x5a5aa5a5 || mm_probe_fault) break;
+        *probe = saved;
+    }
+    register_exception_handler(7, 0);
+    return size;
+#endif
+}
@@ -3,7 +3,10 @@
 
 //	machine params
 
-#define MACHINE_MMSIZE 128 * 1024 * 1024     // 128MB
+#define MACHINE_MMSIZE 128 * 1024 * 1024     // 128MB, 0: probe at boot
+#define MACHINE_MMSIZE_MIN 16 * 1024 * 1024   // kernel image and stack, always present
+#define MACHINE_MMSIZE_MAX 256 * 1024 * 1024  // probe limit, below the I/O at 0x1fc00000
+#define MACHINE_MMSIZE_STEP 1024 * 1024       // probe granularity
 #define MACHINE_SDSIZE 16 * 1024 * 1024 * 2  // 32M Sectors
 #define CHAR_VRAM_SIZE 128 * 32 * 4          // 128*32*4
 #define PAGE_TABLE_SIZE 256 * 1024           // 4MB
@@ -31,6 +34,7 @@ extern unsigned int* const VGA_MODE;        // enable graphic mode
 
 // kernel sp
 extern volatile unsigned int kernel_sp;
+extern volatile unsigned int next_trap_frame;
 
 // PS/2 control register:
 //  [5:0]: RX buffer load(R)
@@ -46,4 +50,11 @@ extern volatile unsigned int kernel_sp;
 
 unsigned int get_phymm_size();
 
+// read the CP0 Count register, used to time kernel benchmarks
+static inline unsigned int get_cp0_count() {
+    unsigned int count;
+    asm volatile("mfc0 %0, $9\n\t" : "=r"(count));
+    return count;
+}
+
 #endif
@@ -22,7 +22,7 @@ void do_exceptions(unsigned int status, unsigned int cause,
         kernel_printf("\nProcess %s exited due to exception cause=%x;\n",
                       pcb->name, cause);
         kernel_printf("status=%x, EPC=%x, BadVaddr=%x", status,
-                      pcb->context.epc, badVaddr);
+                      pt_context->epc, badVaddr);
         task_kill(pcb->pid);
         // while (1)
         //     ;
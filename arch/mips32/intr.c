@@ -64,4 +64,25 @@ void register_interrupt_handler(int index, intr_fn fn) {
         : "=r"(index));
 }
 
+// clear or set one IM bit in Status, the handler stays registered
+void mask_interrupt(int index) {
+    index = ~(1 << ((index & 7) + 8));
+    asm volatile(
+        "mfc0 $t0, $12\n\t"
+        "and $t0, $t0, %0\n\t"
+        "mtc0 $t0, $12"
+        :
+        : "r"(index));
+}
+
+void unmask_interrupt(int index) {
+    index = 1 << ((index & 7) + 8);
+    asm volatile(
+        "mfc0 $t0, $12\n\t"
+        "or $t0, $t0, %0\n\t"
+        "mtc0 $t0, $12"
+        :
+        : "r"(index));
+}
+
 #pragma GCC pop_options
\ No newline at end of file
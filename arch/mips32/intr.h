@@ -12,5 +12,7 @@ int enable_interrupts();
 int disable_interrupts();
 void do_interrupts(unsigned int status, unsigned int cause, context* pt_context);
 void register_interrupt_handler(int index, intr_fn fn);
+void mask_interrupt(int index);
+void unmask_interrupt(int index);
 
 #endif
\ No newline at end of file
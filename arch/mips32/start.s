@@ -2,16 +2,92 @@
 .globl start
 .globl exception
 .extern kernel_sp
+.extern next_trap_frame
 .extern exception_handler
 .extern interrupt_handler
+.extern current_ptd
+.extern tlb_refill_scratch
 
 .set noreorder
 .set noat
 .align 2
 
+# TLB refill vector, walks current_ptd -> pt with k0/k1 only and
+# writes the even/odd pair with tlbwr.
+# kernel addresses, a missing page directory or page table go to the
+# general exception path (tlb_refill in kernel/vm/vm.c). An empty pte
+# gives an invalid EntryLo, touching it raises TLBL/TLBS there as well.
+# large page ptes (PTE_PAGE_MASK) need a PageMask and swapped out ptes
+# (PTE_SWAP) hold a slot number, both go there too.
+# pte -> EntryLo: (pte & 0x7ffff000) >> 6, C = 3, D | V,
+# no D if PTE_COW or PTE_RDONLY, PTE_ACCESSED is set in the page table
 exception:
-	j   exception_start
+	mfc0 $k0, $8
+	bltz $k0, exception_start
+	lui $k1, %hi(current_ptd)
+	lw $k1, %lo(current_ptd)($k1)
+	beq $k1, $zero, exception_start
+	srl $k0, $k0, 22
+	sll $k0, $k0, 2
+	addu $k1, $k1, $k0
+	lw $k1, 0($k1)
+	beq $k1, $zero, exception_start
+	mfc0 $k0, $8
+	srl $k0, $k0, 10
+	andi $k0, $k0, 0xff8
+	addu $k1, $k1, $k0
+# at is the third scratch register from here on
+	lui $k0, %hi(tlb_refill_scratch)
+	sw $at, %lo(tlb_refill_scratch)($k0)
+	lw $k0, 0($k1)
+	andi $at, $k0, 0x16
+	bne $at, $zero, 3f
 	nop
+	beq $k0, $zero, 1f
+	andi $at, $k0, 9
+	ori $k0, $k0, 0x20
+	sw $k0, 0($k1)
+	sll $k0, $k0, 1
+	srl $k0, $k0, 13
+	sll $k0, $k0, 6
+	ori $k0, $k0, 0x1e
+	sltu $at, $zero, $at
+	sll $at, $at, 2
+	xor $k0, $k0, $at
+1:
+	mtc0 $k0, $2
+	lw $k0, 4($k1)
+	andi $at, $k0, 0x10
+	bne $at, $zero, 3f
+	nop
+	beq $k0, $zero, 2f
+	andi $at, $k0, 9
+	ori $k0, $k0, 0x20
+	sw $k0, 4($k1)
+	sll $k0, $k0, 1
+	srl $k0, $k0, 13
+	sll $k0, $k0, 6
+	ori $k0, $k0, 0x1e
+	sltu $at, $zero, $at
+	sll $at, $at, 2
+	xor $k0, $k0, $at
+2:
+	mtc0 $k0, $3
+	mtc0 $zero, $5
+	nop
+	nop
+	tlbwr
+	nop
+	nop
+	lui $k1, %hi(tlb_refill_scratch)
+	lw $at, %lo(tlb_refill_scratch)($k1)
+	eret
+# a large page pair covers both ptes, checking the even one is enough
+# for PTE_PAGE_MASK, a swapped out odd pte is caught on its own
+3:
+	lui $k1, %hi(tlb_refill_scratch)
+	j exception_start
+	lw $at, %lo(tlb_refill_scratch)($k1)
 
 .org 0x0180
 exception_start:
@@ -78,6 +154,16 @@ interrupt_save_context:
 	nop
 	addi $sp, $sp, 32
 
+# a context switch leaves the frame of the next task in next_trap_frame,
+# the frame just saved stays on the outgoing task's kernel stack
+ret_from_trap:
+	la $k0, next_trap_frame
+	lw $k1, 0($k0)
+	beq $k1, $zero, restore_context
+	nop
+	sw $zero, 0($k0)
+	move $sp, $k1
+
 restore_context:
 	lw $a2, 0($sp) # EPC
 	lw $t3, 104($sp) # HI
@@ -166,7 +252,7 @@ exception_save_context:
 	nop
 	addi $sp, $sp, 32
 
-	j restore_context
+	j ret_from_trap
 	nop
 
 .org 0x1000
@@ -24,6 +24,7 @@ struct bootmm_info {
 
 // 4K per page
 #define PAGE_SHIFT 12
+// one bit per page frame in the bootmm bitmap, set when the frame is used
 #define PAGE_FREE 0x00
 #define PAGE_USED 0xff
 
@@ -34,8 +35,8 @@ struct bootmm_info {
 struct bootmm {
     unsigned int phymm;    // the actual physical memory
     unsigned int max_pfn;  // record the max page number
-    unsigned char* s_map;  // map begin place
-    unsigned char* e_map;
+    unsigned int* s_map;  // map begin place, sized from max_pfn at boot
+    unsigned int* e_map;
     unsigned int last_alloc_end;
     unsigned int cnt_infos;  // get number of infos stored in bootmm now
     struct bootmm_info info[MAX_INFO];
@@ -8,13 +8,16 @@
 #define _PAGE_ALLOCED (1 << 30)
 #define _PAGE_SLAB (1 << 29)
 #define _PAGE_FREE (1 << 28)
+// or-ed into an allocated page that a file mapping uses from the page cache,
+// its virtual is then the struct vfs_page, not a slab cache or pool owner
+#define _PAGE_MMAP (1 << 27)
 
 /*
  * struct buddy page is one info-set for the buddy group of pages
  */
 struct page {
     unsigned int flag;       // the declaration of the usage of this page
-    unsigned int reference;  //
+    unsigned int reference;  // users of the block, it is freed when this drops to 0
     struct list_head list;   // double-way list
     void *virtual;           // default 0x(-1)
     unsigned int
@@ -30,21 +33,36 @@ struct page {
 };
 
 #define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
 /*
  * order means the size of the set of pages, e.g. order = 1 -> 2^1
  * pages(consequent) are free In current system, we allow the max order to be
- * 4(2^4 consequent free pages)
+ * 10(2^10 consequent free pages, 4MB)
  */
-#define MAX_BUDDY_ORDER 4
+#define MAX_BUDDY_ORDER 10
 
+/*
+ * @map : one bit for each pair of buddies of this order (none for the max
+ *        order), the bit is the xor of "first is free" and "second is free",
+ *        so when freeing a block a set bit after toggling means its buddy
+ *        is still in use
+ */
 struct freelist {
     unsigned int nr_free;
     struct list_head free_head;
+    unsigned int *map;
 };
 
+/*
+ * @pages_low  : an allocation leaving fewer free frames than this
+ *               runs the shrinkers (see zjunix/shrinker.h)
+ * @pages_high : the shrinkers stop once this many frames are free
+ */
 struct buddy_sys {
     unsigned int buddy_start_pfn;
     unsigned int buddy_end_pfn;
+    unsigned int pages_low;
+    unsigned int pages_high;
     struct page *start_page;
     struct lock_t lock;
     struct freelist freelist[MAX_BUDDY_ORDER + 1];
@@ -72,4 +90,8 @@ extern void init_buddy();
 
 extern void buddy_info();
 
+extern unsigned int buddy_free_pages();
+
+extern void buddy_bench();
+
 #endif
@@ -28,6 +28,10 @@ static const unsigned int sysctl_sched_wakeup_granularity = 1600000;
 // unit time period, used to calculate normalized time
 static const unsigned int sysctl_sched_time_unit = 20000;
 
+// shortest timer interrupt period in dynamic tick mode,
+// a slice that is nearly used up still gets this long
+static const unsigned int sysctl_sched_tick_min = 300000;
+
 // CFS default maximum process,
 // however, if the process number is greater than this
 // the period will use sysctl_sched_min_granularity_ns * nr
@@ -120,7 +124,7 @@ struct cfs_rq {
   // minimum virtual runtime
   u32 min_vruntime;
 
-  // root to the rbtree
+  // root to the rbtree, the running se is not in it
   struct rb_root tasks_timeline;
 
   // cache of se of minimum vruntime
@@ -147,8 +151,16 @@ void dequeue_task_fair(struct cfs_rq* cfs_rq, struct task_struct* p);
 
 struct task_struct* pick_next_task_fair(struct cfs_rq* cfs_rq);
 
+void put_prev_task_fair(struct cfs_rq* cfs_rq, struct task_struct* p);
+
+void set_next_task_fair(struct cfs_rq* cfs_rq, struct task_struct* p);
+
 void check_preempt_tick(struct cfs_rq* cfs_rq, struct sched_entity* curr);
 
 void check_preempt_wakeup(struct cfs_rq* cfs_rq, struct task_struct* p);
 
+u32 sched_slice_left(struct cfs_rq* cfs_rq, struct sched_entity* se);
+
+void sched_bench();
+
 #endif
\ No newline at end of file
@@ -43,8 +43,10 @@ typedef struct task_struct {
     // state, ie: TASK_RUNNING
     int state;
 
-    // registers context
-    reg_context_t context;
+    // trap frame on the task's own kernel stack, saved by the exception
+    // entry and restored from when the task is switched back in
+    // only valid while the task is not running
+    reg_context_t* frame;
 
     // global pid and tgid value
     // pid: process identifier
@@ -103,6 +105,13 @@ typedef struct task_struct {
 
     // ptr to virtual memory
     void *vm;
+
+    // used virtual address ranges, rbtree of vm_area_struct (kernel/vm/vma.c)
+    struct rb_root mm_rb;
+
+    // TLB address space id, generation in the high bits
+    // 0 (or an old generation) means a new one is allocated on switch-in
+    unsigned int asid;
     
     // user pc memory
     memory_block_struct *user_pc_memory_blocks[9];
@@ -128,6 +137,9 @@ void task_schedule(unsigned int status, unsigned int cause,
 void task_exit_syscall(unsigned int status, unsigned int cause,
                        context *pc_context);
 
+void task_fork_syscall(unsigned int status, unsigned int cause,
+                       context *pt_context);
+
 void task_kill(pid_t pid);
 
 void task_wait(pid_t pid);
@@ -140,6 +152,14 @@ int task_exec_from_file(char *filename);
 
 int print_proc();
 
+int sched_stat();
+
+void sched_switch_stat(unsigned int *nr, unsigned int *cycles);
+
+void sched_set_tick_mode(int dynamic);
+
+void pid_stress();
+
 void vruntime_test();
 
 void print_rbtree(struct rb_node *tree, struct rb_node *parent, int direction);
@@ -35,11 +35,15 @@ struct pid {
 
 struct task_struct;
 
-#define PIDMAP_MAX_ENTRY 16
-#define PIDMAP_BYTE ((PIDMAP_MAX_ENTRY + 7) >> 3)
+// two level bitmap, a bit in summary is set when the data word it stands
+// for is full, so a free pid is found with one clz per level
+#define PIDMAP_MAX_ENTRY 4096
+#define PIDMAP_WORDS (PIDMAP_MAX_ENTRY >> 5)
+#define PIDMAP_SUMMARY_WORDS ((PIDMAP_WORDS + 31) >> 5)
 struct pidmap {
     int nr_free;
-    char data[PIDMAP_BYTE];
+    unsigned int summary[PIDMAP_SUMMARY_WORDS];
+    unsigned int data[PIDMAP_WORDS];
 };
 
 struct pid_namespace {
@@ -61,6 +65,8 @@ struct pid *get_pid_by_pid_val_ns(pid_t pid_val, struct pid_namespace *ns);
 
 struct task_struct* get_task_by_pid(struct pid *pid, enum pid_type type);
 
+struct task_struct* find_task_by_pid_ns(pid_t nr, struct pid_namespace* ns);
+
 unsigned int pid_hash_function(pid_t nr, struct pid_namespace* ns);
 
 bool pid_namespace_empty(struct pid_namespace* ns);
@@ -78,4 +84,6 @@ int assign_real_pid_from_ns(struct task_struct *task,
 
 int free_real_pid(struct task_struct *task);
 
+void pid_bench();
+
 #endif
\ No newline at end of file
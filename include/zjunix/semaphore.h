@@ -52,4 +52,10 @@ void customer_proc();
 // 生产者
 void producer_proc();
 
+
+// 乒乓测试，测量进程切换的开销
+void ping_proc();
+
+void pong_proc();
+
 #endif
@@ -0,0 +1,32 @@
+#ifndef _ZJUNIX_SHRINKER_H
+#define _ZJUNIX_SHRINKER_H
+
+#include <zjunix/list.h>
+
+// objects a shrinker is asked to release in one call
+#define SHRINK_BATCH 16
+
+/*
+ * a subsystem that can give memory back under pressure
+ * @shrink   : release up to nr_to_scan objects, returns how many it released,
+ *             0 tells the reclaim path there is nothing left to take
+ * @nr_freed : total returned by @shrink, printed by shrinker_info()
+ *
+ * ATTENTION: shrink may be called from inside any page allocation,
+ * 		it must not allocate memory itself
+ */
+struct shrinker {
+    const char *name;
+    unsigned int (*shrink)(unsigned int nr_to_scan);
+    unsigned int nr_freed;
+    struct list_head list;
+};
+
+// rounds of reclaim that actually ran the shrinkers
+extern unsigned int nr_reclaim;
+
+extern void register_shrinker(struct shrinker *shrinker);
+extern unsigned int reclaim_pages(unsigned int target);
+extern void shrinker_info();
+
+#endif
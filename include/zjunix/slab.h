@@ -9,14 +9,18 @@
 #define SLAB_USED 0xff
 
 /*
- * slab_head makes the allocation accessible from end_ptr to the end of the page
- * @end_ptr : points to the head of the rest of the page
- * @nr_objs : keeps the numbers of memory segments that has been allocated
+ * number of general caches behind kmalloc, and the biggest object
+ * they serve; anything bigger goes to the buddy system directly
  */
-struct slab_head {
-    void *end_ptr;
-    unsigned int nr_objs;
-};
+#define KMALLOC_CACHES 12
+#define KMALLOC_MAX_SIZE 2048
+
+/*
+ * colour range of the small general caches, their objects fill the page
+ * exactly and would get no colour from the space left at the end of a page
+ */
+#define KMALLOC_COLOUR_SIZE 256
+#define KMALLOC_COLOUR_RANGE 256
 
 /*
  * slab pages is chained in this struct
@@ -32,22 +36,89 @@ struct kmem_cache_node {
  * current being allocated page unit
  */
 struct kmem_cache_cpu {
-    void **freeobj;  // points to the free-space head addr inside current page
+    void **freeobj;  // points to the first free object inside current page
     struct page *page;
 };
 
+/*
+ * magazine: a small stack of free objects in front of the slab pages
+ * kmem_cache_alloc/free only touch the stack, it is refilled from and
+ * drained to the slab pages SLAB_MAG_BATCH objects at a time
+ * objects in the magazine still count as allocated in their page
+ */
+#define SLAB_MAG_SIZE 16
+#define SLAB_MAG_BATCH 8
+
+struct kmem_magazine {
+    unsigned int avail;
+    void *objs[SLAB_MAG_SIZE];
+};
+
+/*
+ * throughput counters of one cache
+ * @allocs/@frees  : objects handed out / taken back
+ * @refills/@drains: batches moved between the magazine and the slab pages
+ */
+struct kmem_cache_stats {
+    unsigned int allocs;
+    unsigned int frees;
+    unsigned int refills;
+    unsigned int drains;
+};
+
+typedef void (*kmem_ctor_fn)(void *obj);
+
+/*
+ * @size    : size of one object slot inside a slab page
+ * @objsize : size requested by the user (rounded up to SIZE_INT)
+ * @offset  : where the free-list pointer lives inside a free object
+ * @align   : alignment of every object
+ * @nr_pages: number of pages currently owned by this cache
+ * @colour  : number of colours, the objects of a new slab page start
+ *            colour_next * colour_off bytes into the page, so the hot
+ *            first objects of different pages fall into different cache sets
+ * @colour_off : distance between two colours, one L1 cache line
+ * @colour_next: colour of the next slab page, rotates through 0..colour-1
+ * @ctor    : called once for every object when its slab page is formatted
+ * @mag     : per-cache magazine, see struct kmem_magazine
+ * @stats   : alloc/free counters, printed by slab_info()
+ * @list    : links all caches together, for slab_info()
+ *
+ * ATTENTION: objects of a cache with ctor must be freed in the state
+ * 		the ctor left them in, kmem_cache_alloc() does not run it again
+ */
 struct kmem_cache {
     unsigned int size;
     unsigned int objsize;
     unsigned int offset;
+    unsigned int align;
+    unsigned int nr_pages;
+    unsigned int colour;
+    unsigned int colour_off;
+    unsigned int colour_next;
+    kmem_ctor_fn ctor;
     struct kmem_cache_node node;
     struct kmem_cache_cpu cpu;
+    struct kmem_magazine mag;
+    struct kmem_cache_stats stats;
+    struct list_head list;
     unsigned char name[16];
 };
 
-// extern struct kmem_cache kmalloc_caches[PAGE_SHIFT];
+extern struct kmem_cache kmalloc_caches[KMALLOC_CACHES];
 extern void init_slab();
 extern void *kmalloc(unsigned int size);
 extern void kfree(void *obj);
+extern struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+                                            unsigned int align,
+                                            kmem_ctor_fn ctor);
+extern void kmem_cache_set_colour(struct kmem_cache *cache,
+                                  unsigned int range);
+extern int kmem_cache_destroy(struct kmem_cache *cache);
+extern void *kmem_cache_alloc(struct kmem_cache *cache);
+extern void kmem_cache_free(struct kmem_cache *cache, void *obj);
+extern void slab_info();
+extern void slab_bench();
+extern void slab_colour_bench(const char *name, unsigned int size);
 
 #endif
@@ -24,6 +24,7 @@ void kernel_serial_puts(char* str);
 void kernel_serial_putc(char c);
 unsigned int is_bound(unsigned int val, unsigned int bound);
 void sleep(int cycle);
+void mem_bench();
 
 typedef unsigned char* va_list;
 #define _INTSIZEOF(n) \
@@ -3,6 +3,7 @@
 
 #include <zjunix/type.h>
 #include <zjunix/list.h>
+#include <zjunix/buddy.h>
 #include <zjunix/vfs/err.h>
 #include <driver/vga.h>
 
@@ -34,6 +35,7 @@ static char *quad5 = "                    ";
 // 文件系统类型
 #define PARTITION_TYPE_FAT32					0x0b
 #define PARTITION_TYPE_EXT2						0x83
+#define PARTITION_TYPE_SWAP						0x82
 #define FAT32_SUPER_MAGIC						0x4d44
 #define EXT2_SUPER_MAGIC						0xEF53
 
@@ -64,8 +66,6 @@ enum {LAST_NORM, LAST_ROOT, LAST_DOT, LAST_DOTDOT, LAST_BIND};
 #define FMODE_PREAD		                        0x8                     // 文件可用pread
 #define FMODE_PWRITE	                        0x10                    // 文件可用pwrite
 
-#define PAGE_SIZE                               (1 << PAGE_SHIFT)
-#define PAGE_SHIFT                              12
 #define PAGE_CACHE_SIZE                         PAGE_SIZE
 #define PAGE_CACHE_SHIFT                        PAGE_SHIFT
 #define PAGE_CACHE_MASK                         (~((1 << PAGE_SHIFT) - 1))
@@ -114,6 +114,7 @@ struct super_block;
 struct master_boot_record {
     u32                                 m_count;                        // 分区数
     u32                                 m_base[DPT_MAX_ENTRY_COUNT];    // 每个分区的基地址
+    u32                                 m_size[DPT_MAX_ENTRY_COUNT];    // 每个分区的扇区数
     u8                                  m_data[SECTOR_SIZE];            // 数据
 	u8 									m_type[DPT_MAX_ENTRY_COUNT];	// 分区类型
 };
@@ -6,8 +6,9 @@
 #define DCACHE_CAPACITY                 16
 #define DCACHE_HASHTABLE_SIZE           16
 
-#define PCACHE_CAPACITY                 64
-#define PCACHE_HASHTABLE_SIZE           16
+// 内存紧张时页缓存由回收路径收缩，容量可以设得较大
+#define PCACHE_CAPACITY                 512
+#define PCACHE_HASHTABLE_SIZE           64
 
 #define P_CLEAR                         0
 #define P_DIRTY                         1
@@ -21,6 +22,8 @@ struct vfs_page {
     struct list_head            p_LRU;                      // LRU链表
     struct list_head            p_list;                     // 同一文件已缓冲页的链表
     struct address_space        *p_mapping;                 // 所属的address_space结构
+    u32                         p_mapcount;                 // 被 mmap 映射到进程中的页数，非0时不被换出
+    u32                         p_count;                    // 正在使用该页的调用者数，非0时不被换出
 };
 
 // 缓存
@@ -52,6 +55,11 @@ struct cache_operations {
     void (*write_back)(void*);
 };
 
+// 对象的专用 slab 缓存
+extern struct kmem_cache * dentry_cachep;
+extern struct kmem_cache * inode_cachep;
+extern struct kmem_cache * vfspage_cachep;
+
 // 下面是函数声明
 // vfscache.c
 u32 init_cache();
@@ -62,12 +70,15 @@ u32 cache_is_full(struct cache *);
 void* dcache_look_up(struct cache *, struct condition *);
 void dcache_add(struct cache *, void *);
 void dcache_put_LRU(struct cache *);
+unsigned int dcache_shrink(unsigned int);
 
 // pcache.c
 struct vfs_page * pcache_get_page(struct cache * pcache, struct inode * inode, u32 page_no);
 void* pcache_look_up(struct cache *, struct condition *);
 void pcache_add(struct cache *, void *);
-void pcache_put_LRU(struct cache *);
+u32 pcache_put_LRU(struct cache *);
+void pcache_put_page(struct vfs_page *);
+unsigned int pcache_shrink(unsigned int);
 void pcache_write_back(void *);
 
 struct dentry * dget(struct dentry *);
@@ -11,9 +11,20 @@ struct _memory_block_struct {
     unsigned int chunk_size;
     void* head;
     memory_block_struct* next_memory_block;
+    // 大片内存链表是双向的，释放时直接摘除
+    memory_block_struct* prev_memory_block;
 };
 
 
+// 低地址区（程序映像、栈与按需分配的零页）的上界
+#define VMA_LOW_END 0x10000
+
+
+// mmap 的权限
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+
+
 // 初始化虚拟内存地址机制
 void init_vm();
 
@@ -30,15 +41,28 @@ void vm_delete(task_struct* pcb);
 void vm_print(void* vm);
 
 
+// fork 时复制地址空间，除内存池外的页都以写时复制的方式共享
+int vm_fork(task_struct* parent, task_struct* child);
+
+
 // 设置当前活动ASID，以匹配TLB表项中的ASID
 void set_active_asid(unsigned int asid);
 
 
-// 创建共享页，返回虚拟地址
-void* shared_page_create(task_struct* pcb, const char* name);
+// 切换到进程的地址空间，必要时为其分配新的 ASID
+void vm_activate(task_struct* pcb);
+
+
+// 打印 ASID 分配与 TLB 清空的统计
+void tlb_stat();
+
 
+// 创建或映射共享内存区，size 为0时为一页，返回虚拟地址
+void* shared_page_create(task_struct* pcb, const char* name,
+                         unsigned int size);
 
-// 删除共享页
+
+// 解除共享内存区的映射
 int shared_page_delete(task_struct* pcb, void* virtual_addr);
 
 
@@ -58,6 +82,19 @@ void* memory_alloc(task_struct* pcb, unsigned int size);
 int memory_free(task_struct* pcb, void* virtual_addr);
 
 
+// 为进程建立区域树，并保留低地址区
+void vma_init(task_struct* pcb);
+
+
+// 把文件映射到进程中，返回映射的虚拟地址
+void* vm_mmap(task_struct* pcb, const char* filename, unsigned int offset,
+              unsigned int length, unsigned int prot);
+
+
+// 解除文件映射
+int vm_munmap(task_struct* pcb, void* virtual_addr);
+
+
 // 虚拟内存地址测试程序
 void vma_proc();
 
@@ -74,6 +111,42 @@ void page_share_proc_2();
 void buffer_proc();
 
 
+// fork 与写时复制的测试程序
+void fork_proc();
+
+
+// TLB 抖动测试程序，测量 TLB Refill 的开销
+void tlb_thrash_proc();
+
+
+// 用户堆分配测试程序，测量逐次 malloc 的开销
+void vma_bench_proc();
+
+
+// 初始化交换机制，使用交换分区
+void init_swap();
+
+
+// 启用 RAM 盘作为交换设备，已有交换设备时返回1
+int swap_ramdisk_on();
+
+
+// 打印交换设备的使用情况与换入换出的统计
+void swap_stat();
+
+
+// 共享内存区测试程序，映射同一个 1MB 的区两次并校验
+void share_bench_proc();
+
+
+// 交换测试程序，换出低地址区的页后读回校验
+void swap_test_proc();
+
+
+// 文件映射测试程序，参数为文件名
+void mmap_proc(unsigned int argc, void* args);
+
+
 // 根据虚拟地址，查页表获取对应的物理地址
 void* vma_va_to_pa(task_struct* pcb, void* virtual_addr);
 
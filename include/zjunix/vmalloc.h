@@ -0,0 +1,42 @@
+#ifndef _ZJUNIX_VMALLOC_H
+#define _ZJUNIX_VMALLOC_H
+
+#include <zjunix/list.h>
+
+/*
+ * vmalloc window inside kseg2, mapped through the TLB with global entries
+ * every page of the window has one slot in a flat kernel page table,
+ * which keeps the kseg0 address of the page (like the user PTEs in vm.c)
+ *
+ * ATTENTION: the TLB is filled on demand, so vmalloc memory must not be
+ * 		touched inside exception/interrupt handlers (EXL is set there and
+ * 		a nested TLB miss can not return)
+ */
+#define VMALLOC_START 0xC0000000
+#define VMALLOC_SIZE (16 * 1024 * 1024)
+#define VMALLOC_END (VMALLOC_START + VMALLOC_SIZE)
+
+#define is_vmalloc_addr(addr) \
+    ((unsigned int)(addr) >= VMALLOC_START && (unsigned int)(addr) < VMALLOC_END)
+
+/*
+ * one allocated range of the window, the list is sorted by address
+ * @size : bytes of the range, including the unmapped guard page at its end
+ */
+struct vm_struct {
+    unsigned int addr;
+    unsigned int size;
+    unsigned int nr_pages;
+    struct list_head list;
+};
+
+extern void init_vmalloc();
+extern void *vmalloc(unsigned int size);
+extern void vfree(void *addr);
+extern void vunmap(void *addr);
+extern void *vmalloc_to_kaddr(void *addr);
+extern void vmalloc_fault(void *addr);
+extern void vmalloc_info();
+extern void vmalloc_test();
+
+#endif
@@ -14,6 +14,7 @@
 #include <zjunix/syscall.h>
 #include <zjunix/time.h>
 #include <zjunix/vm.h>
+#include <zjunix/vmalloc.h>
 #include "../usr/ps.h"
 #include <zjunix/vfs/vfs.h>
 #pragma GCC push_options
@@ -53,6 +54,7 @@ void create_startup_process() {
 #pragma GCC pop_options
 
 void init_kernel() {
+    unsigned int stage_start;
     kernel_clear_screen(31);
     // Exception
     init_exception();
@@ -61,20 +63,28 @@ void init_kernel() {
     // Drivers
     init_vga();
     init_ps2();
-    // Virtual Memory
-    init_vm();
     // Memory management
+    // each stage is timed with CP0 Count, the timer is not running yet
     log(LOG_START, "Memory Modules.");
+    stage_start = get_cp0_count();
     init_bootmm();
-    log(LOG_OK, "Bootmem.");
+    log(LOG_OK, "Bootmem. (%d cycles)", get_cp0_count() - stage_start);
+    stage_start = get_cp0_count();
     init_buddy();
-    log(LOG_OK, "Buddy.");
+    log(LOG_OK, "Buddy. (%d cycles)", get_cp0_count() - stage_start);
+    stage_start = get_cp0_count();
     init_slab();
-    log(LOG_OK, "Slab.");
+    log(LOG_OK, "Slab. (%d cycles)", get_cp0_count() - stage_start);
+    init_vmalloc();
+    log(LOG_OK, "Vmalloc.");
     log(LOG_END, "Memory Modules.");
+    // Virtual Memory, needs slab for its caches
+    init_vm();
     // File system
     log(LOG_START, "File System.");
     init_vfs();
+    // Swap, looks for its partition in the MBR read by init_vfs
+    init_swap();
     log(LOG_END, "File System.");
     // System call
     log(LOG_START, "System Calls.");
@@ -17,7 +17,6 @@ void set_mminfo(struct bootmm_info *info, unsigned int start, unsigned int end,
     info->end = end;
     info->type = type;
 }
-unsigned char bootmmmap[MACHINE_MMSIZE >> PAGE_SHIFT];
 /*
 * return value list:
 *		0 -> insert_mminfo failed
@@ -113,35 +112,59 @@ void remove_mminfo(struct bootmm *mm, unsigned int index) {
     mm->cnt_infos--;
 }
 
+// the kernel image and its stack take everything below KERNEL_STACK_BOTTOM,
+// the bitmap is put right above them and sized from the probed memory
 void init_bootmm() {
-    unsigned int index;
-    unsigned char *t_map;
-    unsigned int end;
-    end = 16 * 1024 * 1024;
+    unsigned int end, map_size;
+
     kernel_memset(&bmm, 0, sizeof(bmm));
     bmm.phymm = get_phymm_size();
     bmm.max_pfn = bmm.phymm >> PAGE_SHIFT;
-    bmm.s_map = bootmmmap;
-    bmm.e_map = bootmmmap + sizeof(bootmmmap);
+    end = KERNEL_STACK_BOTTOM - KERNEL_ENTRY;
+    map_size = ((bmm.max_pfn + 31) >> 5) * sizeof(unsigned int);
+    map_size = (map_size + (1 << PAGE_SHIFT) - 1) & PAGE_ALIGN;
+    bmm.s_map = (unsigned int *)(end | KERNEL_ENTRY);
+    bmm.e_map = bmm.s_map + (map_size >> 2);
     bmm.cnt_infos = 0;
-    kernel_memset(bmm.s_map, PAGE_FREE, sizeof(bootmmmap));
+    kernel_memset(bmm.s_map, PAGE_FREE, map_size);
     insert_mminfo(&bmm, 0, (unsigned int)(end - 1), _MM_KERNEL);
-    bmm.last_alloc_end = (((unsigned int)(end) >> PAGE_SHIFT) - 1);
+    insert_mminfo(&bmm, end, end + map_size - 1, _MM_MMMAP);
+    set_maps(0, (end + map_size) >> PAGE_SHIFT, PAGE_USED);
+    bmm.last_alloc_end = ((end + map_size) >> PAGE_SHIFT) - 1;
+}
 
-    for (index = 0; index<end>> PAGE_SHIFT; index++) {
-        bmm.s_map[index] = PAGE_USED;
-    }
+static inline unsigned int test_map(unsigned int pfn) {
+    return (bmm.s_map[pfn >> 5] >> (pfn & 31)) & 1;
 }
 
 /*
  * set value of page-bitmap-indicator
  * @param s_pfn	: page frame start node
  * @param cnt	: the number of pages to be set
- * @param value	: the value to be set
+ * @param value	: PAGE_USED or PAGE_FREE
  */
 void set_maps(unsigned int s_pfn, unsigned int cnt, unsigned char value) {
+    unsigned int word = value ? 0xffffffff : 0;
+
+    while (cnt && (s_pfn & 31)) {
+        if (value)
+            bmm.s_map[s_pfn >> 5] |= 1 << (s_pfn & 31);
+        else
+            bmm.s_map[s_pfn >> 5] &= ~(1 << (s_pfn & 31));
+        --cnt;
+        ++s_pfn;
+    }
+    // whole words at once in the middle
+    if (cnt >= 32) {
+        kernel_memset_word(bmm.s_map + (s_pfn >> 5), word, cnt >> 5);
+        s_pfn += cnt & ~31;
+        cnt &= 31;
+    }
     while (cnt) {
-        bmm.s_map[s_pfn] = (unsigned char)value;
+        if (value)
+            bmm.s_map[s_pfn >> 5] |= 1 << (s_pfn & 31);
+        else
+            bmm.s_map[s_pfn >> 5] &= ~(1 << (s_pfn & 31));
         --cnt;
         ++s_pfn;
     }
@@ -157,38 +180,31 @@ void set_maps(unsigned int s_pfn, unsigned int cnt, unsigned char value) {
 unsigned char *find_pages(unsigned int page_cnt, unsigned int s_pfn,
                           unsigned int e_pfn) {
     unsigned int index, tmp;
-    unsigned int cnt;
 
     for (index = s_pfn; index < e_pfn;) {
-        if (bmm.s_map[index] == PAGE_USED) {
+        // skip 32 used frames at a time
+        if (!(index & 31) && bmm.s_map[index >> 5] == 0xffffffff) {
+            index += 32;
+            continue;
+        }
+        if (test_map(index)) {
             index++;
             continue;
         }
 
-        cnt = page_cnt;
         tmp = index;
-        while (cnt) {
-            if (tmp >= e_pfn) return 0;
-            // reaching end, but allocate request still cannot be satisfied
-
-            if (bmm.s_map[tmp] == PAGE_FREE) {
-                tmp++;  // find next possible free page
-                cnt--;
-            }
-            if (bmm.s_map[tmp] == PAGE_USED) {
-                break;
-            }
+        while (tmp < e_pfn && tmp - index < page_cnt && !test_map(tmp)) {
+            tmp++;
         }
-        if (cnt ==
-            0) {  // cnt = 0 indicates that the specified page-sequence found
+        if (tmp - index == page_cnt) {
+            // the specified page-sequence found
             bmm.last_alloc_end = tmp - 1;
             set_maps(index, page_cnt, PAGE_USED);
             return (unsigned char *)(index << PAGE_SHIFT);
-        } else {
-            index = tmp;
-            // there will be no possible memory space
-            // to be allocated before tmp
         }
+        // there will be no possible memory space
+        // to be allocated before tmp
+        index = tmp;
     }
     return 0;
 }
@@ -223,6 +239,7 @@ unsigned char *bootmm_alloc_pages(unsigned int size, unsigned int type) {
 void bootmap_info(unsigned char *msg) {
     unsigned int index;
     kernel_printf("%s :\n", msg);
+    kernel_printf("\tphysical memory : %x (%d frames)\n", bmm.phymm, bmm.max_pfn);
     for (index = 0; index < bmm.cnt_infos; ++index) {
         kernel_printf("\t%x-%x : %s\n", bmm.info[index].start,
                       bmm.info[index].end, mem_msg[bmm.info[index].type]);
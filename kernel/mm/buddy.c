@@ -1,8 +1,11 @@
+#include <arch.h>
 #include <driver/vga.h>
+#include <intr.h>
 #include <zjunix/bootmm.h>
 #include <zjunix/buddy.h>
 #include <zjunix/list.h>
 #include <zjunix/lock.h>
+#include <zjunix/shrinker.h>
 #include <zjunix/utils.h>
 
 struct page *pages;
@@ -24,6 +27,16 @@ void buddy_info() {
     }
 }
 
+// count the free page frames in all freelists
+unsigned int buddy_free_pages() {
+    unsigned int index;
+    unsigned int nr = 0;
+    for (index = 0; index <= MAX_BUDDY_ORDER; ++index) {
+        nr += buddy.freelist[index].nr_free << index;
+    }
+    return nr;
+}
+
 // this function is to init all memory with page struct
 void init_pages(unsigned int start_pfn, unsigned int end_pfn) {
     unsigned int i;
@@ -37,6 +50,68 @@ void init_pages(unsigned int start_pfn, unsigned int end_pfn) {
     }
 }
 
+// toggle bit nr of map, return its old value
+static inline unsigned int test_and_change_bit(unsigned int nr,
+                                               unsigned int *map) {
+    unsigned int mask = 1 << (nr & 31);
+    unsigned int old = map[nr >> 5] & mask;
+    map[nr >> 5] ^= mask;
+    return old;
+}
+
+// allocate the pair bitmaps of every order below MAX_BUDDY_ORDER
+static void init_buddy_maps(unsigned int nr_pages) {
+    unsigned int i;
+    unsigned int words[MAX_BUDDY_ORDER];
+    unsigned int total = 0;
+    unsigned int *map;
+
+    for (i = 0; i < MAX_BUDDY_ORDER; i++) {
+        // the tail pair may be half beyond nr_pages, so count it too
+        words[i] = ((nr_pages >> (i + 1)) + 32) >> 5;
+        total += words[i];
+    }
+    map = (unsigned int *)((unsigned int)bootmm_alloc_pages(
+                               total * sizeof(unsigned int), _MM_KERNEL) |
+                           0x80000000);
+    // all pages start as allocated, so every pair is "both used"
+    kernel_memset(map, 0, total * sizeof(unsigned int));
+    for (i = 0; i < MAX_BUDDY_ORDER; i++) {
+        buddy.freelist[i].map = map;
+        map += words[i];
+    }
+    buddy.freelist[MAX_BUDDY_ORDER].map = 0;
+}
+
+// put the free frames [start_pfn, end_pfn) straight into the freelists
+// as naturally aligned blocks of the biggest order that fits, instead of
+// freeing them one by one and coalescing upward
+// each block is the biggest one that is aligned and still ends by end_pfn,
+// so two free blocks of the same order are never buddies
+static void seed_buddy(unsigned int start_pfn, unsigned int end_pfn) {
+    unsigned int page_idx = start_pfn - buddy.buddy_start_pfn;
+    unsigned int end_idx = end_pfn - buddy.buddy_start_pfn;
+    unsigned int order;
+    struct page *page;
+
+    while (page_idx < end_idx) {
+        order = MAX_BUDDY_ORDER;
+        while ((page_idx & ((1 << order) - 1)) ||
+               page_idx + (1 << order) > end_idx) {
+            --order;
+        }
+        page = buddy.start_page + page_idx;
+        set_bplevel(page, order);
+        set_flag(page, _PAGE_FREE);
+        list_add_tail(&(page->list), &(buddy.freelist[order].free_head));
+        ++buddy.freelist[order].nr_free;
+        if (order < MAX_BUDDY_ORDER)
+            test_and_change_bit(page_idx >> (order + 1),
+                                buddy.freelist[order].map);
+        page_idx += 1 << order;
+    }
+}
+
 void init_buddy() {
     unsigned int i;
     unsigned int kernel_start_pfn, kernel_end_pfn;
@@ -46,6 +121,7 @@ void init_buddy() {
                             0x80000000);
 
     init_pages(0, bmm.max_pfn);
+    init_buddy_maps(bmm.max_pfn);
 
     kernel_start_pfn = 0;
     kernel_end_pfn = 0;
@@ -53,11 +129,13 @@ void init_buddy() {
         if (bmm.info[i].end > kernel_end_pfn) kernel_end_pfn = bmm.info[i].end;
     }
     kernel_end_pfn >>= PAGE_SHIFT;
-    buddy.buddy_start_pfn = kernel_end_pfn + 1;
-    buddy.buddy_start_pfn += (1 << MAX_BUDDY_ORDER) - 1;
-    buddy.buddy_start_pfn &= ~((1 << MAX_BUDDY_ORDER) - 1);
-    buddy.buddy_end_pfn =
-        bmm.max_pfn & ~((1 << MAX_BUDDY_ORDER) - 1);  // remain 2 pages for I/O
+    // the buddy index base is aligned down to the max order,
+    // the frames between it and the kernel end just stay reserved
+    kernel_start_pfn = kernel_end_pfn + 1;
+    buddy.buddy_start_pfn = kernel_start_pfn & ~((1 << MAX_BUDDY_ORDER) - 1);
+    // every frame up to the probed end, a block at the tail whose buddy
+    // lies past the end simply never coalesces
+    buddy.buddy_end_pfn = bmm.max_pfn;
 
     // init freelists of all bplevels
     for (i = 0; i <= MAX_BUDDY_ORDER; i++) {
@@ -67,9 +145,9 @@ void init_buddy() {
     buddy.start_page = pages + buddy.buddy_start_pfn;
     init_lock(&(buddy.lock));
 
-    for (i = buddy.buddy_start_pfn; i < buddy.buddy_end_pfn; ++i) {
-        __free_pages(pages + i, 0);
-    }
+    seed_buddy(kernel_start_pfn, buddy.buddy_end_pfn);
+    buddy.pages_low = buddy_free_pages() >> 6;
+    buddy.pages_high = buddy_free_pages() >> 5;
 }
 
 void __free_pages(struct page *pbpage, unsigned int bplevel) {
@@ -79,37 +157,36 @@ void __free_pages(struct page *pbpage, unsigned int bplevel) {
     if (pbpage->flag == _PAGE_FREE) {
         return;
     }
+    // a block shared by copy-on-write only drops one reference
+    if (pbpage->reference > 1) {
+        dec_ref(pbpage, 1);
+        return;
+    }
+    set_ref(pbpage, 0);
     set_flag(pbpage, _PAGE_FREE);
     unsigned int page_idx, bgroup_idx;
-    unsigned int combined_idx, tmp;
     struct page *bgroup_page;
 
-    // dec_ref(pbpage, 1);
-    // if(pbpage->reference)
-    //	return;
-
     lockup(&buddy.lock);
 
     page_idx = pbpage - buddy.start_page;
     // complier do the sizeof(struct) operation, and now page_idx is the index
 
     while (bplevel < MAX_BUDDY_ORDER) {
-        bgroup_idx = page_idx ^ (1 << bplevel);
-        bgroup_page = pbpage + (bgroup_idx - page_idx);
-        if (bgroup_page->flag != _PAGE_FREE) {
-            break;  // Its pair has been allocated or reserved
-        }
-        if (!_is_same_bplevel(bgroup_page, bplevel)) {
+        // the pair bit was 0 if its buddy is in use, nothing to combine
+        if (!test_and_change_bit(page_idx >> (bplevel + 1),
+                                 buddy.freelist[bplevel].map)) {
             break;
         }
+        bgroup_idx = page_idx ^ (1 << bplevel);
+        bgroup_page = buddy.start_page + bgroup_idx;
         list_del_init(&bgroup_page->list);
         --buddy.freelist[bplevel].nr_free;
         set_bplevel(bgroup_page, -1);
-        combined_idx = bgroup_idx & page_idx;
-        pbpage += (combined_idx - page_idx);
-        page_idx = combined_idx;
+        page_idx &= ~(1 << bplevel);
         ++bplevel;
     }
+    pbpage = buddy.start_page + page_idx;
     set_bplevel(pbpage, bplevel);
     set_flag(pbpage, _PAGE_FREE);
     list_add(&(pbpage->list), &(buddy.freelist[bplevel].free_head));
@@ -117,8 +194,10 @@ void __free_pages(struct page *pbpage, unsigned int bplevel) {
     unlock(&buddy.lock);
 }
 
-struct page *__alloc_pages(unsigned int bplevel) {
+// take a block of (bplevel) straight from the freelists, no reclaim
+static struct page *buddy_rmqueue(unsigned int bplevel) {
     unsigned int current_order, size;
+    unsigned int page_idx;
     struct page *page, *buddy_page;
     struct freelist *free;
 
@@ -138,9 +217,14 @@ found:
     list_del_init(&(page->list));
     set_bplevel(page, bplevel);
     set_flag(page, _PAGE_ALLOCED);
-    // set_ref(page, 1);
+    set_ref(page, 1);
     --(free->nr_free);
 
+    page_idx = page - buddy.start_page;
+    if (current_order < MAX_BUDDY_ORDER)
+        test_and_change_bit(page_idx >> (current_order + 1), free->map);
+
+    // hand the upper halves back to the lower freelists
     size = 1 << current_order;
     while (current_order > bplevel) {
         --free;
@@ -150,12 +234,31 @@ found:
         list_add(&(buddy_page->list), &(free->free_head));
         ++(free->nr_free);
         set_bplevel(buddy_page, current_order);
+        set_flag(buddy_page, _PAGE_FREE);
+        test_and_change_bit(page_idx >> (current_order + 1), free->map);
     }
 
     unlock(&buddy.lock);
     return page;
 }
 
+// when the free frames drop below pages_low the shrinkers are run
+// until they are above pages_high, and once more if the freelists
+// could not serve the request at all
+struct page *__alloc_pages(unsigned int bplevel) {
+    struct page *page;
+
+    page = buddy_rmqueue(bplevel);
+    if (!page) {
+        reclaim_pages(buddy.pages_high);
+        return buddy_rmqueue(bplevel);
+    }
+    if (buddy_free_pages() < buddy.pages_low) {
+        reclaim_pages(buddy.pages_high);
+    }
+    return page;
+}
+
 void *alloc_pages(unsigned int bplevel) {
     struct page *page = __alloc_pages(bplevel);
 
@@ -166,4 +269,61 @@ void *alloc_pages(unsigned int bplevel) {
 
 void free_pages(void *addr, unsigned int bplevel) {
     __free_pages(pages + ((unsigned int)addr >> PAGE_SHIFT), bplevel);
-}
\ No newline at end of file
+}
+
+#define BUDDY_BENCH_BLOCKS 64
+#define BUDDY_BENCH_ROUNDS 16
+
+// alloc/free storm at mixed orders, cycles are read from CP0 Count
+// interrupts stay off while timing, since the timer tick clears Count
+// pages_low is 0 for the run so that no allocation reclaims on the way,
+// reclaim still runs when the freelists are empty and is reported then
+void buddy_bench() {
+    static unsigned int bench_order[16] = {0, 1, 0, 2, 0, 3, 1, 0,
+                                           4, 0, 2, 6, 0, 1, 0, 8};
+    struct page *blocks[BUDDY_BENCH_BLOCKS];
+    unsigned int round, i;
+    unsigned int start, alloc_cycles = 0, free_cycles = 0;
+    unsigned int nr_alloc = 0, nr_free = 0, failed = 0;
+    unsigned int old_ie, pages_low, reclaims;
+
+    pages_low = buddy.pages_low;
+    buddy.pages_low = 0;
+    reclaims = nr_reclaim;
+    for (round = 0; round < BUDDY_BENCH_ROUNDS; round++) {
+        old_ie = disable_interrupts();
+        start = get_cp0_count();
+        for (i = 0; i < BUDDY_BENCH_BLOCKS; i++) {
+            blocks[i] = __alloc_pages(bench_order[(i + round) & 15]);
+        }
+        alloc_cycles += get_cp0_count() - start;
+        nr_alloc += BUDDY_BENCH_BLOCKS;
+
+        // free the odd blocks first, then the even ones coalesce with them
+        start = get_cp0_count();
+        for (i = 1; i < BUDDY_BENCH_BLOCKS; i += 2) {
+            if (blocks[i]) __free_pages(blocks[i], bench_order[(i + round) & 15]);
+        }
+        for (i = 0; i < BUDDY_BENCH_BLOCKS; i += 2) {
+            if (blocks[i]) __free_pages(blocks[i], bench_order[(i + round) & 15]);
+        }
+        free_cycles += get_cp0_count() - start;
+        if (old_ie) {
+            enable_interrupts();
+        }
+        for (i = 0; i < BUDDY_BENCH_BLOCKS; i++) {
+            if (blocks[i])
+                nr_free++;
+            else
+                failed++;
+        }
+    }
+    buddy.pages_low = pages_low;
+    kernel_printf("buddy bench: %d allocs, %d failed\n", nr_alloc, failed);
+    if (nr_reclaim != reclaims)
+        kernel_printf("\treclaim ran %d times, included in alloc\n",
+                      nr_reclaim - reclaims);
+    kernel_printf("\talloc : %d cycles/op\n", alloc_cycles / nr_alloc);
+    if (nr_free) kernel_printf("\tfree  : %d cycles/op\n", free_cycles / nr_free);
+    buddy_info();
+}
@@ -0,0 +1,54 @@
+#include <driver/vga.h>
+#include <zjunix/buddy.h>
+#include <zjunix/shrinker.h>
+
+static LIST_HEAD(shrinkers);
+
+// set while the shrinkers run, an allocation made by one of them
+// must not start another round of reclaim
+static int reclaiming;
+
+unsigned int nr_reclaim;
+
+void register_shrinker(struct shrinker *shrinker) {
+    shrinker->nr_freed = 0;
+    list_add_tail(&(shrinker->list), &shrinkers);
+}
+
+// call every shrinker in turn until (target) page frames are free,
+// or a whole round released nothing, returns the free page frames
+unsigned int reclaim_pages(unsigned int target) {
+    struct list_head *pos;
+    struct shrinker *shrinker;
+    unsigned int progress, nr, free;
+
+    free = buddy_free_pages();
+    if (reclaiming) return free;
+    reclaiming = 1;
+    if (free < target) ++nr_reclaim;
+    while (free < target) {
+        progress = 0;
+        list_for_each(pos, &shrinkers) {
+            shrinker = container_of(pos, struct shrinker, list);
+            nr = shrinker->shrink(SHRINK_BATCH);
+            shrinker->nr_freed += nr;
+            progress += nr;
+        }
+        free = buddy_free_pages();
+        if (!progress) break;
+    }
+    reclaiming = 0;
+    return free;
+}
+
+void shrinker_info() {
+    struct list_head *pos;
+    struct shrinker *shrinker;
+
+    kernel_printf("Reclaim : %d free pages, low %d, high %d\n",
+                  buddy_free_pages(), buddy.pages_low, buddy.pages_high);
+    list_for_each(pos, &shrinkers) {
+        shrinker = container_of(pos, struct shrinker, list);
+        kernel_printf("\t%s : %d freed\n", shrinker->name, shrinker->nr_freed);
+    }
+}
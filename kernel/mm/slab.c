@@ -1,20 +1,30 @@
 #include <arch.h>
 #include <driver/vga.h>
+#include <intr.h>
+#include <zjunix/shrinker.h>
 #include <zjunix/slab.h>
 #include <zjunix/utils.h>
 
 #define KMEM_ADDR(PAGE, BASE) ((((PAGE) - (BASE)) << PAGE_SHIFT) | 0x80000000)
 
 /*
- * one list of PAGE_SHIFT(now it's 12) possbile memory size
- * 96, 192, 8, 16, 32, 64, 128, 256, 512, 1024, (2 undefined)
- * in current stage, set (2 undefined) to be (4, 2048)
+ * one list of KMALLOC_CACHES possbile memory size
+ * 96, 192, 8, 16, 32, 64, 128, 256, 512, 1024, 1536, 2048
  */
-struct kmem_cache kmalloc_caches[PAGE_SHIFT];
+struct kmem_cache kmalloc_caches[KMALLOC_CACHES];
 
-static unsigned int size_kmem_cache[PAGE_SHIFT] = {
+static unsigned int size_kmem_cache[KMALLOC_CACHES] = {
     96, 192, 8, 16, 32, 64, 128, 256, 512, 1024, 1536, 2048};
 
+/*
+ * constant-time size -> cache index lookup
+ * sizes up to 256 are looked up in 8-byte steps: size_index_small[(size - 1) >> 3]
+ * sizes above 256 in 256-byte steps: size_index_large[(size - 1) >> 8]
+ * both tables are filled from size_kmem_cache[] in init_slab()
+ */
+static unsigned char size_index_small[256 >> 3];
+static unsigned char size_index_large[KMALLOC_MAX_SIZE >> 8];
+
 // init the struct kmem_cache_cpu
 void init_kmem_cpu(struct kmem_cache_cpu *kcpu) {
     kcpu->page = 0;
@@ -27,27 +37,106 @@ void init_kmem_node(struct kmem_cache_node *knode) {
     INIT_LIST_HEAD(&(knode->partial));
 }
 
-void init_each_slab(struct kmem_cache *cache, unsigned int size) {
+// all caches, the general ones first
+static struct list_head slab_caches;
+
+// L1 data cache line size, the step between two slab colours
+static unsigned int slab_line_size = 32;
+
+// read the data cache line size from Config1.DL, 0 when it is unknown
+static unsigned int read_dcache_line_size() {
+    unsigned int config, config1;
+    asm volatile("mfc0 %0, $16, 0\n\t" : "=r"(config));
+    // Config.M tells whether Config1 is implemented
+    if (!(config & 0x80000000)) return 0;
+    asm volatile("mfc0 %0, $16, 1\n\t" : "=r"(config1));
+    config1 = (config1 >> 10) & 7;
+    if (config1 == 0 || config1 == 7) return 0;
+    return 2 << config1;
+}
+
+// hands the magazines and empty pages back under pressure, see slab_shrink()
+static struct shrinker slab_shrinker;
+
+void init_each_slab(struct kmem_cache *cache, const char *name,
+                    unsigned int size, unsigned int align, kmem_ctor_fn ctor) {
+    unsigned int i;
+
+    if (align < SIZE_INT) align = SIZE_INT;
     cache->objsize = size;
     cache->objsize += (SIZE_INT - 1);
     cache->objsize &= ~(SIZE_INT - 1);
-    cache->size =
-        cache->objsize + sizeof(void *);  // add one char as mark(available)
-    cache->offset = cache->size;
+    if (ctor) {
+        // keep the next-free pointer behind the object,
+        // so it does not destroy what the ctor has built
+        cache->offset = cache->objsize;
+        cache->size = cache->objsize + sizeof(void *);
+    } else {
+        // a free object keeps the next-free pointer in its first word
+        cache->offset = 0;
+        cache->size = cache->objsize;
+    }
+    cache->size = UPPER_ALLIGN(cache->size, align);
+    cache->align = align;
+    cache->nr_pages = 0;
+    // by default only the space left at the end of a page is used
+    cache->colour_off = slab_line_size > align ? slab_line_size : align;
+    kmem_cache_set_colour(cache, (1 << PAGE_SHIFT) % cache->size);
+    cache->ctor = ctor;
+    for (i = 0; name[i] && i < sizeof(cache->name) - 1; i++) {
+        cache->name[i] = name[i];
+    }
+    cache->name[i] = 0;
     init_kmem_cpu(&(cache->cpu));
     init_kmem_node(&(cache->node));
+    kernel_memset(&(cache->mag), 0, sizeof(cache->mag));
+    kernel_memset(&(cache->stats), 0, sizeof(cache->stats));
+    list_add_tail(&(cache->list), &slab_caches);
+}
+
+// find the best-fit slab system for (size)
+// only used to build the lookup tables at boot
+static unsigned int get_slab(unsigned int size) {
+    unsigned int i;
+    unsigned int bf_num = KMALLOC_MAX_SIZE + 1;
+    unsigned int bf_index = KMALLOC_CACHES;  // record the best fit num & index
+
+    for (i = 0; i < KMALLOC_CACHES; i++) {
+        if ((kmalloc_caches[i].objsize >= size) &&
+            (kmalloc_caches[i].objsize < bf_num)) {
+            bf_num = kmalloc_caches[i].objsize;
+            bf_index = i;
+        }
+    }
+    return bf_index;
 }
 
 void init_slab() {
     unsigned int i;
 
-    for (i = 0; i < PAGE_SHIFT; i++) {
-        init_each_slab(&(kmalloc_caches[i]), size_kmem_cache[i]);
+    INIT_LIST_HEAD(&slab_caches);
+    i = read_dcache_line_size();
+    if (i >= SIZE_INT) slab_line_size = i;
+    for (i = 0; i < KMALLOC_CACHES; i++) {
+        init_each_slab(&(kmalloc_caches[i]), "kmalloc", size_kmem_cache[i],
+                       SIZE_INT, 0);
+        // the power-of-two sizes leave nothing at the end of a page,
+        // colouring them costs at most one object on a coloured page
+        if (size_kmem_cache[i] <= KMALLOC_COLOUR_SIZE)
+            kmem_cache_set_colour(&(kmalloc_caches[i]), KMALLOC_COLOUR_RANGE);
     }
+    // the largest size inside each step decides its cache
+    for (i = 0; i < sizeof(size_index_small); i++) {
+        size_index_small[i] = get_slab((i + 1) << 3);
+    }
+    for (i = 0; i < sizeof(size_index_large); i++) {
+        size_index_large[i] = get_slab((i + 1) << 8);
+    }
+    register_shrinker(&slab_shrinker);
 #ifdef SLAB_DEBUG
     kernel_printf("Setup Slub ok :\n");
     kernel_printf("\tcurrent slab cache size list:\n\t");
-    for (i = 0; i < PAGE_SHIFT; i++) {
+    for (i = 0; i < KMALLOC_CACHES; i++) {
         kernel_printf("%x %x ", kmalloc_caches[i].objsize,
                       (unsigned int)(&(kmalloc_caches[i])));
     }
@@ -56,168 +145,471 @@ void init_slab() {
 }
 
 // ATTENTION: sl_objs is the reuse of bplevel
-// ATTENTION: slabp must be set right to add itself to reach the end of the page
-// 		e.g. if size = 96 then 4096 / 96 = .. .. 64 then slabp starts at
-// 64
+// ATTENTION: slabp keeps the free list of a page that is not cpu.page,
+// 		it is 0 when every object of the page is allocated
+// ATTENTION: the objects start at the colour of the page, a page whose colour
+// eats into the last object holds one object less
 void format_slabpage(struct kmem_cache *cache, struct page *page) {
-    unsigned char *moffset =
-        (unsigned char *)KMEM_ADDR(page, pages);  // physical addr
-    struct slab_head *s_head = (struct slab_head *)moffset;
-    unsigned int *ptr;
-    unsigned int remaining = (1 << PAGE_SHIFT);
+    unsigned char *moffset = (unsigned char *)KMEM_ADDR(page, pages);
+    unsigned char *end = moffset + (1 << PAGE_SHIFT);
+    void **ptr = 0;
 
+    moffset += cache->colour_next * cache->colour_off;
+    if (++(cache->colour_next) == cache->colour) cache->colour_next = 0;
     set_flag(page, _PAGE_SLAB);
-    do {
-        ptr = (unsigned int *)(moffset + cache->offset);
+    page->slabp = (unsigned int)moffset;
+    while (moffset + cache->size <= end) {
+        if (cache->ctor) cache->ctor(moffset);
+        ptr = (void **)(moffset + cache->offset);
         moffset += cache->size;
-        *ptr = (unsigned int)moffset;
-        remaining -= cache->size;
-    } while (remaining >= cache->size);
+        *ptr = moffset;
+    }
+    *ptr = 0;
 
-    *ptr = (unsigned int)moffset & ~((1 << PAGE_SHIFT) - 1);
-    s_head->end_ptr = ptr;
-    s_head->nr_objs = 0;
+    set_bplevel(page, 0);
+    page->virtual = (void *)cache;
+    ++(cache->nr_pages);
+}
 
+// make page the cpu.page of cache, taking over its free list
+static void set_cpu_page(struct kmem_cache *cache, struct page *page) {
     cache->cpu.page = page;
-    cache->cpu.freeobj = (void **)(*ptr + cache->offset);
-    page->virtual = (void *)cache;
-    page->slabp = (unsigned int)(*(cache->cpu.freeobj));
+    cache->cpu.freeobj = (void **)(page->slabp);
+    page->slabp = 0;
 }
 
 void *slab_alloc(struct kmem_cache *cache) {
-    struct slab_head *s_head;
-    void *object = 0;
+    void **object;
     struct page *newpage;
 
-    if (cache->cpu.freeobj) object = *(cache->cpu.freeobj);
-
-slalloc_check:
-    // 1st: check if the freeobj is in the boundary situation
-    if (is_bound((unsigned int)object, (1 << PAGE_SHIFT))) {
-        // 2nd: the page is full
+    if (!cache->cpu.freeobj) {
+        // the cpu.page is used up, it goes to the full list
         if (cache->cpu.page) {
             list_add_tail(&(cache->cpu.page->list), &(cache->node.full));
+            init_kmem_cpu(&(cache->cpu));
         }
 
         if (list_empty(&(cache->node.partial))) {
             // call the buddy system to allocate one more page to be slab-cache
             newpage = __alloc_pages(0);  // get bplevel = 0 page === one page
             if (!newpage) {
-                // allocate failed, memory in system is used up
+                // allocate failed even after reclaim, memory is used up
                 kernel_printf("ERROR: slab request one page in cache failed\n");
-                while (1)
-                    ;
+                return 0;
             }
 #ifdef SLAB_DEBUG
             kernel_printf("\tnew page, index: %x \n", newpage - pages);
 #endif  // ! SLAB_DEBUG
-        // using standard format to shape the new-allocated page,
-        // set the new page to be cpu.page
+            // using standard format to shape the new-allocated page,
+            // set the new page to be cpu.page
             format_slabpage(cache, newpage);
-            object = *(cache->cpu.freeobj);
-            // as it's newly allocated no check may be need
-            goto slalloc_check;
-        }
-        // get the header of the cpu.page(struct page)
-        cache->cpu.page =
-            container_of(cache->node.partial.next, struct page, list);
-        list_del(cache->node.partial.next);
-        object = (void *)(cache->cpu.page->slabp);
-        cache->cpu.freeobj = (void **)((unsigned char *)object + cache->offset);
-        goto slalloc_check;
-    }
-slalloc_normal:
-    cache->cpu.freeobj = (void **)((unsigned char *)object + cache->offset);
-    cache->cpu.page->slabp = (unsigned int)(*(cache->cpu.freeobj));
-    s_head = (struct slab_head *)KMEM_ADDR(cache->cpu.page, pages);
-    ++(s_head->nr_objs);
-slalloc_end:
-    // slab may be full after this allocation
-    if (is_bound(cache->cpu.page->slabp, 1 << PAGE_SHIFT)) {
-        list_add_tail(&(cache->cpu.page->list), &(cache->node.full));
-        init_kmem_cpu(&(cache->cpu));
+        } else {
+            // get the header of the cpu.page(struct page)
+            newpage = container_of(cache->node.partial.next, struct page, list);
+            list_del_init(&(newpage->list));
+        }
+        set_cpu_page(cache, newpage);
     }
-    return object;
+
+    object = cache->cpu.freeobj;
+    cache->cpu.freeobj = *(void ***)((unsigned char *)object + cache->offset);
+    ++(cache->cpu.page->bplevel);
+    return (void *)object;
 }
 
 void slab_free(struct kmem_cache *cache, void *object) {
-    struct page *opage = pages + ((unsigned int)object >> PAGE_SHIFT);
-    unsigned int *ptr;
-    struct slab_head *s_head = (struct slab_head *)KMEM_ADDR(opage, pages);
+    struct page *opage =
+        pages + (((unsigned int)object & ~KERNEL_ENTRY) >> PAGE_SHIFT);
+    void **ptr = (void **)((unsigned char *)object + cache->offset);
 
-    if (!(s_head->nr_objs)) {
+    if (!(opage->bplevel)) {
         return;
     }
+    --(opage->bplevel);
 
-    ptr = (unsigned int *)((unsigned char *)object + cache->offset);
-    *ptr = *((unsigned int *)(s_head->end_ptr));
-    *((unsigned int *)(s_head->end_ptr)) = (unsigned int)object;
-    --(s_head->nr_objs);
-
-    if (list_empty(&(opage->list))) return;
+    if (opage == cache->cpu.page) {
+        *ptr = (void *)cache->cpu.freeobj;
+        cache->cpu.freeobj = (void **)object;
+        return;
+    }
 
-    if (!(s_head->nr_objs)) {
+    if (!(opage->bplevel)) {
+        // the page is empty now, give it back to the buddy system
+        list_del_init(&(opage->list));
+        opage->slabp = 0;
+        opage->virtual = (void *)(-1);
+        --(cache->nr_pages);
         __free_pages(opage, 0);
         return;
     }
 
-    list_del_init(&(opage->list));
-    list_add_tail(&(opage->list), &(cache->node.partial));
+    if (!(opage->slabp)) {
+        // the page was full, now it has one free object
+        list_del_init(&(opage->list));
+        list_add_tail(&(opage->list), &(cache->node.partial));
+    }
+    *ptr = (void *)(opage->slabp);
+    opage->slabp = (unsigned int)object;
 }
 
-// find the best-fit slab system for (size)
-unsigned int get_slab(unsigned int size) {
-    unsigned int itop = PAGE_SHIFT;
-    unsigned int i;
-    unsigned int bf_num = (1 << (PAGE_SHIFT - 1));  // half page
-    unsigned int bf_index = PAGE_SHIFT;  // record the best fit num & index
+// give cache one more slab page, it goes to the partial list
+// the page allocation may run reclaim, which can kfree into this very
+// cache or drain its magazine, so it is made with the caller's interrupt
+// state (old_ie) and cache_alloc re-checks everything afterwards
+static int cache_grow(struct kmem_cache *cache, unsigned int old_ie) {
+    struct page *page;
 
-    for (i = 0; i < itop; i++) {
-        if ((kmalloc_caches[i].objsize >= size) &&
-            (kmalloc_caches[i].objsize < bf_num)) {
-            bf_num = kmalloc_caches[i].objsize;
-            bf_index = i;
+    if (old_ie) {
+        enable_interrupts();
+    }
+    page = __alloc_pages(0);
+    disable_interrupts();
+    if (!page) {
+        kernel_printf("ERROR: slab request one page in cache failed\n");
+        return 0;
+    }
+    format_slabpage(cache, page);
+    list_add_tail(&(page->list), &(cache->node.partial));
+    return 1;
+}
+
+// take one object from the magazine, refill it from the slab pages if empty
+// the refill only carves objects out of pages the cache already has, a new
+// page is taken (through cache_grow) only while the magazine is still empty
+static void *cache_alloc(struct kmem_cache *cache) {
+    struct kmem_magazine *mag = &(cache->mag);
+    void *object;
+    unsigned int i, old_ie;
+
+    old_ie = disable_interrupts();
+    if (!mag->avail) {
+        for (i = 0; i < SLAB_MAG_BATCH && mag->avail < SLAB_MAG_SIZE; i++) {
+            if (!cache->cpu.freeobj && list_empty(&(cache->node.partial))) {
+                if (mag->avail || !cache_grow(cache, old_ie)) break;
+                // someone else may have refilled the magazine meanwhile
+                continue;
+            }
+            object = slab_alloc(cache);
+            if (!object) break;
+            mag->objs[mag->avail++] = object;
         }
+        ++(cache->stats.refills);
     }
-    return bf_index;
+    object = 0;
+    if (mag->avail) {
+        object = mag->objs[--(mag->avail)];
+        ++(cache->stats.allocs);
+    }
+    if (old_ie) {
+        enable_interrupts();
+    }
+    return object;
 }
 
-void *kmalloc(unsigned int size) {
+// put one object into the magazine, when it is full the bottom batch
+// (the objects freed longest ago) goes back to the slab pages
+static void cache_free(struct kmem_cache *cache, void *object) {
+    struct kmem_magazine *mag = &(cache->mag);
+    unsigned int i, old_ie;
+
+    old_ie = disable_interrupts();
+    if (mag->avail == SLAB_MAG_SIZE) {
+        for (i = 0; i < SLAB_MAG_BATCH; i++) {
+            slab_free(cache, mag->objs[i]);
+        }
+        for (i = SLAB_MAG_BATCH; i < SLAB_MAG_SIZE; i++) {
+            mag->objs[i - SLAB_MAG_BATCH] = mag->objs[i];
+        }
+        mag->avail -= SLAB_MAG_BATCH;
+        ++(cache->stats.drains);
+    }
+    mag->objs[(mag->avail)++] = object;
+    ++(cache->stats.frees);
+    if (old_ie) {
+        enable_interrupts();
+    }
+}
+
+// give the magazines and the empty cpu pages of all caches back,
+// returns the number of pages freed to the buddy system
+static unsigned int slab_shrink(unsigned int nr_to_scan) {
+    struct list_head *pos;
     struct kmem_cache *cache;
+    struct page *page;
+    unsigned int i, nr_pages, freed = 0;
+    unsigned int old_ie;
+
+    old_ie = disable_interrupts();
+    list_for_each(pos, &slab_caches) {
+        cache = container_of(pos, struct kmem_cache, list);
+        nr_pages = cache->nr_pages;
+        if (cache->mag.avail) {
+            for (i = 0; i < cache->mag.avail; i++) {
+                slab_free(cache, cache->mag.objs[i]);
+            }
+            cache->mag.avail = 0;
+            ++(cache->stats.drains);
+        }
+        page = cache->cpu.page;
+        if (page && !(page->bplevel)) {
+            init_kmem_cpu(&(cache->cpu));
+            page->slabp = 0;
+            page->virtual = (void *)(-1);
+            --(cache->nr_pages);
+            __free_pages(page, 0);
+        }
+        freed += nr_pages - cache->nr_pages;
+    }
+    if (old_ie) {
+        enable_interrupts();
+    }
+    return freed;
+}
+
+static struct shrinker slab_shrinker = {
+    .name = "slab",
+    .shrink = slab_shrink,
+};
+
+void *kmalloc(unsigned int size) {
     unsigned int bf_index;
 
     if (!size) return 0;
-    size += (1 << PAGE_SHIFT) - 1;
-    size &= ~((1 << PAGE_SHIFT) - 1);
 
-    if (size > kmalloc_caches[PAGE_SHIFT - 1].objsize) {
+    if (size > KMALLOC_MAX_SIZE) {
         unsigned int bplevel = 0;
         unsigned int curr_size = 1 << PAGE_SHIFT;
+        void *addr;
         while (size > curr_size) {
             curr_size <<= 1;
             bplevel++;
         }
-        return (void *)(KERNEL_ENTRY | (unsigned int)alloc_pages(bplevel));
+        addr = alloc_pages(bplevel);
+        if (!addr) return 0;
+        return (void *)(KERNEL_ENTRY | (unsigned int)addr);
     }
 
-    bf_index = get_slab(size);
-    if (bf_index >= PAGE_SHIFT) {
-        kernel_printf("ERROR: No available slab\n");
-        while (1)
-            ;
-    }
-    return (void *)(KERNEL_ENTRY |
-                    (unsigned int)slab_alloc(&(kmalloc_caches[bf_index])));
+    if (size <= 256)
+        bf_index = size_index_small[(size - 1) >> 3];
+    else
+        bf_index = size_index_large[(size - 1) >> 8];
+    return cache_alloc(&(kmalloc_caches[bf_index]));
 }
 
 void kfree(void *obj) {
     struct page *page;
-    obj = (void *)((unsigned int)obj & (~KERNEL_ENTRY));
-    page = pages + ((unsigned int)obj >> PAGE_SHIFT);
+    if (!obj) return;
+    page = pages + (((unsigned int)obj & ~KERNEL_ENTRY) >> PAGE_SHIFT);
     if (!(page->flag == _PAGE_SLAB))
-        free_pages((void *)((unsigned int)obj & ~((1 << PAGE_SHIFT) - 1)),
+        free_pages((void *)((unsigned int)obj & ~KERNEL_ENTRY &
+                            ~((1 << PAGE_SHIFT) - 1)),
                    page->bplevel);
     else {
-        slab_free(page->virtual, obj);
+        cache_free(page->virtual, obj);
+    }
+}
+
+// spread the first object of the new slab pages over (range) bytes,
+// in steps of colour_off, range 0 turns colouring off
+// the range is cut so that every page still holds at least one object
+void kmem_cache_set_colour(struct kmem_cache *cache, unsigned int range) {
+    if (cache->size >= (1 << PAGE_SHIFT))
+        range = 0;
+    else if (range + cache->size > (1 << PAGE_SHIFT))
+        range = (1 << PAGE_SHIFT) - cache->size;
+    cache->colour = range / cache->colour_off + 1;
+    cache->colour_next = 0;
+}
+
+// create a named cache for objects of one type
+// size: object size, align: object alignment, ctor: may be 0
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+                                     unsigned int align, kmem_ctor_fn ctor) {
+    struct kmem_cache *cache;
+
+    if (!size || size > (1 << PAGE_SHIFT)) return 0;
+    cache = (struct kmem_cache *)kmalloc(sizeof(struct kmem_cache));
+    if (!cache) return 0;
+    init_each_slab(cache, name, size, align, ctor);
+    if (cache->size > (1 << PAGE_SHIFT)) {
+        // the pointer behind the object does not fit in one page
+        list_del(&(cache->list));
+        kfree(cache);
+        return 0;
+    }
+    return cache;
+}
+
+// release a cache whose objects have all been freed,
+// returns 1 and keeps the cache if some object is still allocated
+int kmem_cache_destroy(struct kmem_cache *cache) {
+    struct page *page;
+    unsigned int i, old_ie;
+
+    old_ie = disable_interrupts();
+    for (i = 0; i < cache->mag.avail; i++) {
+        slab_free(cache, cache->mag.objs[i]);
+    }
+    cache->mag.avail = 0;
+    page = cache->cpu.page;
+    if (page && !(page->bplevel)) {
+        init_kmem_cpu(&(cache->cpu));
+        page->slabp = 0;
+        page->virtual = (void *)(-1);
+        --(cache->nr_pages);
+        __free_pages(page, 0);
+    }
+    if (cache->nr_pages) {
+        if (old_ie) {
+            enable_interrupts();
+        }
+        return 1;
+    }
+    list_del(&(cache->list));
+    if (old_ie) {
+        enable_interrupts();
+    }
+    kfree(cache);
+    return 0;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache) { return cache_alloc(cache); }
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+    if (!obj) return;
+    cache_free(cache, obj);
+}
+
+// print the page usage of every cache
+void slab_info() {
+    struct list_head *pos;
+    struct kmem_cache *cache;
+    unsigned int total = 0;
+    kernel_printf("Slab caches :\n");
+    list_for_each(pos, &slab_caches) {
+        cache = container_of(pos, struct kmem_cache, list);
+        kernel_printf("\t%s-%d : %d pages, %d in magazine, %d colours\n",
+                      cache->name, cache->objsize, cache->nr_pages,
+                      cache->mag.avail, cache->colour);
+        kernel_printf("\t\talloc %d, free %d, refill %d, drain %d\n",
+                      cache->stats.allocs, cache->stats.frees,
+                      cache->stats.refills, cache->stats.drains);
+        total += cache->nr_pages;
+    }
+    kernel_printf("\ttotal : %d pages\n", total);
+}
+
+#define SLAB_BENCH_OBJS 64
+#define SLAB_BENCH_ROUNDS 16
+
+// kmalloc/kfree storm over the general caches, cycles are read from CP0 Count
+// the interrupts are off while timing, since the timer tick clears Count
+// as in buddy_bench, pages_low is 0 for the run so new slab pages do not
+// reclaim on the way
+void slab_bench() {
+    static unsigned int bench_size[8] = {8, 24, 64, 40, 128, 16, 200, 32};
+    void *objs[SLAB_BENCH_OBJS];
+    unsigned int round, i;
+    unsigned int start, alloc_cycles = 0, free_cycles = 0;
+    unsigned int nr_ops = 0;
+    unsigned int old_ie, pages_low, reclaims;
+
+    pages_low = buddy.pages_low;
+    buddy.pages_low = 0;
+    reclaims = nr_reclaim;
+    for (round = 0; round < SLAB_BENCH_ROUNDS; round++) {
+        old_ie = disable_interrupts();
+        start = get_cp0_count();
+        for (i = 0; i < SLAB_BENCH_OBJS; i++) {
+            objs[i] = kmalloc(bench_size[(i + round) & 7]);
+        }
+        alloc_cycles += get_cp0_count() - start;
+
+        start = get_cp0_count();
+        for (i = 0; i < SLAB_BENCH_OBJS; i++) {
+            kfree(objs[i]);
+        }
+        free_cycles += get_cp0_count() - start;
+        if (old_ie) {
+            enable_interrupts();
+        }
+        nr_ops += SLAB_BENCH_OBJS;
+    }
+    buddy.pages_low = pages_low;
+    kernel_printf("slab bench: %d kmalloc/kfree pairs\n", nr_ops);
+    if (nr_reclaim != reclaims)
+        kernel_printf("\treclaim ran %d times, included in alloc\n",
+                      nr_reclaim - reclaims);
+    kernel_printf("\talloc : %d cycles/op\n", alloc_cycles / nr_ops);
+    kernel_printf("\tfree  : %d cycles/op\n", free_cycles / nr_ops);
+    slab_info();
+}
+
+#define COLOUR_BENCH_PAGES 64
+#define COLOUR_BENCH_ROUNDS 64
+#define COLOUR_BENCH_RANGE 8
+
+// walk the first object of each page in a cache of (size) objects,
+// once without colouring and once spread over COLOUR_BENCH_RANGE lines
+// without colouring all these objects start at page offset 0 and compete
+// for the same cache sets, the difference is the cost of the conflict misses
+void slab_colour_bench(const char *name, unsigned int size) {
+    static void *hot[COLOUR_BENCH_PAGES];
+    struct kmem_cache *cache;
+    void *rest, *obj;
+    unsigned int pass, round, i, nr_hot, colours = 1;
+    unsigned int start, cycles[2], sum = 0;
+    unsigned int old_ie;
+
+    for (pass = 0; pass < 2; pass++) {
+        cache = kmem_cache_create("colour_bench", size, 0, 0);
+        if (!cache) return;
+        kmem_cache_set_colour(cache,
+                              pass ? COLOUR_BENCH_RANGE * cache->colour_off : 0);
+        colours = cache->colour;
+        // the first object seen on a page is the hot one, the others are
+        // only kept on a list through their first word until they are freed
+        nr_hot = 0;
+        rest = 0;
+        while (nr_hot < COLOUR_BENCH_PAGES) {
+            obj = kmem_cache_alloc(cache);
+            if (!obj) break;
+            for (i = 0; i < nr_hot; i++) {
+                if ((((unsigned int)hot[i] ^ (unsigned int)obj) >> PAGE_SHIFT) ==
+                    0)
+                    break;
+            }
+            if (i == nr_hot) {
+                hot[nr_hot++] = obj;
+            } else {
+                *(void **)obj = rest;
+                rest = obj;
+            }
+        }
+        old_ie = disable_interrupts();
+        start = get_cp0_count();
+        for (round = 0; round < COLOUR_BENCH_ROUNDS; round++) {
+            for (i = 0; i < nr_hot; i++) {
+                sum += *(unsigned int *)hot[i];
+            }
+        }
+        cycles[pass] = (get_cp0_count() - start) /
+                       (COLOUR_BENCH_ROUNDS * (nr_hot ? nr_hot : 1));
+        if (old_ie) {
+            enable_interrupts();
+        }
+        while (rest) {
+            obj = rest;
+            rest = *(void **)obj;
+            kmem_cache_free(cache, obj);
+        }
+        for (i = 0; i < nr_hot; i++) {
+            kmem_cache_free(cache, hot[i]);
+        }
+        kmem_cache_destroy(cache);
     }
+    kernel_printf("colour bench: %s-%d, %d pages, sum %x\n", name, size,
+                  COLOUR_BENCH_PAGES, sum);
+    kernel_printf("\tno colour : %d cycles/access\n", cycles[0]);
+    kernel_printf("\t%d colours : %d cycles/access\n", colours, cycles[1]);
 }
@@ -0,0 +1,316 @@
+#include <arch.h>
+#include <driver/vga.h>
+#include <intr.h>
+#include <zjunix/buddy.h>
+#include <zjunix/slab.h>
+#include <zjunix/utils.h>
+#include <zjunix/vmalloc.h>
+
+#define VMALLOC_PAGES (VMALLOC_SIZE >> PAGE_SHIFT)
+
+// kseg0 address of the page behind every page of the window, 0 if unmapped
+static unsigned int *vmalloc_pte;
+
+// all allocated ranges, sorted by address
+static struct list_head vmlist;
+
+void init_vmalloc() {
+    vmalloc_pte = (unsigned int *)kmalloc(VMALLOC_PAGES * sizeof(unsigned int));
+    kernel_memset(vmalloc_pte, 0, VMALLOC_PAGES * sizeof(unsigned int));
+    INIT_LIST_HEAD(&vmlist);
+}
+
+// EntryLo of one slot, valid + dirty + cacheable + global,
+// an empty slot is only global so the pair stays a global entry
+static unsigned int vmalloc_entry_lo(unsigned int kaddr) {
+    if (!kaddr) return 1;
+    return (((kaddr & ~KERNEL_ENTRY) >> PAGE_SHIFT) << 6) | (3 << 3) | 0x7;
+}
+
+// write the entry pair covering entry_hi into the TLB,
+// overwriting the stale entry of the pair if there is one
+static void vmalloc_tlb_write(unsigned int entry_hi, unsigned int entry_lo0,
+                              unsigned int entry_lo1) {
+    unsigned int old_hi, index;
+
+    asm volatile("mfc0 %0, $10\n\t" : "=r"(old_hi));
+    // keep the current ASID, it is ignored by global entries anyway
+    entry_hi |= old_hi & 0xFF;
+    asm volatile(
+        "mtc0 %1, $10\n\t"
+        "nop\n\t"
+        "nop\n\t"
+        "tlbp\n\t"
+        "nop\n\t"
+        "nop\n\t"
+        "mfc0 %0, $0\n\t"
+        : "=r"(index)
+        : "r"(entry_hi));
+    asm volatile(
+        "mtc0 $zero, $5\n\t"
+        "mtc0 %0, $2\n\t"
+        "mtc0 %1, $3\n\t"
+        "nop\n\t"
+        "nop\n\t"
+        :
+        : "r"(entry_lo0), "r"(entry_lo1));
+    if (index & 0x80000000) {
+        asm volatile("tlbwr\n\tnop\n\tnop\n\t");
+    } else {
+        asm volatile("tlbwi\n\tnop\n\tnop\n\t");
+    }
+}
+
+// drop the TLB entry of the pair containing addr, if any
+// the dropped slot gets a distinct kseg0 VPN, which never matches
+static void vmalloc_tlb_flush(unsigned int addr) {
+    unsigned int old_hi, index;
+
+    asm volatile("mfc0 %0, $10\n\t" : "=r"(old_hi));
+    asm volatile(
+        "mtc0 %1, $10\n\t"
+        "nop\n\t"
+        "nop\n\t"
+        "tlbp\n\t"
+        "nop\n\t"
+        "nop\n\t"
+        "mfc0 %0, $0\n\t"
+        : "=r"(index)
+        : "r"((addr & 0xFFFFE000) | (old_hi & 0xFF)));
+    if (!(index & 0x80000000)) {
+        asm volatile(
+            "mtc0 $zero, $2\n\t"
+            "mtc0 $zero, $3\n\t"
+            "mtc0 $zero, $5\n\t"
+            "mtc0 %0, $10\n\t"
+            "nop\n\t"
+            "nop\n\t"
+            "tlbwi\n\t"
+            "nop\n\t"
+            "nop\n\t"
+            :
+            : "r"(KERNEL_ENTRY + (index << 13)));
+    }
+    asm volatile("mtc0 %0, $10\n\tnop\n\t" : : "r"(old_hi));
+}
+
+// first-fit search of (size) bytes of free window
+static struct vm_struct *get_vm_area(unsigned int size) {
+    struct list_head *pos;
+    struct vm_struct *area, *tmp;
+    unsigned int addr = VMALLOC_START;
+
+    area = (struct vm_struct *)kmalloc(sizeof(struct vm_struct));
+    if (!area) return 0;
+    list_for_each(pos, &vmlist) {
+        tmp = container_of(pos, struct vm_struct, list);
+        if (addr + size <= tmp->addr) break;
+        addr = tmp->addr + tmp->size;
+    }
+    if (size > VMALLOC_END - addr) {
+        kfree(area);
+        return 0;
+    }
+    area->addr = addr;
+    area->size = size;
+    area->nr_pages = 0;
+    // insert before pos, which keeps the list sorted
+    list_add_tail(&(area->list), pos);
+    return area;
+}
+
+static struct vm_struct *find_vm_area(unsigned int addr) {
+    struct list_head *pos;
+    struct vm_struct *area;
+
+    list_for_each(pos, &vmlist) {
+        area = container_of(pos, struct vm_struct, list);
+        if (area->addr == addr) return area;
+    }
+    return 0;
+}
+
+// clear the slots and TLB entries of area and release it,
+// its pages go back to the buddy system if free_pages is set
+static void unmap_vm_area(struct vm_struct *area, int free_pages) {
+    unsigned int idx = (area->addr - VMALLOC_START) >> PAGE_SHIFT;
+    unsigned int i, addr, kaddr;
+
+    for (i = 0; i < area->nr_pages; i++) {
+        kaddr = vmalloc_pte[idx + i];
+        if (free_pages)
+            __free_pages(pages + ((kaddr & ~KERNEL_ENTRY) >> PAGE_SHIFT), 0);
+        vmalloc_pte[idx + i] = 0;
+    }
+    for (addr = area->addr & 0xFFFFE000; addr < area->addr + area->size;
+         addr += 2 << PAGE_SHIFT) {
+        vmalloc_tlb_flush(addr);
+    }
+    list_del(&(area->list));
+    kfree(area);
+}
+
+// allocate (size) bytes, virtually contiguous in the window
+// the pages are single frames from the buddy system, not zeroed
+void *vmalloc(unsigned int size) {
+    struct vm_struct *area;
+    struct page *page;
+    unsigned int nr_pages, idx, i;
+    unsigned int addr = 0;
+    unsigned int old_ie;
+
+    if (!size) return 0;
+    nr_pages = UPPER_ALLIGN(size, 1 << PAGE_SHIFT) >> PAGE_SHIFT;
+
+    old_ie = disable_interrupts();
+    // one more page as the guard, it is never mapped
+    area = get_vm_area((nr_pages + 1) << PAGE_SHIFT);
+    if (!area) goto out;
+    idx = (area->addr - VMALLOC_START) >> PAGE_SHIFT;
+    for (i = 0; i < nr_pages; i++) {
+        page = __alloc_pages(0);
+        if (!page) {
+            unmap_vm_area(area, 1);
+            goto out;
+        }
+        vmalloc_pte[idx + i] = ((page - pages) << PAGE_SHIFT) | KERNEL_ENTRY;
+        ++(area->nr_pages);
+    }
+    addr = area->addr;
+out:
+    if (old_ie) {
+        enable_interrupts();
+    }
+    return (void *)addr;
+}
+
+// release the range and its pages
+void vfree(void *addr) {
+    struct vm_struct *area;
+    unsigned int old_ie;
+
+    if (!addr) return;
+    old_ie = disable_interrupts();
+    area = find_vm_area((unsigned int)addr);
+    if (area)
+        unmap_vm_area(area, 1);
+    else
+        kernel_printf("ERROR: vfree bad address %x\n", (unsigned int)addr);
+    if (old_ie) {
+        enable_interrupts();
+    }
+}
+
+// release the range only, the pages are left to whoever took them
+// over through vmalloc_to_kaddr(), e.g. a user page table
+void vunmap(void *addr) {
+    struct vm_struct *area;
+    unsigned int old_ie;
+
+    if (!addr) return;
+    old_ie = disable_interrupts();
+    area = find_vm_area((unsigned int)addr);
+    if (area) unmap_vm_area(area, 0);
+    if (old_ie) {
+        enable_interrupts();
+    }
+}
+
+// kseg0 address behind a vmalloc address, 0 if it is not mapped
+void *vmalloc_to_kaddr(void *addr) {
+    unsigned int kaddr;
+
+    if (!is_vmalloc_addr(addr)) return 0;
+    kaddr = vmalloc_pte[((unsigned int)addr - VMALLOC_START) >> PAGE_SHIFT];
+    if (!kaddr) return 0;
+    return (void *)(kaddr | ((unsigned int)addr & ((1 << PAGE_SHIFT) - 1)));
+}
+
+// TLB miss inside the window, called by tlb_refill()
+void vmalloc_fault(void *addr) {
+    unsigned int idx = ((unsigned int)addr - VMALLOC_START) >> PAGE_SHIFT;
+
+    if (!vmalloc_pte[idx]) {
+        kernel_printf("ERROR: kernel access to unmapped vmalloc addr %x\n",
+                      (unsigned int)addr);
+        while (1)
+            ;
+    }
+    idx &= ~1;
+    vmalloc_tlb_write((unsigned int)addr & 0xFFFFE000,
+                      vmalloc_entry_lo(vmalloc_pte[idx]),
+                      vmalloc_entry_lo(vmalloc_pte[idx + 1]));
+}
+
+void vmalloc_info() {
+    struct list_head *pos;
+    struct vm_struct *area;
+    unsigned int total = 0;
+
+    kernel_printf("Vmalloc areas :\n");
+    list_for_each(pos, &vmlist) {
+        area = container_of(pos, struct vm_struct, list);
+        kernel_printf("\t%x-%x : %d pages\n", area->addr,
+                      area->addr + area->size, area->nr_pages);
+        total += area->nr_pages;
+    }
+    kernel_printf("\ttotal : %d pages\n", total);
+}
+
+// split the free memory into single frames: take every free frame,
+// then give back only those with an even pfn, so no two free frames are
+// buddies, then vmalloc 1MB..8MB and check every word of it
+void vmalloc_test() {
+    struct list_head held, *pos, *n;
+    struct page *page;
+    unsigned int *buf;
+    unsigned int mb, i, words, start, cycles;
+    unsigned int nr_held = 0;
+
+    INIT_LIST_HEAD(&held);
+    while ((page = __alloc_pages(0)) != 0) {
+        list_add_tail(&(page->list), &held);
+        ++nr_held;
+    }
+    list_for_each_safe(pos, n, &held) {
+        page = container_of(pos, struct page, list);
+        if (!((page - pages) & 1)) {
+            list_del_init(&(page->list));
+            __free_pages(page, 0);
+            --nr_held;
+        }
+    }
+    kernel_printf("vmalloc test: %d frames held, %d free\n", nr_held,
+                  buddy_free_pages());
+    buddy_info();
+    buf = (unsigned int *)kmalloc(1 << 20);
+    kernel_printf("\tkmalloc 1MB : %x\n", (unsigned int)buf);
+    kfree(buf);
+
+    for (mb = 1; mb <= 8; mb <<= 1) {
+        start = get_cp0_count();
+        buf = (unsigned int *)vmalloc(mb << 20);
+        cycles = get_cp0_count() - start;
+        if (!buf) {
+            kernel_printf("\tvmalloc %dMB failed\n", mb);
+            continue;
+        }
+        words = (mb << 20) / sizeof(unsigned int);
+        for (i = 0; i < words; i++) {
+            buf[i] = i ^ 0x5a5a5a5a;
+        }
+        for (i = 0; i < words; i++) {
+            if (buf[i] != (i ^ 0x5a5a5a5a)) break;
+        }
+        kernel_printf("\tvmalloc %dMB at %x : %d cycles, %s\n", mb,
+                      (unsigned int)buf, cycles, i == words ? "ok" : "BAD");
+        vfree(buf);
+    }
+
+    list_for_each_safe(pos, n, &held) {
+        page = container_of(pos, struct page, list);
+        list_del_init(&(page->list));
+        __free_pages(page, 0);
+    }
+    buddy_info();
+}
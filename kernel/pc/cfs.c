@@ -1,5 +1,9 @@
+#include <arch.h>
+#include <driver/vga.h>
+#include <intr.h>
 #include <zjunix/cfs.h>
 #include <zjunix/pc.h>
+#include <zjunix/slab.h>
 extern struct list_head task_ready;
 
 // helper function for maximum vruntime
@@ -67,6 +71,7 @@ static inline void sub_nr_running(struct cfs_rq* cfs_rq, unsigned int count) {
 }
 
 // helper function to insert a se into the cfs_rq's rb_tree
+// the running se is kept out of the tree, see set_next_entity
 static void enqueue_entity(struct cfs_rq* cfs_rq, struct sched_entity* se) {
   struct rb_node** link = &cfs_rq->tasks_timeline.rb_node;
   struct rb_node* parent = NULL;
@@ -110,7 +115,7 @@ static void reassign_vruntime(struct cfs_rq* cfs_rq) {
     p = container_of(pos, struct task_struct, state_node);
     p->se.vruntime = 0;
   }
-  cfs_rq->rb_leftmost = rb_next(cfs_rq->rb_leftmost);
+  // the tree order does not change, every key is 0 now
   cfs_rq->min_vruntime = 0;
 }
 
@@ -127,12 +132,10 @@ void INIT_CFS_RQ(struct cfs_rq* cfs_rq) {
 
 // update min_vruntime of cfs_rq
 // compare between cfs_rq's leftmost node and current se
-// in the meantime, update cfs_rq's leftmost node
+// the leftmost cache is kept exact by enqueue/dequeue, no tree walk here
 void update_min_vruntime(struct cfs_rq* cfs_rq) {
   struct sched_entity* curr = cfs_rq->curr;
-
-  struct rb_node* leftmost = rb_first(&cfs_rq->tasks_timeline);
-  cfs_rq->rb_leftmost = leftmost;
+  struct rb_node* leftmost = cfs_rq->rb_leftmost;
 
   u32 vruntime = cfs_rq->min_vruntime;
 
@@ -157,7 +160,7 @@ void update_min_vruntime(struct cfs_rq* cfs_rq) {
 
 // update cfs_rq with time unit delta
 // first, we will update the time info on current node
-// rearrange its position in the rb_tree
+// it is not in the rb_tree while running, so nothing moves there
 // and then we update metainfo of the cfs_rq
 void update_curr(struct cfs_rq* cfs_rq, u32 delta) {
   struct sched_entity* curr = cfs_rq->curr;
@@ -172,8 +175,6 @@ void update_curr(struct cfs_rq* cfs_rq, u32 delta) {
   } else {
     curr->vruntime += vruntime_delta;
   }
-  dequeue_entity(cfs_rq, curr);
-  enqueue_entity(cfs_rq, curr);
   update_min_vruntime(cfs_rq);
   if (cfs_rq->min_vruntime + 10 >= U32_MAX) {
     // all faces overflow
@@ -182,12 +183,14 @@ void update_curr(struct cfs_rq* cfs_rq, u32 delta) {
 }
 
 // CFS export function to add a new task_struct
-// first add the se onto the rb_tree
+// first add the se onto the rb_tree, unless it is the running one
 // then update cfs_rq's metainfo
 void enqueue_task_fair(struct cfs_rq* cfs_rq, struct task_struct* p) {
   struct sched_entity* se = &p->se;
   if (se && cfs_rq) {
-    enqueue_entity(cfs_rq, se);
+    if (se != cfs_rq->curr) {
+      enqueue_entity(cfs_rq, se);
+    }
     update_load_add(&cfs_rq->load, se->load.weight);
     add_nr_running(cfs_rq, 1);
     se->on_cfs_rq = true;
@@ -199,7 +202,9 @@ void enqueue_task_fair(struct cfs_rq* cfs_rq, struct task_struct* p) {
 void dequeue_task_fair(struct cfs_rq* cfs_rq, struct task_struct* p) {
   struct sched_entity* se = &p->se;
   if (se && cfs_rq) {
-    dequeue_entity(cfs_rq, se);
+    if (se != cfs_rq->curr) {
+      dequeue_entity(cfs_rq, se);
+    }
     update_load_sub(&cfs_rq->load, se->load.weight);
     sub_nr_running(cfs_rq, 1);
     se->on_cfs_rq = false;
@@ -207,12 +212,40 @@ void dequeue_task_fair(struct cfs_rq* cfs_rq, struct task_struct* p) {
 }
 
 // helper function to pick next node from the rb_tree
+// the running se is outside the tree, it keeps the cpu only while it is
+// strictly before the leftmost one
 static struct sched_entity* pick_next_entity(struct cfs_rq* cfs_rq) {
   struct rb_node* left = cfs_rq->rb_leftmost;
+  struct sched_entity* curr = cfs_rq->curr;
+  struct sched_entity* se;
+  if (curr && !curr->on_cfs_rq) {
+    curr = NULL;
+  }
   if (!left) {
-    return NULL;
+    return curr;
+  }
+  se = rb_entry(left, struct sched_entity, rb_node);
+  if (curr && entity_before(curr, se)) {
+    return curr;
   }
-  return rb_entry(left, struct sched_entity, rb_node);
+  return se;
+}
+
+// the se is about to run: take it out of the tree and start a new slice
+static void set_next_entity(struct cfs_rq* cfs_rq, struct sched_entity* se) {
+  if (se->on_cfs_rq) {
+    dequeue_entity(cfs_rq, se);
+  }
+  cfs_rq->curr = se;
+  se->prev_sum_exec_runtime = se->sum_exec_runtime;
+}
+
+// the running se gives up the cpu: back into the tree if still runnable
+static void put_prev_entity(struct cfs_rq* cfs_rq, struct sched_entity* prev) {
+  if (prev->on_cfs_rq) {
+    enqueue_entity(cfs_rq, prev);
+  }
+  cfs_rq->curr = NULL;
 }
 
 // helper function to get the task_struct
@@ -227,6 +260,18 @@ struct task_struct* pick_next_task_fair(struct cfs_rq* cfs_rq) {
   return p;
 }
 
+// CFS export function called before switching away from p
+void put_prev_task_fair(struct cfs_rq* cfs_rq, struct task_struct* p) {
+  if (cfs_rq->curr == &p->se) {
+    put_prev_entity(cfs_rq, &p->se);
+  }
+}
+
+// CFS export function called when p becomes the running task
+void set_next_task_fair(struct cfs_rq* cfs_rq, struct task_struct* p) {
+  set_next_entity(cfs_rq, &p->se);
+}
+
 
 // calculate schedule period
 // by default, it's sysctl_sched_latency
@@ -264,6 +309,17 @@ static u32 sched_slice(struct cfs_rq* cfs_rq, struct sched_entity* se) {
 }
 
 
+// CFS export function for the dynamic tick
+// time units left before check_preempt_tick would ask for a schedule
+u32 sched_slice_left(struct cfs_rq* cfs_rq, struct sched_entity* se) {
+  u32 ideal_runtime = sched_slice(cfs_rq, se);
+  u32 delta_exec = se->sum_exec_runtime - se->prev_sum_exec_runtime;
+  if (delta_exec >= ideal_runtime) {
+    return 0;
+  }
+  return ideal_runtime - delta_exec;
+}
+
 // CFS export function to check whether current se use all its time slice
 // if so, mark NEED_SCHED
 void check_preempt_tick(struct cfs_rq* cfs_rq,
@@ -298,3 +354,74 @@ void check_preempt_wakeup(struct cfs_rq* cfs_rq, struct task_struct *p) {
   }
 }
 
+
+#define SCHED_BENCH_TICKS 256
+
+// cycles per tick and per switch on a private cfs_rq with nr fake entities
+// a tick is update_curr + check_preempt_tick, a switch is pick_next +
+// put_prev + set_next, interrupts stay off while timing
+static void sched_bench_run(unsigned int nr) {
+  struct cfs_rq rq;
+  struct sched_entity* ses;
+  struct sched_entity* curr;
+  unsigned int i, old_ie, start;
+  unsigned int tick_cycles = 0, switch_cycles = 0, nr_switches = 0;
+
+  ses = (struct sched_entity*)kmalloc(nr * sizeof(struct sched_entity));
+  if (ses == NULL) {
+    kernel_printf("sched bench: no memory for %d entities\n", nr);
+    return;
+  }
+  INIT_CFS_RQ(&rq);
+  rq.min_vruntime = 0;
+  rq.NEED_SCHED = false;
+  for (i = 0; i < nr; i++) {
+    ses[i].load.weight = prio_to_weight[20 + (i & 7)];
+    ses[i].load.inv_weight = prio_to_wmult[20 + (i & 7)];
+    ses[i].vruntime = i;
+    ses[i].sum_exec_runtime = 0;
+    ses[i].prev_sum_exec_runtime = 0;
+    ses[i].on_cfs_rq = true;
+    enqueue_entity(&rq, &ses[i]);
+    update_load_add(&rq.load, ses[i].load.weight);
+    add_nr_running(&rq, 1);
+  }
+  set_next_entity(&rq, pick_next_entity(&rq));
+
+  old_ie = disable_interrupts();
+  for (i = 0; i < SCHED_BENCH_TICKS; i++) {
+    start = get_cp0_count();
+    update_curr(&rq, sysctl_sched_min_granularity_ns / sysctl_sched_time_unit);
+    check_preempt_tick(&rq, rq.curr);
+    tick_cycles += get_cp0_count() - start;
+    if (rq.NEED_SCHED) {
+      start = get_cp0_count();
+      curr = pick_next_entity(&rq);
+      if (curr != rq.curr) {
+        put_prev_entity(&rq, rq.curr);
+        set_next_entity(&rq, curr);
+        switch_cycles += get_cp0_count() - start;
+        nr_switches++;
+      }
+      rq.NEED_SCHED = false;
+    }
+  }
+  if (old_ie) {
+    enable_interrupts();
+  }
+  kernel_printf("\t%d tasks: %d cycles/tick, ", nr, tick_cycles / SCHED_BENCH_TICKS);
+  if (nr_switches) {
+    kernel_printf("%d cycles/switch (%d switches)\n", switch_cycles / nr_switches,
+                  nr_switches);
+  } else {
+    kernel_printf("no switch\n");
+  }
+  kfree(ses);
+}
+
+void sched_bench() {
+  kernel_printf("sched bench:\n");
+  sched_bench_run(8);
+  sched_bench_run(64);
+  sched_bench_run(512);
+}
@@ -8,6 +8,7 @@
 #include <zjunix/utils.h>
 #include <zjunix/vfs/vfs.h>
 #include <zjunix/vm.h>
+#include <zjunix/vmalloc.h>
 #include <../usr/ps.h>
 // global ptr to init process
 // currently init process serve no special purpose
@@ -39,10 +40,32 @@ struct list_head task_ready;
 // cfs run queue
 struct cfs_rq cfs_rq;
 
+// slab cache for PCBs and their kernel stacks
+struct kmem_cache *task_union_cachep;
+
+// context switch statistics, printed by sched_stat()
+// switch_cycles counts cp0 cycles spent switching the trap frames
+// and activating the address space of the next process
+static unsigned int nr_switches;
+static unsigned int switch_cycles;
+
+// set by pid_stress, task_create and task_kill skip their log lines
+// so that the timings are not mostly VGA output
+static bool task_quiet;
+
+// dynamic tick: Compare is set from the slice left to the running task
+// instead of a fixed period, and the timer interrupt is masked while at
+// most one task is runnable, there is nothing to preempt it for then
+// Count still restarts from 0 at every tick and schedule, so Count is
+// always the time since the running task was last charged
+static bool dynamic_tick = true;
+static bool tick_stopped;
+static unsigned int nr_ticks;
+
 static const unsigned int CACHE_BLOCK_SIZE = 64;
 #define max(a, b) ((a > b) ? (a) : (b))
 
-// save context when doing context switch in interrupt
+// copy a trap frame, only fork needs this now
 static void copy_context(reg_context_t *src, reg_context_t *dest) {
   dest->epc = src->epc;
   dest->at = src->at;
@@ -78,6 +101,57 @@ static void copy_context(reg_context_t *src, reg_context_t *dest) {
   dest->ra = src->ra;
 }
 
+// make the exception return path restore next's trap frame
+// the outgoing task keeps its frame on its own kernel stack, so nothing
+// is copied, and a trap from a user stack lands on next's kernel stack
+static void switch_frame(struct task_struct *next) {
+  next_trap_frame = (unsigned int)next->frame;
+  kernel_sp = (unsigned int)next + TASK_KERNEL_SIZE;
+}
+
+// program the next timer interrupt, called with interrupts off
+// Count holds the time not yet charged to the current task, so the
+// tick is due when Count reaches the period, not the period from now
+static void sched_program_tick() {
+  unsigned int cycles, elapsed;
+  if (!dynamic_tick) {
+    cycles = sysctl_sched_min_granularity_ns;
+  } else if (cfs_rq.nr_running <= 1) {
+    mask_interrupt(7);
+    tick_stopped = true;
+    return;
+  } else {
+    // one unit more, check_preempt_tick wants the slice exceeded
+    cycles = (sched_slice_left(&cfs_rq, &current_task->se) + 1) *
+             sysctl_sched_time_unit;
+    if (cycles > sysctl_sched_latency) {
+      cycles = sysctl_sched_latency;
+    }
+  }
+  // never closer than tick_min, a Compare already passed would
+  // only fire after Count wraps
+  elapsed = get_cp0_count();
+  if (cycles < elapsed + sysctl_sched_tick_min) {
+    cycles = elapsed + sysctl_sched_tick_min;
+  }
+  // writing Compare also clears a pending timer interrupt
+  asm volatile("mtc0 %0, $11\n\t" : : "r"(cycles));
+  if (tick_stopped) {
+    unmask_interrupt(7);
+    tick_stopped = false;
+  }
+}
+
+// switch between dynamic and fixed period ticks
+void sched_set_tick_mode(int dynamic) {
+  unsigned int old_ie = disable_interrupts();
+  dynamic_tick = dynamic ? true : false;
+  sched_program_tick();
+  if (old_ie) {
+    enable_interrupts();
+  }
+}
+
 // set a process state
 // link it to corresponding state list
 static void set_state(struct task_struct *p, struct list_head *state_list) {
@@ -113,12 +187,17 @@ void init_task_module() {
   INIT_LIST_HEAD(&task_waiting);
   INIT_LIST_HEAD(&task_ready);
 
+  // one task_union per page, aligned so the kernel stack top is page aligned
+  task_union_cachep = kmem_cache_create("task_union", sizeof(union task_union),
+                                        TASK_KERNEL_SIZE, NULL);
+
   // setting init process
   union task_union *tmp = (union task_union *)(kernel_sp - TASK_KERNEL_SIZE);
   init = &tmp->task;
   struct task_struct *p = init;
   kernel_strcpy(init->name, "init");
-  kernel_memset(&p->context, 0, sizeof(context));
+  // init already runs, its frame is saved when it is first switched out
+  p->frame = NULL;
   
   // set prio
   p->nice = 0;
@@ -148,23 +227,23 @@ void init_task_module() {
   // init is a kernel process
   // no vm or user_pc_mem created
   init->vm = NULL;
+  init->asid = 0;
+  init->mm_rb.rb_node = NULL;
   kernel_memset(init->user_pc_memory_blocks, 0,
                 sizeof(init->user_pc_memory_blocks));
   init->user_mode = 0;
   current_task = init;
 
-  // configure cfs_rq
-  cfs_rq.curr = &(current_task->se);
+  // configure cfs_rq, the running se lives outside the tree
+  set_next_task_fair(&cfs_rq, current_task);
   init->state = TASK_RUNNING;
 
   // enable timer interrupt
+  // init is the only task so far, task_create starts the tick in
+  // dynamic mode as soon as there is a second one
   register_interrupt_handler(7, task_tick);
-
-  asm volatile(
-      "mtc0 %0, $11\n\t"
-      "mtc0 $zero, $9"
-      :
-      : "r"(sysctl_sched_min_granularity_ns));
+  asm volatile("mtc0 $zero, $9\n\t");
+  sched_program_tick();
 }
 
 // called when return from function
@@ -186,11 +265,18 @@ void ret_from_sched_syscall() {
 // we inline the code from main scheduler here
 void task_tick(unsigned int status, unsigned int cause, context *pc_context) {
   unsigned int old_ie = disable_interrupts();
+  u32 delta;
 
   // update current process time slice
   // check whether it needs to schedule
-  update_curr(&cfs_rq,
-              sysctl_sched_min_granularity_ns / sysctl_sched_time_unit);
+  // a dynamic tick charges what Count says, the period varies
+  nr_ticks++;
+  if (dynamic_tick) {
+    delta = get_cp0_count() / sysctl_sched_time_unit;
+  } else {
+    delta = sysctl_sched_min_granularity_ns / sysctl_sched_time_unit;
+  }
+  update_curr(&cfs_rq, delta);
   check_preempt_tick(&cfs_rq, &current_task->se);
 
   // our function can stop here
@@ -202,19 +288,25 @@ void task_tick(unsigned int status, unsigned int cause, context *pc_context) {
     if (current_task == next) {
       goto finish;
     }
-    copy_context(pc_context, &(current_task->context));
-    copy_context(&(next->context), pc_context);
-    current_task->state = TASK_READY;
-    current_task->se.prev_sum_exec_runtime = current_task->se.sum_exec_runtime;
+    unsigned int switch_start = get_cp0_count();
+    current_task->frame = pc_context;
+    switch_frame(next);
+    if (current_task->state == TASK_RUNNING) {
+      current_task->state = TASK_READY;
+    }
+    put_prev_task_fair(&cfs_rq, current_task);
     current_task = next;
     current_task->state = TASK_RUNNING;
-    cfs_rq.curr = &current_task->se;
-    set_active_asid(current_task->pid);
+    set_next_task_fair(&cfs_rq, current_task);
+    vm_activate(current_task);
+    switch_cycles += get_cp0_count() - switch_start;
+    nr_switches++;
   finish:
     cfs_rq.NEED_SCHED = false;
   }
   if (old_ie) {
     asm volatile("mtc0 $zero, $9\n\t");
+    sched_program_tick();
     enable_interrupts();
     return;
   }
@@ -232,23 +324,30 @@ void task_schedule(unsigned int status, unsigned int cause,
     goto finish;
   }
 
-  // context save and switch
-  copy_context(pc_context, &(current_task->context));
-  copy_context(&(next->context), pc_context);
-  current_task->state = TASK_READY;
+  // context save and switch, the frame just saved stays where it is
+  unsigned int switch_start = get_cp0_count();
+  current_task->frame = pc_context;
+  switch_frame(next);
+  // a task that went to sleep is on task_waiting already
+  if (current_task->state == TASK_RUNNING) {
+    current_task->state = TASK_READY;
+  }
 
-  // update time info
-  current_task->se.prev_sum_exec_runtime = current_task->se.sum_exec_runtime;
+  // update time info, prev goes back into the tree and next leaves it
+  put_prev_task_fair(&cfs_rq, current_task);
   current_task = next;
   current_task->state = TASK_RUNNING;
-  cfs_rq.curr = &current_task->se;
+  set_next_task_fair(&cfs_rq, current_task);
   
   // active tlb
-  set_active_asid(current_task->pid);
+  vm_activate(current_task);
+  switch_cycles += get_cp0_count() - switch_start;
+  nr_switches++;
 
 finish:
   cfs_rq.NEED_SCHED = false;
   asm volatile("mtc0 $zero, $9\n\t");
+  sched_program_tick();
   if (old_ie) {
     enable_interrupts();
   }
@@ -266,7 +365,8 @@ struct task_struct *task_create(char *task_name,
                                 unsigned int argc, void *args, int nice,
                                 int user_mode) {
   // malloc memory
-  union task_union *tmp = (union task_union *)kmalloc(sizeof(union task_union));
+  union task_union *tmp =
+      (union task_union *)kmem_cache_alloc(task_union_cachep);
   if (tmp == 0) {
     kernel_printf("allocate fail, return\n");
     return NULL;
@@ -297,15 +397,19 @@ struct task_struct *task_create(char *task_name,
   se->load.weight = prio_to_weight[new_task->prio];
   se->load.inv_weight = prio_to_wmult[new_task->prio];
 
-  // set context, sp and pc
-  kernel_memset(&(new_task->context), 0, sizeof(context));
-  new_task->context.epc = (unsigned int)entry;
-  new_task->context.sp = (unsigned int)tmp + TASK_KERNEL_SIZE;
+  // build the first trap frame at the top of the kernel stack, the task
+  // starts when the exception return path restores it
+  // the stack starts at the top as well, the frame is used up by then
+  new_task->frame =
+      (reg_context_t *)((unsigned int)tmp + TASK_KERNEL_SIZE) - 1;
+  kernel_memset(new_task->frame, 0, sizeof(context));
+  new_task->frame->epc = (unsigned int)entry;
+  new_task->frame->sp = (unsigned int)tmp + TASK_KERNEL_SIZE;
   unsigned int init_gp;
   asm volatile("la %0, _gp\n\t" : "=r"(init_gp));
-  new_task->context.gp = init_gp;
-  new_task->context.a0 = argc;
-  new_task->context.a1 = (unsigned int)args;
+  new_task->frame->gp = init_gp;
+  new_task->frame->a0 = argc;
+  new_task->frame->a1 = (unsigned int)args;
 
   // add task and set its state
   enqueue_task_fair(&cfs_rq, new_task);
@@ -315,8 +419,12 @@ struct task_struct *task_create(char *task_name,
 
   // if user mode
   // allocate vm and user mem
+  // the asid is allocated when the task is first switched in
+  new_task->asid = 0;
+  new_task->mm_rb.rb_node = NULL;
   if (user_mode != 0) {
     new_task->vm = vm_create();
+    vma_init(new_task);
     memory_pool_create(new_task);
   } else {
     new_task->vm = NULL;
@@ -325,10 +433,20 @@ struct task_struct *task_create(char *task_name,
   }
 
   // update cfs_rq
+  // in dynamic mode a second runnable task restarts a stopped tick
   new_task->user_mode = user_mode;
   update_min_vruntime(&cfs_rq);
-  kernel_printf("[task_create]: name=%s pid=%d nice=%d\n", new_task->name,
-                new_task->pid, new_task->nice);
+  if (dynamic_tick) {
+    unsigned int old_ie = disable_interrupts();
+    sched_program_tick();
+    if (old_ie) {
+      enable_interrupts();
+    }
+  }
+  if (!task_quiet) {
+    kernel_printf("[task_create]: name=%s pid=%d nice=%d\n", new_task->name,
+                  new_task->pid, new_task->nice);
+  }
   return new_task;
 }
 
@@ -339,36 +457,41 @@ void task_kill(pid_t pid) {
     return;
   }
   unsigned int old_ie = disable_interrupts();
-  struct list_head *pos;
   struct task_struct *p, *to_be_freed = NULL;
   bool is_cur = false;
 
-  // go through all tasks
-  list_for_each(pos, &task_all) {
-    p = container_of(pos, struct task_struct, task_node);
-    if (p && p->pid == pid) {
-      // if (kernel_strcmp(p->name, "powershell") == 0) {
-      //   powershell_killed = 1;
-      // }
-      // if match
-      // delete task from cfs_rq and list
-      // also reset vm and mem pool
-      to_be_freed = p;
-      delete_task(p);
-      unset_state(p);
-      dequeue_task_fair(&cfs_rq, p);
-      p->state = TASK_DEAD;
-      if (p->user_mode != 0) {
-        vm_delete(p);
-        memory_pool_delete(p);
-      }
-      // free pid
-      free_real_pid(p);
-      break;
+  // pids from the shell and syscalls are root namespace pids
+  p = find_task_by_pid_ns(pid, root_pid_namespace);
+  if (p == NULL) {
+    kernel_printf("task_kill: no process %d\n", pid);
+    if (old_ie) {
+      enable_interrupts();
     }
+    return;
+  }
+  // if (kernel_strcmp(p->name, "powershell") == 0) {
+  //   powershell_killed = 1;
+  // }
+  // delete task from cfs_rq and list
+  // also reset vm and mem pool
+  to_be_freed = p;
+  delete_task(p);
+  unset_state(p);
+  if (p->state != TASK_WAITING) {
+    dequeue_task_fair(&cfs_rq, p);
+  }
+  p->state = TASK_DEAD;
+  if (p->user_mode != 0) {
+    // the pool pages go first, vm_delete frees the page tables
+    memory_pool_delete(p);
+    vm_delete(p);
   }
+  // free pid
+  free_real_pid(p);
   update_min_vruntime(&cfs_rq);
-  kernel_printf("[task_kill] kill process %d\n", p->pid);
+  if (!task_quiet) {
+    kernel_printf("[task_kill] kill process %d\n", p->pid);
+  }
   if (to_be_freed) {
     // kfree(to_be_freed);
   }
@@ -397,24 +520,20 @@ void task_wait(pid_t pid) {
     return;
   }
   unsigned int old_ie = disable_interrupts();
-  struct list_head *pos;
   struct task_struct *p;
   bool is_cur = false;
-  list_for_each(pos, &task_all) {
-    p = container_of(pos, struct task_struct, task_node);
-    if (p && p->pid == pid) {
-      if (p == current_task) {
-        update_curr(&cfs_rq, delta);
-        is_cur = true;
-        cfs_rq.NEED_SCHED = true;
-      }
-      // remove from running queue and list
-      unset_state(p);
-      set_state(p, &task_waiting);
-      dequeue_task_fair(&cfs_rq, p);
-      p->state = TASK_WAITING;
-      break;
+  p = find_task_by_pid_ns(pid, root_pid_namespace);
+  if (p && p->state != TASK_WAITING) {
+    if (p == current_task) {
+      update_curr(&cfs_rq, delta);
+      is_cur = true;
+      cfs_rq.NEED_SCHED = true;
     }
+    // remove from running queue and list
+    unset_state(p);
+    set_state(p, &task_waiting);
+    dequeue_task_fair(&cfs_rq, p);
+    p->state = TASK_WAITING;
   }
   // update time info
   update_min_vruntime(&cfs_rq);
@@ -439,24 +558,25 @@ void task_wakeup(pid_t pid) {
   }
   unsigned int old_ie = disable_interrupts();
   update_curr(&cfs_rq, delta);
-  struct list_head *pos;
+  // the time is charged now, the next tick must not charge it again
+  asm volatile("mtc0 $zero, $9\n\t");
   struct task_struct *p;
   bool is_cur = false;
-  list_for_each(pos, &task_waiting) {
-    p = container_of(pos, struct task_struct, state_node);
-    if (p && p->pid == pid) {
-      unset_state(p);
-      set_state(p, &task_ready);
-      enqueue_task_fair(&cfs_rq, p);
-      p->state = TASK_READY;
-      p->se.vruntime =
-          max(p->se.vruntime, cfs_rq.min_vruntime - NICE_0_LOAD * 8);
-      // check whether the wake up process needs schedule
-      check_preempt_wakeup(&cfs_rq, p);
-      break;
-    }
+  // only a task on task_waiting can be woken up
+  p = find_task_by_pid_ns(pid, root_pid_namespace);
+  if (p && p->state == TASK_WAITING) {
+    unset_state(p);
+    set_state(p, &task_ready);
+    // the key must be final before the se goes into the tree
+    p->se.vruntime =
+        max(p->se.vruntime, cfs_rq.min_vruntime - NICE_0_LOAD * 8);
+    enqueue_task_fair(&cfs_rq, p);
+    p->state = TASK_READY;
+    // check whether the wake up process needs schedule
+    check_preempt_wakeup(&cfs_rq, p);
   }
   update_min_vruntime(&cfs_rq);
+  sched_program_tick();
   kernel_printf("[task_wakeup]: wake process %d\n", pid);
   if (old_ie) {
     enable_interrupts();
@@ -495,12 +615,49 @@ void task_exit_syscall(unsigned int status, unsigned int cause,
     next = init;
     return;
   }
-  copy_context(&(next->context), pc_context);
+  unsigned int switch_start = get_cp0_count();
+  switch_frame(next);
+  put_prev_task_fair(&cfs_rq, current_task);
   current_task = next;
   current_task->state = TASK_RUNNING;
-  cfs_rq.curr = &current_task->se;
-  set_active_asid(current_task->pid);
+  set_next_task_fair(&cfs_rq, current_task);
+  vm_activate(current_task);
+  switch_cycles += get_cp0_count() - switch_start;
+  nr_switches++;
   task_kill(pid_to_kill);
+  // the next task starts a fresh accounting period, like task_schedule
+  if (dynamic_tick) {
+    asm volatile("mtc0 $zero, $9\n\t");
+    sched_program_tick();
+  }
+}
+
+// fork syscall
+// the child gets a copy-on-write copy of the address space and returns
+// to the same user pc with v0 = 0, the parent gets the child pid in v0
+// only a process on a user-space stack can be forked, a stack inside
+// the task_union can not be shared by two processes
+void task_fork_syscall(unsigned int status, unsigned int cause,
+                       context *pt_context) {
+  struct task_struct *child;
+  if (current_task->user_mode == 0 || current_task->vm == NULL ||
+      pt_context->sp >= KERNEL_ENTRY) {
+    kernel_printf("[fork]: process %s can not be forked\n", current_task->name);
+    pt_context->v0 = -1;
+    return;
+  }
+  child = task_create(current_task->name, (void *)pt_context->epc, 0, 0,
+                      current_task->nice, 0);
+  if (child == NULL) {
+    pt_context->v0 = -1;
+    return;
+  }
+  child->user_mode = 1;
+  child->parent = current_task;
+  vm_fork(current_task, child);
+  copy_context(pt_context, child->frame);
+  child->frame->v0 = 0;
+  pt_context->v0 = child->pid;
 }
 
 // get current process
@@ -525,16 +682,34 @@ int task_exec_from_file(char *filename) {
   }
 
   // load program text
+  // the image lives in the low area of the address space (see vma_init),
+  // below the heap
   unsigned int size = file->f_dentry->d_inode->i_size;
+  if (size > VMA_LOW_END) {
+    kernel_printf("[exec]: %s is too large\n", filename);
+    if (old_ie) {
+      enable_interrupts();
+    }
+    return 1;
+  }
   unsigned int n = size / CACHE_BLOCK_SIZE + 1;
   unsigned int i = 0;
   unsigned int j = 0;
-  void *user_proc_entry = (void *)kmalloc(size);
+  // the image only has to be virtually contiguous, its pages are handed
+  // over to the user page table one by one below
+  void *user_proc_entry = vmalloc(size);
   u32 base = 0;
 
-  
+  if (!user_proc_entry) {
+    kernel_printf("[exec]: No memory for %s\n", filename);
+    if (old_ie) {
+      enable_interrupts();
+    }
+    return 1;
+  }
   if (vfs_read(file, (char *)user_proc_entry, size, &base) != size) {
     kernel_printf("[exec]:File %s read failed\n", filename);
+    vfree(user_proc_entry);
     if (old_ie) {
       enable_interrupts();
     }
@@ -545,7 +720,12 @@ int task_exec_from_file(char *filename) {
   
   // set vma mapping
   // important for address tranlation
-  vma_set_mapping(pcb, 0, user_proc_entry);
+  for (i = 0; i < size; i += 1 << PAGE_SHIFT) {
+    vma_set_mapping(pcb, (void *)i,
+                    vmalloc_to_kaddr((char *)user_proc_entry + i));
+  }
+  // the pages belong to the process now, only drop the kernel mapping
+  vunmap(user_proc_entry);
   kernel_printf("[exec]: success, run user program %s\n", filename);
   if (old_ie) {
     enable_interrupts();
@@ -579,3 +759,79 @@ int print_proc() {
                   p->se.vruntime, state_to_string(p->state));
   }
 }
+
+#define PID_STRESS_ROUNDS 4
+#define PID_STRESS_TASKS 32
+
+// body of the processes created by pid_stress, they are killed right away
+static void pid_stress_proc(unsigned int argc, void *args) {
+  while (1)
+    ;
+}
+
+// create and kill batches of kernel processes, then time the raw allocator
+// pids keep moving up since the cursor only wraps at the end of the map
+void pid_stress() {
+  struct task_struct *tasks[PID_STRESS_TASKS];
+  unsigned int round, i, old_ie, start;
+  unsigned int create_cycles = 0, kill_cycles = 0, nr = 0;
+  pid_t first_pid = -1, last_pid = -1;
+
+  task_quiet = true;
+  for (round = 0; round < PID_STRESS_ROUNDS; round++) {
+    old_ie = disable_interrupts();
+    start = get_cp0_count();
+    for (i = 0; i < PID_STRESS_TASKS; i++) {
+      tasks[i] = task_create("pid_stress", pid_stress_proc, 0, 0, 0, 0);
+      if (tasks[i]) {
+        if (first_pid < 0) {
+          first_pid = tasks[i]->pid;
+        }
+        last_pid = tasks[i]->pid;
+        nr++;
+      }
+    }
+    create_cycles += get_cp0_count() - start;
+    start = get_cp0_count();
+    for (i = 0; i < PID_STRESS_TASKS; i++) {
+      if (tasks[i]) {
+        // task_kill keeps the PCB, these never ran so it can go here
+        task_kill(tasks[i]->pid);
+        kmem_cache_free(task_union_cachep, (union task_union *)tasks[i]);
+      }
+    }
+    kill_cycles += get_cp0_count() - start;
+    if (old_ie) {
+      enable_interrupts();
+    }
+  }
+  task_quiet = false;
+  kernel_printf("pid stress: %d processes, pids %d..%d\n", nr, first_pid,
+                last_pid);
+  if (nr) {
+    kernel_printf("\tcreate : %d cycles/process\n", create_cycles / nr);
+    kernel_printf("\tkill   : %d cycles/process\n", kill_cycles / nr);
+  }
+  pid_bench();
+}
+
+// context switch counters, for benchmarks that measure a window
+void sched_switch_stat(unsigned int *nr, unsigned int *cycles) {
+  *nr = nr_switches;
+  *cycles = switch_cycles;
+}
+
+// print scheduler statistics
+int sched_stat() {
+  kernel_printf("timer ticks : %d (%s%s)\n", nr_ticks,
+                dynamic_tick ? "dynamic" : "static",
+                tick_stopped ? ", stopped" : "");
+  kernel_printf("context switches : %d\n", nr_switches);
+  if (nr_switches) {
+    kernel_printf("\tavg cycles per switch : %d\n",
+                  switch_cycles / nr_switches);
+  }
+  kernel_printf("TLB :\n");
+  tlb_stat();
+  return 0;
+}
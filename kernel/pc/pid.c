@@ -1,21 +1,98 @@
+#include <arch.h>
+#include <intr.h>
 #include <zjunix/pc.h>
 #include <zjunix/pid.h>
 #include <zjunix/slab.h>
-#define PID_MAX_HASH_ENTRY 4
 
-struct hlist_head pid_hashtable[PID_MAX_HASH_ENTRY];
+// the pid hash starts with 1 << PID_HASH_MIN_SHIFT buckets and doubles
+// whenever the chains get longer than PID_HASH_LOAD on average
+#define PID_HASH_MIN_SHIFT 4
+#define PID_HASH_MAX_SHIFT 12
+#define PID_HASH_LOAD 2
+
+// one upid per namespace level is hashed, keyed by (nr, ns)
+static struct hlist_head pid_hash_min[1 << PID_HASH_MIN_SHIFT];
+static struct hlist_head *pid_hashtable;
+static unsigned int pid_hash_shift;
+static unsigned int nr_pid_hashed;
 
 // our hash function
 unsigned int pid_hash_function(pid_t nr, struct pid_namespace *ns) {
-  return (nr + ns->level) % PID_MAX_HASH_ENTRY;
+  unsigned int key = (unsigned int)nr ^ ((unsigned int)ns >> 4);
+  return (key * 0x9e370001) >> (32 - pid_hash_shift);
 }
 
 void init_pid_module() {
   int i = 0;
-  for (i = 0; i < PID_MAX_HASH_ENTRY; ++i) {
+  pid_hashtable = pid_hash_min;
+  pid_hash_shift = PID_HASH_MIN_SHIFT;
+  nr_pid_hashed = 0;
+  for (i = 0; i < (1 << PID_HASH_MIN_SHIFT); ++i) {
     INIT_HLIST_HEAD(&pid_hashtable[i]);
   }
 }
+
+// move every upid into a table of 1 << shift buckets
+// called with interrupts off, the old table stays if kmalloc fails
+static void pid_hash_resize(unsigned int shift) {
+  struct hlist_head *old_table = pid_hashtable;
+  unsigned int old_size = 1 << pid_hash_shift;
+  struct hlist_head *table;
+  struct hlist_node *pos, *n;
+  struct upid *upid;
+  unsigned int i;
+
+  table = (struct hlist_head *)kmalloc(sizeof(struct hlist_head) << shift);
+  if (table == NULL) {
+    return;
+  }
+  for (i = 0; i < (1 << shift); ++i) {
+    INIT_HLIST_HEAD(&table[i]);
+  }
+  pid_hashtable = table;
+  pid_hash_shift = shift;
+  for (i = 0; i < old_size; ++i) {
+    hlist_for_each_safe(pos, n, &old_table[i]) {
+      upid = hlist_entry(pos, struct upid, pid_chain);
+      hlist_add_head(&upid->pid_chain,
+                     &table[pid_hash_function(upid->nr, upid->ns)]);
+    }
+  }
+  if (old_table != pid_hash_min) {
+    kfree(old_table);
+  }
+}
+
+static void pid_hash_add(struct upid *upid) {
+  unsigned int old_ie = disable_interrupts();
+  if (nr_pid_hashed >= (PID_HASH_LOAD << pid_hash_shift) &&
+      pid_hash_shift < PID_HASH_MAX_SHIFT) {
+    pid_hash_resize(pid_hash_shift + 1);
+  }
+  hlist_add_head(&upid->pid_chain,
+                 &pid_hashtable[pid_hash_function(upid->nr, upid->ns)]);
+  ++nr_pid_hashed;
+  if (old_ie) {
+    enable_interrupts();
+  }
+}
+
+static void pid_hash_del(struct upid *upid) {
+  unsigned int old_ie = disable_interrupts();
+  if (!hlist_unhashed(&upid->pid_chain)) {
+    hlist_del_init(&upid->pid_chain);
+    --nr_pid_hashed;
+  }
+  // give memory back once the table is mostly empty
+  if (pid_hash_shift > PID_HASH_MIN_SHIFT &&
+      nr_pid_hashed < (1 << (pid_hash_shift - 2))) {
+    pid_hash_resize(pid_hash_shift - 1);
+  }
+  if (old_ie) {
+    enable_interrupts();
+  }
+}
+
 // static inline struct pid *task_pid(struct task_struct *task) {
 //   return task->pids[PIDTYPE_PID].pid;
 // }
@@ -28,56 +105,49 @@ void init_pid_module() {
 //   return task->group_leader->pids[PIDTYPE_PGID].pid;
 // }
 
-// static inline pid_t pid_nr_ns(struct pid *pid, struct pid_namespace *ns) {
-//   struct upid *upid;
-//   pid_t nr = 0;
-//   if (pid && ns->level <= pid->level) {
-//     upid = &pid->numbers[ns->level];
-//     if (upid->ns == ns) {
-//       nr = upid->nr;
-//     }
-//   }
-//   return nr;
-// }
-
-// pid_t get_pid_val_by_task_ns(struct task_struct *task,
-//                              struct pid_namespace *ns) {
-//   return pid_nr_ns(task_pid(task), ns);
-// }
+static inline pid_t pid_nr_ns(struct pid *pid, struct pid_namespace *ns) {
+  struct upid *upid;
+  pid_t nr = 0;
+  if (pid && ns->level <= pid->level) {
+    upid = &pid->numbers[ns->level];
+    if (upid->ns == ns) {
+      nr = upid->nr;
+    }
+  }
+  return nr;
+}
 
-// pid_t get_tgid_val_by_task_ns(struct task_struct *task,
-//                               struct pid_namespace *ns) {
-//   return pid_nr_ns(task_tgid(task), ns);
-// }
+pid_t get_pid_val_by_task_ns(struct task_struct *task,
+                             struct pid_namespace *ns) {
+  return pid_nr_ns(&task->real_pid, ns);
+}
 
-// pid_t get_pgid_val_by_task_ns(struct task_struct *task,
-//                               struct pid_namespace *ns) {
-//   return pid_nr_ns(task_pgid(task), ns);
-// }
+// find the pid numbered nr in ns, NULL if there is none
+struct pid *get_pid_by_pid_val_ns(pid_t nr, struct pid_namespace *ns) {
+  struct hlist_node *pos;
+  struct upid *upid;
+  struct hlist_head *head = &(pid_hashtable[pid_hash_function(nr, ns)]);
+  hlist_for_each(pos, head) {
+    upid = hlist_entry(pos, struct upid, pid_chain);
+    if (upid->nr == nr && upid->ns == ns) {
+      return container_of(upid, struct pid, numbers[ns->level]);
+    }
+  }
+  return NULL;
+}
 
-// struct pid *get_pid_by_pid_val_ns(pid_t nr, struct pid_namespace *ns) {
-//   struct hlist_node *elem;
-//   struct upid *upid;
-//   struct hlist_head *head = &(pid_hashtable[pid_hash_function(nr, ns)]);
-//   hlist_for_each_entry(upid, head, pid_chain) {
-//     if (upid && upid->nr == nr && upid->ns == ns) {
-//       return container_of(upid, struct pid, numbers[ns->level]);
-//     }
-//   }
-//   return NULL;
-// }
+// every pid is owned by exactly one task, process groups are not kept
+struct task_struct *get_task_by_pid(struct pid *pid, enum pid_type type) {
+  if (pid && type == PIDTYPE_PID) {
+    return pid->task_ptr;
+  }
+  return NULL;
+}
 
-// struct task_struct *get_task_by_pid(struct pid *pid, enum pid_type type) {
-//   struct task_struct *result = NULL;
-//   if (pid) {
-//     struct hlist_node *first;
-//     first = pid->tasks[type].first;
-//     if (first) {
-//       result = hlist_entry(first, struct task_struct, pids[(type)].node);
-//     }
-//   }
-//   return result;
-// }
+// the task numbered nr in ns, NULL if there is none
+struct task_struct *find_task_by_pid_ns(pid_t nr, struct pid_namespace *ns) {
+  return get_task_by_pid(get_pid_by_pid_val_ns(nr, ns), PIDTYPE_PID);
+}
 
 bool pid_namespace_empty(struct pid_namespace *ns) {
   return ns->pidmap.nr_free == PIDMAP_MAX_ENTRY;
@@ -89,63 +159,92 @@ bool pid_namespace_full(struct pid_namespace *ns) {
 
 void init_pidmap(struct pidmap *pidmap) {
   pidmap->nr_free = PIDMAP_MAX_ENTRY;
-  int i;
-  for (i = 0; i < PIDMAP_BYTE; ++i) {
-    pidmap->data[i] = 0;
-  }
+  kernel_memset(pidmap->summary, 0, sizeof(pidmap->summary));
+  kernel_memset(pidmap->data, 0, sizeof(pidmap->data));
+}
+
+// index of the lowest set bit, x must not be 0
+static inline int pidmap_lowest_bit(unsigned int x) {
+  unsigned int lz;
+  x &= -x;
+  asm volatile("clz %0, %1\n\t" : "=r"(lz) : "r"(x));
+  return 31 - lz;
 }
 
-static bool pidmap_id_is_valid(int index, int offset, struct pidmap *map) {
-  if (map->data[index] & (1 << offset))
-    return false;
-  else
-    return true;
+// first free pid at or after start, -1 if there is none up to the end
+static int pidmap_find_free(struct pidmap *map, int start) {
+  int word = start >> 5;
+  int sword;
+  unsigned int bits;
+
+  // the rest of the first data word
+  bits = ~map->data[word] & (~0u << (start & 31));
+  if (bits) {
+    return (word << 5) + pidmap_lowest_bit(bits);
+  }
+  // then a whole summary word at a time
+  ++word;
+  while (word < PIDMAP_WORDS) {
+    sword = word >> 5;
+    bits = ~map->summary[sword] & (~0u << (word & 31));
+    if (bits) {
+      word = (sword << 5) + pidmap_lowest_bit(bits);
+      if (word >= PIDMAP_WORDS) {
+        return -1;
+      }
+      return (word << 5) + pidmap_lowest_bit(~map->data[word]);
+    }
+    word = (sword + 1) << 5;
+  }
+  return -1;
 }
 
-static void pidmap_id_alloc(int index, int offset, struct pidmap *map) {
-  map->data[index] |= (1 << offset);
+static void pidmap_id_alloc(pid_t nr, struct pidmap *map) {
+  int word = nr >> 5;
+  map->data[word] |= 1 << (nr & 31);
+  if (map->data[word] == 0xffffffff) {
+    map->summary[word >> 5] |= 1 << (word & 31);
+  }
   map->nr_free--;
 }
 
-static void pidmap_id_free(int index, int offset, struct pidmap *map) {
-  map->data[index] &= (~(1 << offset));
+static void pidmap_id_free(pid_t nr, struct pidmap *map) {
+  int word = nr >> 5;
+  map->data[word] &= ~(1 << (nr & 31));
+  map->summary[word >> 5] &= ~(1 << (word & 31));
   map->nr_free++;
 }
 
+// the search starts after the last pid handed out, and wraps around to 0
+// once, so recently freed pids are not reused at once
 static pid_t alloc_pid_val_from_ns(struct pid_namespace *ns) {
   struct pidmap *map = &(ns->pidmap);
   if (pid_namespace_full(ns) || !map) {
     return -1;
   }
   pid_t res = ns->last_pid + 1;
-  int index, offset;
-  while (true) {
-    if (res >= PIDMAP_MAX_ENTRY) {
-      res %= PIDMAP_MAX_ENTRY;
-    }
-    index = res >> 3;
-    offset = res & 0x07;
-    kernel_printf("index=%d, offset=%d\n", index, offset);
-    if (pidmap_id_is_valid(index, offset, map)) {
-      pidmap_id_alloc(index, offset, map);
-      kernel_printf("[pid_alloc] res=%d\n", res);
-      ns->last_pid = res;
-      return res;
-    } else {
-      ++res;
-    }
+  if (res >= PIDMAP_MAX_ENTRY) {
+    res = 0;
+  }
+  res = pidmap_find_free(map, res);
+  if (res < 0) {
+    res = pidmap_find_free(map, 0);
+  }
+  if (res < 0) {
+    return -1;
   }
+  pidmap_id_alloc(res, map);
+  ns->last_pid = res;
+  return res;
 }
 
 static void free_pid_val_from_ns(pid_t val, struct pid_namespace *ns) {
   struct pidmap *map = &(ns->pidmap);
-  if (pid_namespace_empty(ns) || !map) {
+  if (pid_namespace_empty(ns) || !map || val < 0 || val >= PIDMAP_MAX_ENTRY) {
     return;
   }
-  int index = val >> 3;
-  int offset = val & 0x07;
-  if (!pidmap_id_is_valid(index, offset, map)) {
-    pidmap_id_free(index, offset, map);
+  if (map->data[val >> 5] & (1 << (val & 31))) {
+    pidmap_id_free(val, map);
   }
 }
 
@@ -209,9 +308,6 @@ int assign_real_pid_from_ns(struct task_struct *task,
   task->real_pid.task_ptr = task;
   for (i = ns->level; tmp_ns != NULL && i >= 0; --i) {
     task->real_pid.numbers[i].nr = alloc_pid_val_from_ns(tmp_ns);
-    kernel_printf(
-        "[pid][assign_real_pid_from_ns]: alloc id %d in namespace %d\n",
-        task->real_pid.numbers[i].nr, tmp_ns->level);
     if (task->real_pid.numbers[i].nr == -1) {
       kernel_printf(
           "[pid][assign_real_pid_from_ns]: cannot assign new pid in namespace "
@@ -220,10 +316,8 @@ int assign_real_pid_from_ns(struct task_struct *task,
       return 1;
     }
     task->real_pid.numbers[i].ns = tmp_ns;
-    hlist_add_head(&task->real_pid.numbers[i].pid_chain,
-                   &pid_hashtable[pid_hash_function(
-                       task->real_pid.numbers[i].nr, tmp_ns)]);
-    tmp_ns = ns;
+    pid_hash_add(&task->real_pid.numbers[i]);
+    tmp_ns = tmp_ns->parent;
   }
   return 0;
 }
@@ -239,6 +333,58 @@ int free_real_pid(struct task_struct *task) {
       kernel_printf("[pid][free_real_pid]: ns should not be NULL\n");
     }
     free_pid_val_from_ns(task->real_pid.numbers[level].nr, ns);
-    hlist_del_init(&(task->real_pid.numbers[level].pid_chain));
+    pid_hash_del(&task->real_pid.numbers[level]);
+  }
+}
+
+
+#define PID_BENCH_CHURN 4096
+
+// allocator cost on a private namespace: fill every pid, then free and
+// allocate again with the cursor wrapping around, then drain
+// interrupts stay off while timing, the timer tick clears Count
+void pid_bench() {
+  struct pid_namespace *ns = pid_namespace_create(NULL);
+  unsigned int start, fill_cycles, churn_cycles, free_cycles;
+  unsigned int old_ie;
+  int i, failed = 0;
+  pid_t nr;
+
+  if (ns == NULL) {
+    kernel_printf("pid bench: no memory\n");
+    return;
   }
-}
\ No newline at end of file
+  old_ie = disable_interrupts();
+  start = get_cp0_count();
+  for (i = 0; i < PIDMAP_MAX_ENTRY; i++) {
+    if (alloc_pid_val_from_ns(ns) < 0) {
+      failed++;
+    }
+  }
+  fill_cycles = get_cp0_count() - start;
+
+  // free a scattered pid and take the next free one, the map stays full
+  start = get_cp0_count();
+  for (i = 0; i < PID_BENCH_CHURN; i++) {
+    free_pid_val_from_ns((i * 37) & (PIDMAP_MAX_ENTRY - 1), ns);
+    if (alloc_pid_val_from_ns(ns) < 0) {
+      failed++;
+    }
+  }
+  churn_cycles = get_cp0_count() - start;
+
+  start = get_cp0_count();
+  for (nr = 0; nr < PIDMAP_MAX_ENTRY; nr++) {
+    free_pid_val_from_ns(nr, ns);
+  }
+  free_cycles = get_cp0_count() - start;
+  if (old_ie) {
+    enable_interrupts();
+  }
+  kernel_printf("pid bench: %d pids, %d failed\n", PIDMAP_MAX_ENTRY, failed);
+  kernel_printf("\tfill  : %d cycles/alloc\n", fill_cycles / PIDMAP_MAX_ENTRY);
+  kernel_printf("\tchurn : %d cycles/free+alloc\n",
+                churn_cycles / PID_BENCH_CHURN);
+  kernel_printf("\tdrain : %d cycles/free\n", free_cycles / PIDMAP_MAX_ENTRY);
+  kfree(ns);
+}
@@ -15,8 +15,24 @@
 static semaphore_struct semaphores;
 
 
+// 等待队列项的专用 slab 缓存
+static struct kmem_cache* semaphore_wait_cachep;
+
+
+// 等待队列项的构造函数，释放前需用 list_del_init 恢复
+static void semaphore_wait_ctor(void* object) {
+    semaphore_waiting_process_queue_struct* wait = object;
+    INIT_LIST_HEAD(&wait->list);
+}
+
+
 // 初始化信号量结构链表
-void semaphore_init() { INIT_LIST_HEAD(&semaphores.list); }
+void semaphore_init() {
+    INIT_LIST_HEAD(&semaphores.list);
+    semaphore_wait_cachep = kmem_cache_create(
+        "semaphore_wait", sizeof(semaphore_waiting_process_queue_struct), 0,
+        semaphore_wait_ctor);
+}
 
 
 // 创建新的信号量
@@ -30,8 +46,7 @@ int semaphore_create(void* name, int count) {
     semaphore = kmalloc(sizeof(semaphore_struct));
     kernel_strcpy(semaphore->name, name);
     semaphore->count = count;
-    semaphore->wait = kmalloc(sizeof(semaphore_waiting_process_queue_struct));
-    INIT_LIST_HEAD(&semaphore->wait->list);
+    semaphore->wait = kmem_cache_alloc(semaphore_wait_cachep);
     list_add(&(semaphore->list), &(semaphores.list));
     return 0;
 }
@@ -64,7 +79,7 @@ void semaphore_wait(void* name) {
     if (semaphore->count < 0) {
         // 小于0了，则加入等待队列，并挂起进程
         semaphore_waiting_process_queue_struct* wait =
-            kmalloc(sizeof(semaphore_waiting_process_queue_struct));
+            kmem_cache_alloc(semaphore_wait_cachep);
         wait->pid = get_current_task()->pid;
         list_add_tail(&(wait->list), &(semaphore->wait->list));
         kernel_printf("[semaphore_wait]process id:%d blocked\n", wait->pid);
@@ -99,6 +114,7 @@ void semaphore_signal(void* name) {
         // 从队列中删除
         list_del_init(&wait->list);
         kernel_printf("[semaphore_signal]process id:%d wakeup\n", wait->pid);
+        kmem_cache_free(semaphore_wait_cachep, wait);
     }
     if (old_ie) {
         // 开中断
@@ -205,6 +221,7 @@ void customer_proc() {
     // 创建共享内存页
     asm volatile(
         "move $a0, %1\n\t"
+        "move $a1, $zero\n\t"
         "li $v0, 50\n\t"
         "syscall\n\t"
         "move %0, $v0"
@@ -265,6 +282,7 @@ void producer_proc() {
     // 创建共享内存页
     asm volatile(
         "move $a0, %1\n\t"
+        "move $a1, $zero\n\t"
         "li $v0, 50\n\t"
         "syscall\n\t"
         "move %0, $v0"
@@ -300,4 +318,46 @@ void producer_proc() {
         "syscall\n\t");
 }
 
+#define PINGPONG_ROUNDS 32
+
+
+// 乒乓测试的 ping 进程：与 pong 进程通过信号量轮流运行
+// 每一轮至少两次进程切换，结束时统计这段时间内切换的平均周期数
+void ping_proc() {
+    unsigned int nr_start, cycles_start, nr_end, cycles_end;
+    unsigned int i;
+    sched_switch_stat(&nr_start, &cycles_start);
+    for (i = 0; i < PINGPONG_ROUNDS; i++) {
+        semaphore_signal("pong");
+        semaphore_wait("ping");
+    }
+    sched_switch_stat(&nr_end, &cycles_end);
+    kernel_printf("[ping_proc]%d rounds, %d switches\n", PINGPONG_ROUNDS,
+                  nr_end - nr_start);
+    if (nr_end != nr_start) {
+        kernel_printf("[ping_proc]avg cycles per switch: %d\n",
+                      (cycles_end - cycles_start) / (nr_end - nr_start));
+    }
+    semaphore_delete("ping");
+    semaphore_delete("pong");
+    // 退出进程
+    asm volatile(
+        "li $v0, 16\n\t"
+        "syscall\n\t");
+}
+
+
+// 乒乓测试的 pong 进程
+void pong_proc() {
+    unsigned int i;
+    for (i = 0; i < PINGPONG_ROUNDS; i++) {
+        semaphore_wait("pong");
+        semaphore_signal("ping");
+    }
+    // 退出进程
+    asm volatile(
+        "li $v0, 16\n\t"
+        "syscall\n\t");
+}
+
 #pragma GCC pop_options
\ No newline at end of file
@@ -18,7 +18,7 @@ void init_syscall() {
     register_syscall(6, syscall6);
     register_syscall(7, syscall7);
 
-    // page share
+    // shared memory create(name, size) / delete
     register_syscall(50, syscall50);
     register_syscall(51, syscall51);
 
@@ -26,6 +26,10 @@ void init_syscall() {
     register_syscall(60, syscall60);
     register_syscall(61, syscall61);
 
+    // mmap & munmap
+    register_syscall(80, syscall80);
+    register_syscall(81, syscall81);
+
     // semaphore create / wait / signal
     register_syscall(70, syscall70);
     register_syscall(71, syscall71);
@@ -36,6 +40,7 @@ void init_syscall() {
     // task & schedule
     register_syscall(15, task_schedule);
     register_syscall(16, task_exit_syscall);
+    register_syscall(17, task_fork_syscall);
 }
 
 void syscall(unsigned int status, unsigned int cause, context* pt_context) {
@@ -78,7 +83,8 @@ void syscall7(unsigned int status, unsigned int cause, context* pt_context) {
 
 void syscall50(unsigned int status, unsigned int cause, context* pt_context) {
     void* virtual_addr =
-        shared_page_create(get_current_task(), (unsigned char*)pt_context->a0);
+        shared_page_create(get_current_task(), (unsigned char*)pt_context->a0,
+                           pt_context->a1);
     pt_context->v0 = (unsigned int)virtual_addr;
 }
 
@@ -97,6 +103,18 @@ void syscall61(unsigned int status, unsigned int cause, context* pt_context) {
     pt_context->v0 = ret;
 }
 
+void syscall80(unsigned int status, unsigned int cause, context* pt_context) {
+    void* virtual_addr =
+        vm_mmap(get_current_task(), (const char*)pt_context->a0,
+                pt_context->a1, pt_context->a2, pt_context->a3);
+    pt_context->v0 = (unsigned int)virtual_addr;
+}
+
+void syscall81(unsigned int status, unsigned int cause, context* pt_context) {
+    int ret = vm_munmap(get_current_task(), (void*)pt_context->a0);
+    pt_context->v0 = ret;
+}
+
 void syscall70(unsigned int status, unsigned int cause, context* pt_context) {
     char* name = (char*)pt_context->a0;
     int count = pt_context->a1;
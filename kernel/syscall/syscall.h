@@ -11,6 +11,8 @@ void syscall50(unsigned int status, unsigned int cause, context* pt_context);
 void syscall51(unsigned int status, unsigned int cause, context* pt_context);
 void syscall60(unsigned int status, unsigned int cause, context* pt_context);
 void syscall61(unsigned int status, unsigned int cause, context* pt_context);
+void syscall80(unsigned int status, unsigned int cause, context* pt_context);
+void syscall81(unsigned int status, unsigned int cause, context* pt_context);
 void syscall70(unsigned int status, unsigned int cause, context* pt_context);
 void syscall71(unsigned int status, unsigned int cause, context* pt_context);
 void syscall72(unsigned int status, unsigned int cause, context* pt_context);
@@ -85,8 +85,10 @@ void ext2_append_to_end(struct inode * inode, struct ext2_dir_entry_2 *in, u32 l
             kernel_printf("%send ext2_append_to_end: dirt page: %d\n", quad1, i);
 #endif
             ext2_writepage(page);
+            pcache_put_page(page);
             break;
         }
+        pcache_put_page(page);
     }
 
 }
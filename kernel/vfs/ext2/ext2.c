@@ -407,6 +407,7 @@ u32 ext2_delete_inode(struct dentry *dentry){
 
         if (found)
             break;                              // 跳出的是对每一页的循环
+        pcache_put_page(curPage);
     }
 
     // 如果没找到相应的inode
@@ -428,10 +429,13 @@ u32 ext2_delete_inode(struct dentry *dentry){
             *(paste_end+i) = 0;
 
         err = ext2_writepage(curPage);                      // 写回内存
-        if (err)
+        if (err) {
+            pcache_put_page(curPage);
             return err;
+        }
     }
 
+    pcache_put_page(curPage);
     return 0;
 }
 
@@ -562,6 +566,7 @@ struct dentry * ext2_inode_lookup(struct inode * dir, struct dentry * dentry, st
             }
             data += (ex_dir_entry->rec_len);
         }
+        pcache_put_page(curPage);
         if (found)
             break;                              // 跳出的是对每一页的循环
 
@@ -655,8 +660,10 @@ u32 ext2_readdir(struct file * file, struct getdent * getdent){
             qstr.name = ex_dir_entry->name;
 
             name = (u8 *)kmalloc(sizeof(u8) * (ex_dir_entry->name_len + 1));
-            if (name == 0)
+            if (name == 0) {
+                pcache_put_page(curPage);
                 return -ENOMEM;
+            }
             for (j = 0; j < ex_dir_entry->name_len; j++)
                 name[j] = qstr.name[j];
             name[j] = 0;
@@ -668,6 +675,7 @@ u32 ext2_readdir(struct file * file, struct getdent * getdent){
 
             data += (ex_dir_entry->rec_len);
         }
+        pcache_put_page(curPage);
     }
 
     return 0;
@@ -348,6 +348,7 @@ u32 fat32_delete_inode(struct dentry *dentry){
                 break;                          // 跳出的是对每一个目录项的循环
             }
         }
+        pcache_put_page(curPage);
         if (found)
             break;                              // 跳出的是对每一页的循环
     }
@@ -457,6 +458,7 @@ u32 fat32_write_inode(struct inode * inode, struct dentry * parent){
         }
         if (found)
             break;                              // 跳出的是对每一页的循环
+        pcache_put_page(curPage);
     }
 
     // 如果没找到相应的inode
@@ -465,6 +467,7 @@ u32 fat32_write_inode(struct inode * inode, struct dentry * parent){
 
     // 写入外存
     err = mapping->a_op->writepage(curPage);
+    pcache_put_page(curPage);
     if(err)
         return err;
     
@@ -624,6 +627,7 @@ struct dentry* fat32_inode_lookup(struct inode *dir, struct dentry *dentry, stru
                 break;                          // 跳出的是对每一个目录项的循环
             }
         }
+        pcache_put_page(curPage);
         if (found)
             break;                              // 跳出的是对每一页的循环
     }
@@ -754,6 +758,7 @@ u32 fat32_readdir(struct file * file, struct getdent * getdent){
 
             getdent->count += 1;
         }   // 页内循环
+        pcache_put_page(curPage);
     }       // 页际循环
 
     return 0;
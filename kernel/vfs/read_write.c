@@ -45,6 +45,7 @@ u32 generic_file_read(struct file *file, u8 *buf, u32 count, u32 *ppos) {
             read_count = page_no == end_page_no ? end_page_cur : blksize;
             kernel_memcpy(buf + cur, cur_page->p_data, read_count);
         }
+        pcache_put_page(cur_page);
 
         // cur既是当前buf的光标地址，也代表已经读了多少个字节
         cur += read_count;
@@ -104,6 +105,7 @@ u32 generic_file_write(struct file *file, u8 *buf, u32 count, u32 *ppos){
 
         // 最后写回内存
         mapping->a_op->writepage(cur_page);
+        pcache_put_page(cur_page);
 
         cur += write_count;
         *ppos += write_count;
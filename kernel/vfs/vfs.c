@@ -81,6 +81,7 @@ vfs_init_err:
 // 读取主引导记录并完善MBR相关信息
 u32 vfs_read_MBR(){
     u8  *ptr_lba;
+    u8  *ptr_size;
     u8  *ptr_type;
     u8  part_type;
     u32 part_lba;
@@ -96,6 +97,7 @@ u32 vfs_read_MBR(){
 
     // 完善MBR相关信息
     ptr_lba  = MBR->m_data + 446 + 8;
+    ptr_size = MBR->m_data + 446 + 12;
     ptr_type = MBR->m_data + 446 + 4;
     for (MBR->m_count = 0; MBR->m_count < DPT_MAX_ENTRY_COUNT; MBR->m_count++) {
         part_lba  = get_u32(ptr_lba);
@@ -104,9 +106,11 @@ u32 vfs_read_MBR(){
             break;
 
         MBR->m_base[MBR->m_count] = part_lba;
+        MBR->m_size[MBR->m_count] = get_u32(ptr_size);
         MBR->m_type[MBR->m_count] = part_type;
 
         ptr_lba  += DPT_ENTRY_LEN;
+        ptr_size += DPT_ENTRY_LEN;
         ptr_type += DPT_ENTRY_LEN;
 #ifdef DEBUG_VFS
         kernel_printf("  MBR[%d]: base: %d type: %x\n", MBR->m_count, part_lba, part_type);
@@ -125,6 +129,7 @@ u32 vfs_read_MBR(){
 
 vfs_read_MBR_err:
     kfree(MBR);
+    MBR = 0;
     return -EIO;
 }
 
@@ -7,10 +7,11 @@ extern struct address_space_operations ext2_address_space_operations;
 
 // 分配一个空的dentry对象，同时初始化其中的内容
 // 一般来说，初始化的时候 dentry内容全部置0
+// 链表已由 dentry_ctor 初始化，这里只设置其余成员
 struct dentry * alloc_dentry() {
     struct dentry * dentry;
 
-    dentry = (struct dentry *)kmalloc(sizeof(struct dentry));
+    dentry = (struct dentry *)kmem_cache_alloc(dentry_cachep);
     if (dentry == 0)
         return ERR_PTR(-ENOMEM);
 
@@ -23,11 +24,7 @@ struct dentry * alloc_dentry() {
     dentry->d_name.len    = 0;
     dentry->d_sb          = 0;
     dentry->d_op          = 0;
-    INIT_LIST_HEAD(&(dentry->d_hash));
-    INIT_LIST_HEAD(&(dentry->d_LRU));
-    INIT_LIST_HEAD(&(dentry->d_subdirs));
-    INIT_LIST_HEAD(&(dentry->d_child));
-    INIT_LIST_HEAD(&(dentry->d_alias));
+    dentry->d_name.hash   = 0;
 
     // 此处代码有误，刚刚初始化后的dentry不应该加入cache，因为此时它还没有名字
     // dcache->c_op->add(dcache, (void*)dentry);
@@ -39,13 +36,13 @@ struct dentry * alloc_dentry() {
     return dentry;
 }
 
+// 分配一个inode，链表已由 inode_ctor 初始化，无需整体清零
 struct inode * alloc_inode(struct super_block * sb) {
     struct inode * inode;
 
-    inode = (struct inode *)kmalloc(sizeof(struct inode));
+    inode = (struct inode *)kmem_cache_alloc(inode_cachep);
     if (inode == 0)
         return ERR_PTR(-ENOMEM);
-    kernel_memset(inode, 0, sizeof(struct inode));
 
     inode->i_ino       = 0;
     inode->i_count     = 0;
@@ -57,15 +54,12 @@ struct inode * alloc_inode(struct super_block * sb) {
     inode->i_blkbits   = log2(inode->i_blksize);
     inode->i_size      = 0;
     inode->i_mode      = 0;
-    INIT_LIST_HEAD(&(inode->i_hash));
-    INIT_LIST_HEAD(&(inode->i_LRU));
-    INIT_LIST_HEAD(&(inode->i_dentry));
 
     // 构建关联的address_space结构
     inode->i_data.a_host      = inode;
     inode->i_data.a_pagesize  = sb->s_blksize;
+    inode->i_data.a_page      = 0;
     inode->i_data.a_op        = &(ext2_address_space_operations);
-    INIT_LIST_HEAD(&(inode->i_data.a_cache));
 
 #ifdef DEBUG_VFS
     kernel_printf("            [alloc] alloc_empty_inode: %x\n", inode);
@@ -83,17 +77,17 @@ struct vfs_page * alloc_vfspage(u32 location, struct address_space *mapping) {
     kernel_printf("            [alloc] alloc_vfspage(%d, ino: %d)\n", location, mapping->a_host->i_ino);
 #endif
 
-    page = (struct vfs_page *)kmalloc(sizeof(struct vfs_page));
+    // 链表已由 vfspage_ctor 初始化，无需整体清零
+    page = (struct vfs_page *)kmem_cache_alloc(vfspage_cachep);
     if (page == 0)
         return ERR_PTR(-ENOMEM);
-    kernel_memset(page, 0, sizeof(struct vfs_page));
 
+    page->p_data     = 0;
     page->p_state    = P_CLEAR;
     page->p_location = location;
     page->p_mapping  = mapping;
-    INIT_LIST_HEAD(&(page->p_hash));
-    INIT_LIST_HEAD(&(page->p_LRU));
-    INIT_LIST_HEAD(&(page->p_list));
+    page->p_mapcount = 0;
+    page->p_count    = 0;
 
     u32 err = page->p_mapping->a_op->readpage(page);
     if (IS_ERR_VALUE(err)) {
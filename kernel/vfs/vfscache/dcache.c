@@ -114,4 +114,26 @@ void dcache_put_LRU(struct cache *this) {
         release_dentry(put_dentry);
     else
         kernel_printf("[VFS ERROR]: the dcache is full and frozen");
-}
\ No newline at end of file
+}
+// 内存紧张时由回收路径调用，从LRU链表尾释放至多nr_to_scan个目录项
+// 只释放没有引用、没有锁定且没有子目录项的目录项
+unsigned int dcache_shrink(unsigned int nr_to_scan) {
+    unsigned int freed = 0;
+    struct list_head        *put;
+    struct list_head        *prev;
+    struct list_head        *start;
+    struct dentry           *put_dentry;
+
+    start = &(dcache->c_LRU);
+    for (put = start->prev; put != start && freed < nr_to_scan; put = prev) {
+        prev = put->prev;
+        put_dentry = container_of(put, struct dentry, d_LRU);
+        if (put_dentry->d_count != 0 || (put_dentry->d_pinned & D_PINNED))
+            continue;
+        if (!list_empty(&(put_dentry->d_subdirs)))
+            continue;
+        release_dentry(put_dentry);
+        freed += 1;
+    }
+    return freed;
+}
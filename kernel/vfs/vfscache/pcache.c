@@ -1,8 +1,11 @@
 #include <zjunix/vfs/vfs.h>
 #include <zjunix/vfs/vfscache.h>
 
+extern struct cache * pcache;
+
 // 在pacache中寻找inode下的第page_no页的东西
 // 如果不存在，就分配一个新的页然后，加入缓存，并返回
+// 返回的页由调用者持有，用完后调用 pcache_put_page
 struct vfs_page * pcache_get_page(struct cache * pcache, struct inode * inode, u32 page_no) {
     u32 cur_page_no;
     struct condition cond;
@@ -62,6 +65,7 @@ void* pcache_look_up(struct cache *this, struct condition *cond) {
     }
 
     if (found) {
+        tested->p_count++;
         list_del(&(tested->p_hash));
         list_add(&(tested->p_hash), start);
         list_del(&(tested->p_LRU));
@@ -77,15 +81,20 @@ void* pcache_look_up(struct cache *this, struct condition *cond) {
 }
 
 // 往文件数据缓存中添加一个已分配的页面（创建已在其他地方完成）
+// 新加入的页由调用者持有
+// 缓存满而所有页都被持有或映射时仍然加入，暂时超出容量，
+// 以免同一块在缓存外另有一份；pcache_put_page 时再收回到容量以内
 void pcache_add(struct cache *this, void *object) {
     u32 hash;
     struct vfs_page *addend;
 
     addend = (struct vfs_page *) object;
     hash = __intHash(addend->p_location, this->c_tablesize);
+    addend->p_count = 1;
 
-    if (cache_is_full(this))
-        pcache_put_LRU(this);
+    if (cache_is_full(this) && !pcache_put_LRU(this))
+        kernel_printf("[pcache] all pages in use, %d over capacity\n",
+                      this->c_size + 1 - this->c_capacity);
 
     list_add(&(addend->p_hash), &(this->c_hashtable[hash]));
     list_add(&(addend->p_LRU), &(this->c_LRU));
@@ -93,24 +102,61 @@ void pcache_add(struct cache *this, void *object) {
     this->c_size += 1;
 }
 
-// 如果文件数据缓存已满，释放一个最近最少使用的页面
-void pcache_put_LRU(struct cache *this) {
+// 释放一个最近最少使用的页面
+// 正被调用者持有或被 mmap 映射的页面不能释放，跳过；clean_only 时脏页也跳过
+// 没有可释放的页面时返回0
+static u32 pcache_evict(struct cache *this, u32 clean_only) {
     struct list_head    *put;
     struct vfs_page     *put_page;
 
-    // 找到LRU的链表尾对应的页面，这代表着它最近最少使用
-    put = this->c_LRU.prev;
-    put_page = container_of(put, struct vfs_page, p_LRU);
+    // 从LRU的链表尾开始找，越靠后代表越久没有使用
+    for (put = this->c_LRU.prev; put != &(this->c_LRU); put = put->prev) {
+        put_page = container_of(put, struct vfs_page, p_LRU);
+        if (put_page->p_count || put_page->p_mapcount)
+            continue;
+        if (clean_only && (put_page->p_state & P_DIRTY))
+            continue;
+        break;
+    }
+    if (put == &(this->c_LRU))
+        return 0;
 
     if(put_page->p_state & P_DIRTY)
         this->c_op->write_back((void *)put_page);
 
-    list_del(&(put_page->p_LRU));
-    list_del(&(put_page->p_hash));
-    list_del(&(put_page->p_list));
+    list_del_init(&(put_page->p_LRU));
+    list_del_init(&(put_page->p_hash));
+    list_del_init(&(put_page->p_list));
     this->c_size -= 1;
 
     release_page(put_page);
+    return 1;
+}
+
+// 如果文件数据缓存已满，释放一个最近最少使用的页面，脏页先写回
+u32 pcache_put_LRU(struct cache *this) {
+    return pcache_evict(this, 0);
+}
+
+// 调用者用完 look_up/add 得到的页后放回
+// 缓存超出容量时（见 pcache_add）借机收回
+void pcache_put_page(struct vfs_page *page) {
+    page->p_count--;
+    while (pcache->c_size > pcache->c_capacity && pcache_put_LRU(pcache))
+        ;
+}
+
+// 内存紧张时由回收路径调用，从LRU链表尾释放至多nr_to_scan个页面
+// 回收可能发生在任意一次内存分配中，此时不能再进入文件系统写回，只释放干净的页
+unsigned int pcache_shrink(unsigned int nr_to_scan) {
+    unsigned int freed = 0;
+
+    while (freed < nr_to_scan) {
+        if (!pcache_evict(pcache, 1))
+            break;
+        freed += 1;
+    }
+    return freed;
 }
 
 // 把页高速缓存中的某页写回外存
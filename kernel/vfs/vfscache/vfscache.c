@@ -1,11 +1,17 @@
 #include <zjunix/vfs/vfscache.h>
 
+#include <zjunix/shrinker.h>
 #include <zjunix/slab.h>
 
 // 公用缓存
 struct cache * dcache;
 struct cache * pcache;
 
+// dentry、inode、vfs_page 对象的专用 slab 缓存
+struct kmem_cache * dentry_cachep;
+struct kmem_cache * inode_cachep;
+struct kmem_cache * vfspage_cachep;
+
 // 缓存操作函数
 struct cache_operations dentry_cache_operations = {
     .look_up    = dcache_look_up,
@@ -20,9 +26,53 @@ struct cache_operations page_cache_operations = {
     .write_back = pcache_write_back,
 };
 
+// 内存回收时收缩 pcache 和 dcache 的回调
+static struct shrinker pcache_shrinker = {
+    .name       = "pcache",
+    .shrink     = pcache_shrink,
+};
+
+static struct shrinker dcache_shrinker = {
+    .name       = "dcache",
+    .shrink     = dcache_shrink,
+};
+
+// 以下为专用 slab 缓存的构造函数，只在对象所在的 slab 页格式化时调用一次
+// 释放对象前需要把链表恢复为空链表，保持构造后的状态
+static void dentry_ctor(void *object) {
+    struct dentry *dentry = (struct dentry *)object;
+    INIT_LIST_HEAD(&(dentry->d_hash));
+    INIT_LIST_HEAD(&(dentry->d_LRU));
+    INIT_LIST_HEAD(&(dentry->d_subdirs));
+    INIT_LIST_HEAD(&(dentry->d_child));
+    INIT_LIST_HEAD(&(dentry->d_alias));
+}
+
+static void inode_ctor(void *object) {
+    struct inode *inode = (struct inode *)object;
+    INIT_LIST_HEAD(&(inode->i_hash));
+    INIT_LIST_HEAD(&(inode->i_LRU));
+    INIT_LIST_HEAD(&(inode->i_dentry));
+    INIT_LIST_HEAD(&(inode->i_data.a_cache));
+}
+
+static void vfspage_ctor(void *object) {
+    struct vfs_page *page = (struct vfs_page *)object;
+    INIT_LIST_HEAD(&(page->p_hash));
+    INIT_LIST_HEAD(&(page->p_LRU));
+    INIT_LIST_HEAD(&(page->p_list));
+}
+
 // 初始化公用缓存区域
 u32 init_cache() {
 
+    // 初始化对象的 slab 缓存
+    dentry_cachep = kmem_cache_create("dentry", sizeof(struct dentry), 0, dentry_ctor);
+    inode_cachep = kmem_cache_create("inode", sizeof(struct inode), 0, inode_ctor);
+    vfspage_cachep = kmem_cache_create("vfs_page", sizeof(struct vfs_page), 0, vfspage_ctor);
+    if (dentry_cachep == 0 || inode_cachep == 0 || vfspage_cachep == 0)
+        return -ENOMEM;
+
     // 初始化dcache
     dcache = (struct cache *)kmalloc(sizeof(struct cache));
     if (dcache == 0)
@@ -39,6 +89,10 @@ u32 init_cache() {
     cache_init(pcache, PCACHE_CAPACITY, PCACHE_HASHTABLE_SIZE);
     pcache->c_op = &page_cache_operations;
 
+    // 注册回收回调，页缓存先于目录项缓存收缩
+    register_shrinker(&pcache_shrinker);
+    register_shrinker(&dcache_shrinker);
+
     return 0;
 
 init_cache_err:
@@ -65,17 +119,17 @@ void cache_init(struct cache* this, u32 capacity, u32 tablesize) {
 
 // 通用的高速缓存判断满方法
 u32 cache_is_full(struct cache* this) {
-    return this->c_size == this->c_capacity ? 1 : 0;
+    return this->c_size >= this->c_capacity ? 1 : 0;
 }
 
 // 以下为内存清理函数
 void release_dentry(struct dentry *dentry) {
     if (dentry) {
-        list_del(&(dentry->d_LRU));
-        list_del(&(dentry->d_hash));
-        list_del(&(dentry->d_child));
-        list_del(&(dentry->d_alias));
-        list_del(&(dentry->d_subdirs));
+        list_del_init(&(dentry->d_LRU));
+        list_del_init(&(dentry->d_hash));
+        list_del_init(&(dentry->d_child));
+        list_del_init(&(dentry->d_alias));
+        list_del_init(&(dentry->d_subdirs));
         kfree(dentry);
         dcache->c_size -= 1;
     }
@@ -89,9 +143,10 @@ void release_page(struct vfs_page* page) {
 
 // 安全释放inode，需要从各种hash表中删除，然后释放inode中mapping信息，最后释放inode
 void release_inode(struct inode * inode) {
-    list_del(&(inode->i_hash));
-    list_del(&(inode->i_LRU));
-    list_del(&(inode->i_dentry));
+    list_del_init(&(inode->i_hash));
+    list_del_init(&(inode->i_LRU));
+    list_del_init(&(inode->i_dentry));
+    INIT_LIST_HEAD(&(inode->i_data.a_cache));
     kfree(inode->i_data.a_page);
     kfree(inode);
 }
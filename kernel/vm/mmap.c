@@ -0,0 +1,182 @@
+#include "vm.h"
+#include <arch.h>
+#include <driver/vga.h>
+#include <zjunix/buddy.h>
+#include <zjunix/utils.h>
+#include <zjunix/vfs/vfs.h>
+#include <zjunix/vfs/vfscache.h>
+
+
+extern struct cache* pcache;
+
+
+// 被映射的文件页在 struct page 中打上 _PAGE_MMAP，并在 virtual 中记录所属的 vfs_page，
+// 写入和解除映射时由页表项直接找到它；virtual 在别处另有含义（slab、堆池、共享区），
+// 没有 _PAGE_MMAP 的页不能当作 vfs_page 使用
+static struct page* mmap_page(void* kaddr) {
+    return pages + (((unsigned int)kaddr & ~KERNEL_ENTRY) >> PAGE_SHIFT);
+}
+
+
+static void mmap_set_owner(void* kaddr, struct vfs_page* vfs_page) {
+    struct page* page = mmap_page(kaddr);
+    page->flag |= _PAGE_MMAP;
+    page->virtual = (void*)vfs_page;
+}
+
+
+static struct vfs_page* mmap_owner(void* kaddr) {
+    struct page* page = mmap_page(kaddr);
+    if (!(page->flag & _PAGE_MMAP)) {
+        return NULL;
+    }
+    return (struct vfs_page*)page->virtual;
+}
+
+
+// vfs_page 不再被映射时，清除块内每一页的标记
+static void mmap_clear_owner(struct vfs_page* vfs_page) {
+    unsigned int blksize = vfs_page->p_mapping->a_host->i_blksize;
+    unsigned int i;
+    struct page* page;
+    for (i = 0; i < blksize; i += PAGE_SIZE) {
+        page = mmap_page(vfs_page->p_data + i);
+        page->flag &= ~_PAGE_MMAP;
+        page->virtual = (void*)(-1);
+    }
+}
+
+
+// 把文件 [offset, offset + length) 映射到进程中，返回映射的虚拟地址，失败返回 NULL
+// 页缓存的页直接映射到进程中，不复制；访问时才在 tlb_refill 中建立映射
+// 文件系统的块必须是页大小的整数倍，块内的每一页才能单独映射
+void* vm_mmap(task_struct* pcb, const char* filename, unsigned int offset,
+              unsigned int length, unsigned int prot) {
+    struct file* file;
+    struct inode* inode;
+    struct vm_area_struct* vma;
+    void* virtual_addr;
+    if (length == 0 || (offset & (PAGE_SIZE - 1)) != 0) {
+        return NULL;
+    }
+    file = vfs_open((const u8*)filename,
+                    (prot & PROT_WRITE) ? O_RDWR : O_RDONLY, 0);
+    if (IS_ERR_OR_NULL(file)) {
+        return NULL;
+    }
+    inode = file->f_dentry->d_inode;
+    if (inode->i_blksize % PAGE_SIZE != 0 || offset >= inode->i_size) {
+        kernel_printf("[mmap]: %s can not be mapped\n", filename);
+        vfs_close(file);
+        return NULL;
+    }
+    // 只映射到文件末尾所在的页
+    if (length > inode->i_size - offset) {
+        length = inode->i_size - offset;
+    }
+    length = (length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    virtual_addr = vma_alloc(pcb, length, PAGE_SIZE, VMA_FILE);
+    if (virtual_addr == NULL) {
+        vfs_close(file);
+        return NULL;
+    }
+    vma = vma_find(pcb, (unsigned int)virtual_addr);
+    vma->vm_file = file;
+    vma->vm_offset = offset;
+    vma->vm_prot = prot;
+    return virtual_addr;
+}
+
+
+// 文件映射区域的缺页：从页缓存取出对应的页，返回指向它的页表项
+// 页表项总是只读的，可写的映射在第一次写入时再标记脏页
+void* mmap_fault(task_struct* pcb, struct vm_area_struct* vma,
+                 void* virtual_addr) {
+    struct inode* inode = vma->vm_file->f_dentry->d_inode;
+    struct vfs_page* vfs_page;
+    unsigned int offset;
+    void* kaddr;
+    offset = ((unsigned int)virtual_addr & ~(PAGE_SIZE - 1)) - vma->vm_start +
+             vma->vm_offset;
+    vfs_page = pcache_get_page(pcache, inode, offset / inode->i_blksize);
+    if (IS_ERR_OR_NULL(vfs_page)) {
+        return NULL;
+    }
+    kaddr = vfs_page->p_data + offset % inode->i_blksize;
+    // 映射期间页缓存不能换出该页，由 p_mapcount 保持，不再需要持有
+    vfs_page->p_mapcount++;
+    mmap_set_owner(kaddr, vfs_page);
+    pcache_put_page(vfs_page);
+    return (void*)((unsigned int)kaddr | PTE_RDONLY);
+}
+
+
+// 写入文件映射区域的只读页：可写的映射标记脏页后允许写入
+int mmap_write_fault(task_struct* pcb, struct vm_area_struct* vma,
+                     void* pte) {
+    struct vfs_page* vfs_page;
+    if (!(vma->vm_prot & PROT_WRITE)) {
+        return 1;
+    }
+    vfs_page = mmap_owner(PTE_ADDR(pte));
+    if (vfs_page == NULL) {
+        return 1;
+    }
+    vfs_page->p_state |= P_DIRTY;
+    return 0;
+}
+
+
+// 解除一个文件映射区域：脏页写回文件，页留在页缓存中
+static void mmap_unmap_area(task_struct* pcb, struct vm_area_struct* vma) {
+    struct vfs_page* vfs_page;
+    unsigned int addr;
+    void* pte;
+    for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
+        pte = vma_va_to_pa(pcb, (void*)addr);
+        if (pte == NULL) {
+            continue;
+        }
+        vfs_page = mmap_owner(pte);
+        if (vfs_page != NULL) {
+            if (vfs_page->p_state & P_DIRTY) {
+                vfs_page->p_mapping->a_op->writepage(vfs_page);
+                vfs_page->p_state &= ~P_DIRTY;
+            }
+            if (--vfs_page->p_mapcount == 0) {
+                mmap_clear_owner(vfs_page);
+            }
+        }
+        vma_set_mapping(pcb, (void*)addr, NULL);
+    }
+    vfs_close(vma->vm_file);
+    vma_remove(pcb, vma);
+}
+
+
+// 解除文件映射，virtual_addr 必须是 vm_mmap 返回的地址
+int vm_munmap(task_struct* pcb, void* virtual_addr) {
+    struct vm_area_struct* vma = vma_find(pcb, (unsigned int)virtual_addr);
+    if (vma == NULL || !(vma->vm_flags & VMA_FILE) ||
+        vma->vm_start != (unsigned int)virtual_addr) {
+        return 1;
+    }
+    mmap_unmap_area(pcb, vma);
+    // TLB 中可能还有该区域的表项
+    tlb_delete(pcb);
+    return 0;
+}
+
+
+// 进程退出时解除全部文件映射，页缓存的页不能随页表一起释放
+void mmap_exit(task_struct* pcb) {
+    struct rb_node* node = rb_first(&pcb->mm_rb);
+    while (node) {
+        struct vm_area_struct* vma =
+            rb_entry(node, struct vm_area_struct, vm_rb);
+        node = rb_next(node);
+        if (vma->vm_flags & VMA_FILE) {
+            mmap_unmap_area(pcb, vma);
+        }
+    }
+}
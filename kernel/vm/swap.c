@@ -0,0 +1,433 @@
+#include "vm.h"
+#include <arch.h>
+#include <driver/vga.h>
+#include <intr.h>
+#include <zjunix/buddy.h>
+#include <zjunix/log.h>
+#include <zjunix/shrinker.h>
+#include <zjunix/slab.h>
+#include <zjunix/utils.h>
+#include <zjunix/vfs/vfs.h>
+
+
+// 交换设备：以页为单位读写的槽，读写成功返回0
+struct swap_device {
+    const char* name;
+    unsigned int nr_slots;
+    unsigned int (*read)(unsigned int slot, void* buf);
+    unsigned int (*write)(unsigned int slot, void* buf);
+};
+
+
+// 交换槽数的上限，槽的计数表须能由 kmalloc 一次分配
+#define SWAP_MAX_SLOTS 32768
+// 没有空闲的交换槽
+#define SWAP_NO_SLOT 0xFFFFFFFF
+// RAM 盘的槽数
+#define SWAP_RAMDISK_SLOTS 64
+// 一页占用的扇区数
+#define SWAP_PAGE_SECTORS (PAGE_SIZE / SECTOR_SIZE)
+
+
+// 当前使用的交换设备，没有时为 NULL
+static struct swap_device* swap_device;
+
+
+// 每个槽被多少个页表项引用，fork 后父子进程共用同一个槽
+static unsigned short* swap_map;
+static unsigned int swap_used;
+// 下一次从这里开始查找空闲槽
+static unsigned int swap_next;
+
+
+// 换入换出的次数与设备读写的周期数
+static unsigned int swap_in_count;
+static unsigned int swap_out_count;
+static unsigned int swap_in_cycles;
+static unsigned int swap_out_cycles;
+
+
+// 时钟算法的指针：所在的进程与该进程低地址区中的位置
+static pid_t swap_hand_pid;
+static unsigned int swap_hand_addr;
+
+
+// 全部进程的链表，时钟指针沿它依次扫描各进程
+extern struct list_head task_all;
+
+
+// 主引导记录，从中查找交换分区
+extern struct master_boot_record* MBR;
+
+
+// 交换分区的起始扇区
+static unsigned int swap_partition_base;
+
+
+static unsigned int swap_partition_read(unsigned int slot, void* buf) {
+    return read_block((u8*)buf, swap_partition_base + slot * SWAP_PAGE_SECTORS,
+                      SWAP_PAGE_SECTORS);
+}
+
+
+static unsigned int swap_partition_write(unsigned int slot, void* buf) {
+    return write_block((u8*)buf,
+                       swap_partition_base + slot * SWAP_PAGE_SECTORS,
+                       SWAP_PAGE_SECTORS);
+}
+
+
+static struct swap_device swap_partition = {
+    .name = "swap partition",
+    .read = swap_partition_read,
+    .write = swap_partition_write,
+};
+
+
+// 没有 SD 卡时用内存模拟交换设备，用于测试换入换出的路径
+static unsigned char* swap_ramdisk;
+
+
+static unsigned int swap_ramdisk_read(unsigned int slot, void* buf) {
+    kernel_memcpy(buf, swap_ramdisk + slot * PAGE_SIZE, PAGE_SIZE);
+    return 0;
+}
+
+
+static unsigned int swap_ramdisk_write(unsigned int slot, void* buf) {
+    kernel_memcpy(swap_ramdisk + slot * PAGE_SIZE, buf, PAGE_SIZE);
+    return 0;
+}
+
+
+static struct swap_device swap_ramdisk_device = {
+    .name = "ramdisk",
+    .read = swap_ramdisk_read,
+    .write = swap_ramdisk_write,
+};
+
+
+static struct shrinker swap_shrinker = {
+    .name = "swap",
+    .shrink = swap_out,
+};
+
+
+// 启用交换设备，建立槽的计数表
+static int swap_activate(struct swap_device* device, unsigned int nr_slots) {
+    if (nr_slots > SWAP_MAX_SLOTS) {
+        nr_slots = SWAP_MAX_SLOTS;
+    }
+    swap_map = kmalloc(nr_slots * sizeof(unsigned short));
+    if (swap_map == NULL) {
+        return 1;
+    }
+    kernel_memset(swap_map, 0, nr_slots * sizeof(unsigned short));
+    device->nr_slots = nr_slots;
+    swap_used = 0;
+    swap_next = 0;
+    swap_device = device;
+    return 0;
+}
+
+
+// 初始化交换机制，使用主引导记录中的第一个交换分区
+// 交换的回收回调最后注册，回收时先收缩各种缓存，不够时再换出
+void init_swap() {
+    unsigned int i;
+    register_shrinker(&swap_shrinker);
+    if (MBR == NULL) {
+        return;
+    }
+    for (i = 0; i < MBR->m_count; i++) {
+        if (MBR->m_type[i] == PARTITION_TYPE_SWAP) {
+            swap_partition_base = MBR->m_base[i];
+            if (swap_activate(&swap_partition,
+                              MBR->m_size[i] / SWAP_PAGE_SECTORS) == 0) {
+                log(LOG_OK, "Swap on partition %d, %d pages.", i,
+                    swap_partition.nr_slots);
+            }
+            return;
+        }
+    }
+}
+
+
+// 没有交换分区时启用 RAM 盘，已有交换设备时返回1
+int swap_ramdisk_on() {
+    unsigned int old_ie;
+    int ret = 1;
+    old_ie = disable_interrupts();
+    if (swap_device == NULL) {
+        swap_ramdisk = kmalloc(SWAP_RAMDISK_SLOTS * PAGE_SIZE);
+        if (swap_ramdisk != NULL) {
+            ret = swap_activate(&swap_ramdisk_device, SWAP_RAMDISK_SLOTS);
+            if (ret != 0) {
+                kfree(swap_ramdisk);
+                swap_ramdisk = NULL;
+            }
+        }
+    }
+    if (old_ie) {
+        enable_interrupts();
+    }
+    return ret;
+}
+
+
+// 分配一个交换槽，从上次分配的位置开始查找
+static unsigned int swap_slot_alloc() {
+    unsigned int i;
+    unsigned int slot;
+    if (swap_used == swap_device->nr_slots) {
+        return SWAP_NO_SLOT;
+    }
+    for (i = 0; i < swap_device->nr_slots; i++) {
+        slot = swap_next + i;
+        if (slot >= swap_device->nr_slots) {
+            slot -= swap_device->nr_slots;
+        }
+        if (swap_map[slot] == 0) {
+            swap_map[slot] = 1;
+            swap_used++;
+            swap_next = slot + 1;
+            return slot;
+        }
+    }
+    return SWAP_NO_SLOT;
+}
+
+
+// 页表项不再引用交换槽，没有引用时释放该槽
+void swap_free(void* pte) {
+    unsigned int slot = SWAP_SLOT(pte);
+    if (--swap_map[slot] == 0) {
+        swap_used--;
+    }
+}
+
+
+// fork 时子进程复制了已换出的页表项，交换槽多一个引用
+void swap_dup(void* pte) { swap_map[SWAP_SLOT(pte)]++; }
+
+
+// 把已换出的页读回到新分配的页中，返回新的页表项，失败返回 NULL
+// 交换槽仍被其他进程引用时保留，每个进程换入自己的一份
+void* swap_in(void* pte) {
+    void* page;
+    unsigned int start;
+    page = kmalloc(PAGE_SIZE);
+    if (page == NULL) {
+        return NULL;
+    }
+    start = get_cp0_count();
+    if (swap_device->read(SWAP_SLOT(pte), page) != 0) {
+        kfree(page);
+        return NULL;
+    }
+    swap_in_cycles += get_cp0_count() - start;
+    swap_in_count++;
+    swap_free(pte);
+    return page;
+}
+
+
+// 进程的页能否换出：只换出用户进程的页
+static int swap_task_ok(task_struct* pcb) {
+    return pcb->user_mode != 0 && pcb->vm != NULL;
+}
+
+
+// 时钟指针移到链表中的下一个用户进程，没有其他用户进程时留在原进程
+static task_struct* swap_next_task(task_struct* pcb) {
+    struct list_head* pos;
+    task_struct* next;
+    for (pos = pcb->task_node.next; pos != &pcb->task_node; pos = pos->next) {
+        if (pos == &task_all) {
+            continue;
+        }
+        next = container_of(pos, task_struct, task_node);
+        if (swap_task_ok(next)) {
+            return next;
+        }
+    }
+    return pcb;
+}
+
+
+// 时钟指针扫过一个页：最近访问过的页清除访问位，再给一次机会，
+// 否则写入交换设备并释放物理页
+// 返回0表示页表项未变，1表示清除了访问位，2表示换出了该页
+static int swap_scan_page(task_struct* pcb, unsigned int virtual_addr) {
+    unsigned int* pt;
+    unsigned int pt_index;
+    void* pte;
+    struct page* page;
+    unsigned int slot;
+    unsigned int start;
+    pt = (unsigned int*)((unsigned int*)pcb->vm)[get_ptd_index(
+        (void*)virtual_addr)];
+    if (pt == NULL) {
+        return 0;
+    }
+    pt_index = get_pt_index((void*)virtual_addr);
+    pte = (void*)pt[pt_index];
+    if (!PTE_PRESENT(pte) ||
+        ((unsigned int)pte & (PTE_PAGE_MASK | PTE_SHARED))) {
+        return 0;
+    }
+    // 零页与写时复制共享的页被多个页表项引用，不换出
+    page = pages + (((unsigned int)pte & ~KERNEL_ENTRY) >> PAGE_SHIFT);
+    if (page->reference != 1) {
+        return 0;
+    }
+    if ((unsigned int)pte & PTE_ACCESSED) {
+        pt[pt_index] = (unsigned int)pte & ~PTE_ACCESSED;
+        return 1;
+    }
+    slot = swap_slot_alloc();
+    if (slot == SWAP_NO_SLOT) {
+        return 0;
+    }
+    start = get_cp0_count();
+    if (swap_device->write(slot, PTE_ADDR(pte)) != 0) {
+        swap_free(SWAP_ENTRY(slot));
+        return 0;
+    }
+    swap_out_cycles += get_cp0_count() - start;
+    swap_out_count++;
+    pt[pt_index] = (unsigned int)SWAP_ENTRY(slot);
+    kfree(PTE_ADDR(pte));
+    return 2;
+}
+
+
+// 回收路径的回调：用时钟算法换出至多 nr_to_scan 个页
+// 只扫描各进程的低地址区（程序映像、栈与按需分配的页），
+// 堆和共享页由内核直接通过物理地址访问，不能换出
+// 访问位在 TLB Refill 时设置，清除后要让进程换一个 ASID，下次访问才会再设置，
+// 所以至多扫描两圈：第一圈清除访问位，第二圈换出仍未被访问的页
+// 注意：回收可能发生在任意一次内存分配中，换出的每一页都同步写入 SD 卡，
+// 扫描期间关中断（页表与进程链表不能在扫描中途改变），一次至多写 nr_to_scan 页；
+// 堆的缺页换不出时，分配失败的进程在缺页处理中被结束（见 vm_fault_kill）
+unsigned int swap_out(unsigned int nr_to_scan) {
+    struct list_head* pos;
+    task_struct* pcb = NULL;
+    task_struct* first = NULL;
+    unsigned int freed = 0;
+    unsigned int nr_tasks = 0;
+    unsigned int steps, max_steps;
+    int touched = 0;
+    int ret;
+    unsigned int old_ie;
+    old_ie = disable_interrupts();
+    if (swap_device == NULL) {
+        if (old_ie) {
+            enable_interrupts();
+        }
+        return 0;
+    }
+    // 找到时钟指针所在的进程，该进程已退出时从第一个用户进程开始
+    list_for_each(pos, &task_all) {
+        task_struct* p = container_of(pos, task_struct, task_node);
+        if (!swap_task_ok(p)) {
+            continue;
+        }
+        nr_tasks++;
+        if (first == NULL) {
+            first = p;
+        }
+        if (p->pid == swap_hand_pid) {
+            pcb = p;
+        }
+    }
+    if (pcb == NULL) {
+        pcb = first;
+        swap_hand_addr = 0;
+    }
+    max_steps = 2 * nr_tasks * (VMA_LOW_END / PAGE_SIZE);
+    for (steps = 0; steps < max_steps && freed < nr_to_scan; steps++) {
+        ret = swap_scan_page(pcb, swap_hand_addr);
+        if (ret != 0) {
+            touched = 1;
+        }
+        if (ret == 2) {
+            freed++;
+        }
+        swap_hand_addr += PAGE_SIZE;
+        if (swap_hand_addr >= VMA_LOW_END) {
+            // 换出的页与清除访问位的页不能留在 TLB 中
+            if (touched) {
+                tlb_delete(pcb);
+                touched = 0;
+            }
+            pcb = swap_next_task(pcb);
+            swap_hand_addr = 0;
+        }
+    }
+    if (touched) {
+        tlb_delete(pcb);
+    }
+    if (pcb != NULL) {
+        swap_hand_pid = pcb->pid;
+    }
+    if (old_ie) {
+        enable_interrupts();
+    }
+    return freed;
+}
+
+
+// 打印交换设备的使用情况与换入换出的统计
+void swap_stat() {
+    if (swap_device == NULL) {
+        kernel_printf("\tno swap device\n");
+    } else {
+        kernel_printf("\t%s : %d/%d pages used\n", swap_device->name,
+                      swap_used, swap_device->nr_slots);
+    }
+    kernel_printf("\tswap in : %d pages, %d cycles per page\n", swap_in_count,
+                  swap_in_count ? swap_in_cycles / swap_in_count : 0);
+    kernel_printf("\tswap out : %d pages, %d cycles per page\n",
+                  swap_out_count,
+                  swap_out_count ? swap_out_cycles / swap_out_count : 0);
+}
+
+
+// 交换测试写入的页数与起始地址
+#define SWAP_TEST_PAGES 8
+#define SWAP_TEST_BASE 0x4000
+
+
+// 交换测试程序
+// 在低地址区写满若干页，强制换出后再读回校验，没有交换分区时使用 RAM 盘
+void swap_test_proc() {
+    unsigned int* p;
+    unsigned int out, errors = 0;
+    if (swap_device == NULL && swap_ramdisk_on() != 0) {
+        kernel_printf("[swap_test_proc]no swap device\n");
+    } else {
+        for (p = (unsigned int*)SWAP_TEST_BASE;
+             p < (unsigned int*)(SWAP_TEST_BASE + SWAP_TEST_PAGES * PAGE_SIZE);
+             p++) {
+            *p = (unsigned int)p ^ 0x5A5A5A5A;
+        }
+        out = swap_out(SWAP_TEST_PAGES);
+        kernel_printf("[swap_test_proc]%d pages swapped out\n", out);
+        for (p = (unsigned int*)SWAP_TEST_BASE;
+             p < (unsigned int*)(SWAP_TEST_BASE + SWAP_TEST_PAGES * PAGE_SIZE);
+             p++) {
+            if (*p != ((unsigned int)p ^ 0x5A5A5A5A)) {
+                errors++;
+            }
+        }
+        kernel_printf("[swap_test_proc]%d words read back, %d errors\n",
+                      SWAP_TEST_PAGES * PAGE_SIZE / sizeof(unsigned int),
+                      errors);
+        swap_stat();
+    }
+    // 退出进程
+    asm volatile(
+        "li $v0, 16\n\t"
+        "syscall\n\t");
+}
@@ -1,17 +1,77 @@
 ﻿#include "vm.h"
+#include <arch.h>
 #include <driver/vga.h>
 #include <exc.h>
 #include <intr.h>
+#include <zjunix/shrinker.h>
 #include <zjunix/slab.h>
 #include <zjunix/syscall.h>
 #include <zjunix/utils.h>
+#include <zjunix/vmalloc.h>
 
 #pragma GCC push_options
 #pragma GCC optimize("O0")
 
 
-// 共享内存结构链表头
-struct shared_page_struct shared_pages;
+// 共享内存区按名字组织的哈希表
+static struct hlist_head shared_page_hash[SHARED_PAGE_HASH_SIZE];
+
+
+// 内存池区块信息的专用 slab 缓存
+struct kmem_cache* memory_block_cachep;
+
+
+// 全部为0的只读页，进程第一次读取某页时映射到该页
+// 初始化时持有的引用永不释放，所以写入时总会复制
+void* zero_page;
+
+
+// 当前进程的页目录，供 start.s 中的 TLB Refill 快速路径查表
+void* current_ptd;
+
+
+// TLB Refill 快速路径中暂存 $at 的位置
+unsigned int tlb_refill_scratch;
+
+
+// ASID 低8位写入 EntryHi，高位是分配时的代数
+// 同一代内 ASID 不重复分配，一代用完时清空整个 TLB 后进入下一代，
+// 所以进程退出时不必清除它的 TLB 表项
+#define ASID_MASK 0xFF
+#define ASID_VERSION_MASK (~ASID_MASK)
+#define ASID_FIRST_VERSION 0x100
+
+
+// 最近一次分配的 ASID（含代数）
+static unsigned int asid_cache = ASID_FIRST_VERSION;
+
+
+// ASID 分配与 TLB 清空的统计
+static unsigned int asid_alloc_count;
+static unsigned int tlb_flush_count;
+
+
+// 全部进程的链表，回收内存池区块时遍历
+extern struct list_head task_all;
+
+
+// 内存紧张时回收用户内存池中完全空闲的区块
+static unsigned int memory_pool_shrink(unsigned int nr_to_scan);
+
+
+// 映射与释放一块大片内存
+static void big_chunk_map(task_struct* pcb, void* virtual_addr,
+                          void* physical_addr, unsigned int size);
+static void big_chunk_free(task_struct* pcb, memory_block_struct* memory_block);
+
+
+// 共享内存区少了一个映射它的页表项
+static void shared_page_put(struct shared_page_struct* shared_page);
+
+static struct shrinker memory_pool_shrinker = {
+    .name = "user pool",
+    .shrink = memory_pool_shrink,
+};
 
 
 // 初始化虚拟内存地址机制
@@ -19,8 +79,20 @@ void init_vm() {
     // 注册读写虚拟地址的 TLB Refill 中断
     register_exception_handler(2, tlb_refill);
     register_exception_handler(3, tlb_refill);
+    // 注册写入只读页的 TLB Modified 异常，用于写时复制
+    register_exception_handler(1, tlb_modified);
     // 初始化共享页
     init_shared_page();
+    // 创建共享的零页
+    zero_page = kmalloc(PAGE_SIZE);
+    kernel_memset(zero_page, 0, PAGE_SIZE);
+    // 创建内存池区块信息的缓存
+    memory_block_cachep = kmem_cache_create(
+        "memory_block", sizeof(memory_block_struct), 0, NULL);
+    // 注册内存池的回收回调
+    register_shrinker(&memory_pool_shrinker);
+    // 创建虚拟内存区域的缓存
+    init_vma();
 }
 
 
@@ -29,9 +101,12 @@ void* vm_create() { return ptd_create(); }
 
 
 // 删除虚拟内存结构
+// 进程的 ASID 在本代内不会再分配给别的进程，TLB 表项留到换代时统一清空
 void vm_delete(task_struct* pcb) {
-    tlb_delete(pcb->pid);
+    // 文件映射的页属于页缓存，先解除映射，不随页表释放
+    mmap_exit(pcb);
     ptd_delete(pcb, pcb->vm);
+    vma_delete_all(pcb);
 }
 
 
@@ -70,7 +145,60 @@ void set_active_asid(unsigned int asid) {
         "mtc0 $t0, $10\n\t"
         "nop"
         :
-        : "r"(asid));
+        : "r"(asid & ASID_MASK));
+}
+
+
+// 清空整个TLB，每项填入互不相同的 kseg0 VPN，不会被匹配
+static void tlb_flush_all() {
+    int i;
+    unsigned int old_entry_hi;
+    asm volatile("mfc0 %0, $10\n\t" : "=r"(old_entry_hi));
+    for (i = 0; i < 32; i++) {
+        asm volatile(
+            "mtc0 $zero, $2\n\t"
+            "mtc0 $zero, $3\n\t"
+            "mtc0 $zero, $5\n\t"
+            "mtc0 %0, $10\n\t"
+            "mtc0 %1, $0\n\t"
+            "nop\n\t"
+            "nop\n\t"
+            "tlbwi\n\t"
+            "nop" ::"r"(KERNEL_ENTRY + (i << 13)),
+            "r"(i));
+    }
+    asm volatile("mtc0 %0, $10\n\tnop\n\t" : : "r"(old_entry_hi));
+    tlb_flush_count++;
+}
+
+
+// 为进程分配新的 ASID，本代用完时清空 TLB，旧代的 ASID 全部失效
+static void asid_new(task_struct* pcb) {
+    unsigned int asid = asid_cache + 1;
+    if ((asid & ASID_MASK) == 0) {
+        tlb_flush_all();
+        // 代数溢出回绕时跳过代数0，0 表示进程还没有 ASID
+        if (asid == 0) {
+            asid = ASID_FIRST_VERSION;
+        }
+    }
+    pcb->asid = asid_cache = asid;
+    asid_alloc_count++;
+}
+
+
+// 切换到进程的地址空间，调用前当前进程已经切换
+// ASID 不属于当前这一代时重新分配
+void vm_activate(task_struct* pcb) {
+    current_ptd = pcb->vm;
+    if (pcb->vm == NULL) {
+        // 内核进程不访问用户地址，保留上一个进程的 ASID 即可
+        return;
+    }
+    if ((pcb->asid ^ asid_cache) & ASID_VERSION_MASK) {
+        asid_new(pcb);
+    }
+    set_active_asid(pcb->asid);
 }
 
 
@@ -112,10 +240,14 @@ void pt_delete(task_struct* pcb, void* pt) {
         void* pte = (void*)(((int*)pt)[i]);
         if (pte != NULL) {
             // 若存在页表项
-            // 先看看是不是共享页，若不是的话，再由此删除，
-            // 若是则移交shared_page_delete处理
-            if (shared_page_delete(pcb, pte) != 0) {
-                kfree(pte);
+            // 已换出的页只需释放交换槽，共享页交给所属的共享内存区，
+            // 其余的页由此删除
+            if ((unsigned int)pte & PTE_SWAP) {
+                swap_free(pte);
+            } else if ((unsigned int)pte & PTE_SHARED) {
+                shared_page_put(find_shared_page_by_pte(pte));
+            } else {
+                kfree(PTE_ADDR(pte));
             }
             ((int*)pt)[i] = NULL;
         }
@@ -124,7 +256,86 @@ void pt_delete(task_struct* pcb, void* pt) {
 }
 
 
+// 把页表中 pt_index 所在的一对页表项写入TLB，已有旧表项时覆盖旧表项
+// 大页的页表项则以对应的 PageMask 写入整个大页对
+// 写入的页表项设置访问位，已换出的一半无效
+static void tlb_update(void* virtual_addr, void* pt, unsigned int pt_index) {
+    void* pte_even;
+    void* pte_odd;
+    unsigned int entry_lo0;
+    unsigned int entry_lo1;
+    unsigned int entry_hi;
+    unsigned int page_mask = 0;
+    unsigned int index;
+    unsigned int index_even, index_odd;
+    unsigned int large = ((unsigned int*)pt)[pt_index] & PTE_PAGE_MASK;
+    if (large) {
+        // 大页对：偶数页为对齐区域的前一半，奇数页为后一半
+        unsigned int size = (large == PTE_PAGE_64K) ? 0x10000 : 0x40000;
+        unsigned int pages_per_half = size / PAGE_SIZE;
+        index_even = pt_index & ~(2 * pages_per_half - 1);
+        index_odd = index_even + pages_per_half;
+        virtual_addr = (void*)((unsigned int)virtual_addr & ~(2 * size - 1));
+        page_mask = (pages_per_half - 1) << 13;
+    } else {
+        index_even = pt_index & ~1;
+        index_odd = pt_index | 1;
+    }
+    pte_even = (void*)((unsigned int*)pt)[index_even];
+    pte_odd = (void*)((unsigned int*)pt)[index_odd];
+    entry_lo0 = 0;
+    entry_lo1 = 0;
+    if (PTE_PRESENT(pte_even)) {
+        entry_lo0 = get_entry_lo(pte_even);
+        ((unsigned int*)pt)[index_even] |= PTE_ACCESSED;
+    }
+    if (PTE_PRESENT(pte_odd)) {
+        entry_lo1 = get_entry_lo(pte_odd);
+        ((unsigned int*)pt)[index_odd] |= PTE_ACCESSED;
+    }
+    entry_hi = get_entry_hi(virtual_addr);
+    // 查找TLB中是否已有该虚拟页的表项
+    asm volatile(
+        "mtc0 %1, $10\n\t"
+        "nop\n\t"
+        "nop\n\t"
+        "tlbp\n\t"
+        "nop\n\t"
+        "nop\n\t"
+        "mfc0 %0, $0\n\t"
+        : "=r"(index)
+        : "r"(entry_hi));
+    asm volatile(
+        "mtc0 %2, $5\n\t"
+        "mtc0 %0, $2\n\t"
+        "mtc0 %1, $3\n\t"
+        "nop\n\t"
+        "nop\n\t"
+        :
+        : "r"(entry_lo0), "r"(entry_lo1), "r"(page_mask));
+    if (index & 0x80000000) {
+        asm volatile("tlbwr\n\tnop\n\tnop\n\t");
+    } else {
+        asm volatile("tlbwi\n\tnop\n\tnop\n\t");
+    }
+}
+
+
+// 无法处理的缺页（非法访问、内存与交换空间耗尽）：结束当前进程并切换到下一个进程，
+// 而不是停在异常处理中；init 与 shell 不能结束，只能停在这里
+static void vm_fault_kill(unsigned int status, unsigned int cause,
+                          context* pt_context) {
+    task_struct* pcb = get_current_task();
+    if (pcb->pid == 0 || pcb->pid == 1) {
+        while (1)
+            ;
+    }
+    task_exit_syscall(status, cause, pt_context);
+}
+
+
 // TLB Refill 处理程序
+// 同时处理TLB中已有表项、但对应一半无效时的缺页
 void tlb_refill(unsigned int status, unsigned int cause, context* pt_context) {
     task_struct* pcb;
     void* virtual_addr;
@@ -133,15 +344,19 @@ void tlb_refill(unsigned int status, unsigned int cause, context* pt_context) {
     void* pt;
     unsigned int pt_index;
     void* pte;
-    unsigned int pt_near_index;
-    void* pte_near;
-    unsigned int entry_lo0;
-    unsigned int entry_lo1;
-    unsigned int entry_hi;
+    struct vm_area_struct* vma;
     unsigned int old_ie;
     old_ie = disable_interrupts();
     // 获取当前访问的虚拟地址
     asm volatile("mfc0 %0, $8\n\t" : "=r"(virtual_addr));
+    // 内核 vmalloc 区域的缺失由 vmalloc 自己的页表填充
+    if (is_vmalloc_addr(virtual_addr)) {
+        vmalloc_fault(virtual_addr);
+        if (old_ie) {
+            enable_interrupts();
+        }
+        return;
+    }
     // 获取当前进程
     pcb = get_current_task();
     ptd = pcb->vm;
@@ -152,9 +367,8 @@ void tlb_refill(unsigned int status, unsigned int cause, context* pt_context) {
             "*addr=%x "
             "epc=%x\n",
             pcb->name, (unsigned int)virtual_addr,
-            *((unsigned int*)virtual_addr), (unsigned int)pcb->context.epc);
-        while (1)
-            ;
+            *((unsigned int*)virtual_addr), pt_context->epc);
+        goto kill;
     }
     // 根据虚拟地址，获取对应的页目录项
     ptd_index = get_ptd_index(virtual_addr);
@@ -162,62 +376,161 @@ void tlb_refill(unsigned int status, unsigned int cause, context* pt_context) {
     if (pt == NULL) {
         // 若该项页目录项不存在，则创建新页表
         pt = pt_create();
+        if (pt == NULL) {
+            kernel_printf(
+                "[tlb_refill]: Error. No memory for page table of process %s\n",
+                pcb->name);
+            goto kill;
+        }
         ((unsigned int*)ptd)[ptd_index] = (unsigned int)pt;
     }
     // 在页表中，获取页表项下标
     pt_index = get_pt_index(virtual_addr);
     // 获取页表项
     pte = (void*)((unsigned int*)pt)[pt_index];
-    if (pte == NULL) {
-        // 若页表项为空，且 >= 0x10000 说明非法访问
-        if ((unsigned int)virtual_addr >= 0x10000) {
+    if ((unsigned int)pte & PTE_SWAP) {
+        // 该页已被换出，从交换设备读回
+        pte = swap_in(pte);
+        if (pte == NULL) {
+            kernel_printf(
+                "[tlb_refill]: Error. Swap in failed for process %s\n",
+                pcb->name);
+            goto kill;
+        }
+        ((unsigned int*)pt)[pt_index] = (unsigned int)pte;
+    } else if (pte == NULL) {
+        // 若页表项为空，且不在低地址区或文件映射区，说明非法访问
+        vma = vma_find(pcb, (unsigned int)virtual_addr);
+        if (vma == NULL || !(vma->vm_flags & (VMA_LOW | VMA_FILE))) {
             kernel_printf(
                 "[tlb_refill]: Error. Process %s exited due to accessing "
                 "addr=%x, *addr=%x "
                 "epc=%x\n",
                 pcb->name, (unsigned int)virtual_addr,
-                *((unsigned int*)virtual_addr), (unsigned int)pcb->context.epc);
-            while (1)
-                ;
+                *((unsigned int*)virtual_addr), pt_context->epc);
+            goto kill;
+        }
+        if (vma->vm_flags & VMA_FILE) {
+            // 文件映射区域直接映射页缓存中的页
+            pte = mmap_fault(pcb, vma, virtual_addr);
+            if (pte == NULL) {
+                kernel_printf(
+                    "[tlb_refill]: Error. Process %s failed to read mapped "
+                    "file at addr=%x\n",
+                    pcb->name, (unsigned int)virtual_addr);
+                goto kill;
+            }
+        } else if (((cause >> 2) & 0x1F) == 3) {
+            // 写入时才创建新空间，分配给该进程
+            pte = kmalloc(PAGE_SIZE);
+            if (pte == NULL) {
+                kernel_printf(
+                    "[tlb_refill]: Error. No memory for process %s\n",
+                    pcb->name);
+                goto kill;
+            }
+            kernel_memset(pte, 0, PAGE_SIZE);
+        } else {
+            // 读取时先映射共享的只读零页，写入时再由写时复制分配
+            inc_ref(pages + (((unsigned int)zero_page & ~KERNEL_ENTRY) >>
+                             PAGE_SHIFT),
+                    1);
+            pte = (void*)((unsigned int)zero_page | PTE_COW);
         }
-        // 否则创建新空间，分配给该进程
-        pte = kmalloc(PAGE_SIZE);
-        kernel_memset(pte, 0, PAGE_SIZE);
         ((unsigned int*)pt)[pt_index] = (unsigned int)pte;
     }
-    // 获取相邻的页表项下标
-    pt_near_index = pt_index ^ 1;
-    // 获取相邻的页表项
-    pte_near = (void*)((unsigned int*)pt)[pt_near_index];
-    if (pte_near == NULL) {
-        // 若相邻页表项为空，则申请
-        pte_near = kmalloc(PAGE_SIZE);
-        kernel_memset(pte_near, 0, PAGE_SIZE);
-        ((unsigned int*)pt)[pt_near_index] = (unsigned int)pte_near;
-    }
-    // 设置对应的TLB表项中的两个匹配项
-    if ((pt_index & 1) == 0) {
-        entry_lo0 = get_entry_lo(pte);
-        entry_lo1 = get_entry_lo(pte_near);
+    // 将该页所在的一对表项加载到TLB表中
+    // 相邻页表项为空时，对应的一半无效，访问时再进入此处分配
+    tlb_update(virtual_addr, pt, pt_index);
+    if (old_ie) {
+        enable_interrupts();
+    }
+    return;
+kill:
+    vm_fault_kill(status, cause, pt_context);
+    if (old_ie) {
+        enable_interrupts();
+    }
+}
+
+
+// TLB Modified 异常处理程序，处理写时复制页与文件映射页的写入
+void tlb_modified(unsigned int status, unsigned int cause, context* pt_context) {
+    task_struct* pcb;
+    void* virtual_addr;
+    void* pt;
+    unsigned int pt_index;
+    void* pte;
+    void* new_page;
+    struct page* page;
+    struct vm_area_struct* vma;
+    unsigned int old_ie;
+    old_ie = disable_interrupts();
+    // 获取写入的虚拟地址
+    asm volatile("mfc0 %0, $8\n\t" : "=r"(virtual_addr));
+    pcb = get_current_task();
+    pt = NULL;
+    pte = NULL;
+    pt_index = get_pt_index(virtual_addr);
+    if (pcb->vm != NULL) {
+        pt = (void*)((unsigned int*)pcb->vm)[get_ptd_index(virtual_addr)];
+    }
+    if (pt != NULL) {
+        pte = (void*)((unsigned int*)pt)[pt_index];
+    }
+    if (pte != NULL && ((unsigned int)pte & PTE_RDONLY)) {
+        // 文件映射的页：可写的映射标记脏页后恢复可写
+        vma = vma_find(pcb, (unsigned int)virtual_addr);
+        if (vma != NULL && (vma->vm_flags & VMA_FILE) &&
+            mmap_write_fault(pcb, vma, pte) == 0) {
+            pte = (void*)((unsigned int)pte & ~PTE_RDONLY);
+            ((unsigned int*)pt)[pt_index] = (unsigned int)pte;
+            tlb_update(virtual_addr, pt, pt_index);
+            if (old_ie) {
+                enable_interrupts();
+            }
+            return;
+        }
+        pte = NULL;
+    }
+    if (pte == NULL || ((unsigned int)pte & PTE_COW) == 0) {
+        // 不是写时复制的页，非法写入
+        kernel_printf(
+            "[tlb_modified]: Error. Process %s exited due to writing "
+            "addr=%x epc=%x\n",
+            pcb->name, (unsigned int)virtual_addr,
+            (unsigned int)pt_context->epc);
+        goto kill;
+    }
+    page = pages + (((unsigned int)pte & ~KERNEL_ENTRY) >> PAGE_SHIFT);
+    if (page->reference > 1) {
+        // 还有其他进程共享该页，复制一份给当前进程
+        new_page = kmalloc(PAGE_SIZE);
+        if (new_page == NULL) {
+            kernel_printf("[tlb_modified]: Error. No memory for process %s\n",
+                          pcb->name);
+            goto kill;
+        }
+        if (PTE_ADDR(pte) == zero_page) {
+            kernel_memset(new_page, 0, PAGE_SIZE);
+        } else {
+            kernel_memcpy(new_page, PTE_ADDR(pte), PAGE_SIZE);
+        }
+        // 释放当前进程对旧页的引用
+        kfree(PTE_ADDR(pte));
+        pte = new_page;
     } else {
-        entry_lo0 = get_entry_lo(pte_near);
-        entry_lo1 = get_entry_lo(pte);
+        // 只剩当前进程在使用，直接恢复可写
+        pte = PTE_ADDR(pte);
     }
-    // 设置entry_hi
-    entry_hi = get_entry_hi(virtual_addr);
-    // 将该记录加载到TLB表中
-    asm volatile(
-        "mtc0 $zero, $5\n\t"
-        "mtc0 %0, $10\n\t"
-        "mtc0 %1, $2\n\t"
-        "mtc0 %2, $3\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "tlbwr\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        :
-        : "r"(entry_hi), "r"(entry_lo0), "r"(entry_lo1));
+    ((unsigned int*)pt)[pt_index] = (unsigned int)pte;
+    tlb_update(virtual_addr, pt, pt_index);
+    if (old_ie) {
+        enable_interrupts();
+    }
+    return;
+kill:
+    vm_fault_kill(status, cause, pt_context);
     if (old_ie) {
         enable_interrupts();
     }
@@ -225,39 +538,27 @@ void tlb_refill(unsigned int status, unsigned int cause, context* pt_context) {
 
 
 // 删除某个进程的TLB表项
-void tlb_delete(unsigned int asid) {
-    int i;
-    // 遍历32个TLB表项
-    for (i = 0; i < 32; i++) {
-        unsigned int entry_hi;
-        unsigned int curr_asid;
-        asm volatile(
-            "mtc0 %1, $0\n\t"
-            "nop\n\t"
-            "tlbr\n\t"
-            "nop\n\t"
-            "mfc0 %0, $10\n\t"
-            "nop"
-            : "=r"(entry_hi)
-            : "r"(i));
-        curr_asid = entry_hi & 0xFF;
-        if (curr_asid != asid) {
-            // 若该项不是当前进程的，不管
-            continue;
-        }
-        // 若是当前进程的，则填充为0，相当于删除
-        asm volatile(
-            "mtc0 $zero, $2\n\t"
-            "mtc0 $zero, $3\n\t"
-            "mtc0 $zero, $5\n\t"
-            "mtc0 $zero, $10\n\t"
-            "mtc0 %0, $0\n\t"
-            "tlbwi\n\t"
-            "nop" ::"r"(i));
+// 不逐项查找，而是让进程换一个新的 ASID，旧表项再也不会被匹配
+void tlb_delete(task_struct* pcb) {
+    if (pcb == get_current_task()) {
+        asid_new(pcb);
+        set_active_asid(pcb->asid);
+    } else {
+        // 下次切换到该进程时分配
+        pcb->asid = 0;
     }
 }
 
 
+// 打印 ASID 分配与 TLB 清空的统计
+void tlb_stat() {
+    kernel_printf("\tasid generation : %d, last asid : %d\n",
+                  asid_cache >> 8, asid_cache & ASID_MASK);
+    kernel_printf("\tasid allocations : %d\n", asid_alloc_count);
+    kernel_printf("\tfull TLB flushes : %d\n", tlb_flush_count);
+}
+
+
 // 根据虚拟地址，获得页目录项下标
 unsigned int get_ptd_index(void* addr) { return ((unsigned int)addr >> 22); }
 
@@ -272,10 +573,15 @@ unsigned int get_pt_index(void* addr) {
 unsigned int get_entry_lo(void* pte) {
     void* physical_addr;
     unsigned int entry_lo;
-    physical_addr = (void*)((unsigned int)pte - 0x80000000);
+    physical_addr = (void*)((unsigned int)PTE_ADDR(pte) - 0x80000000);
     entry_lo = ((unsigned int)physical_addr >> 12) << 6;
     entry_lo |= (3 << 3);
-    entry_lo |= 0x06;
+    if ((unsigned int)pte & (PTE_COW | PTE_RDONLY)) {
+        // 写时复制与只读的页不设置D位，写入时触发 TLB Modified 异常
+        entry_lo |= 0x02;
+    } else {
+        entry_lo |= 0x06;
+    }
     return entry_lo;
 }
 
@@ -293,75 +599,163 @@ unsigned int get_entry_hi(void* addr) {
 }
 
 
-// 初始化共享页链表
-void init_shared_page() { INIT_LIST_HEAD(&shared_pages.list); }
+// 初始化共享内存区的哈希表
+void init_shared_page() {
+    int i;
+    for (i = 0; i < SHARED_PAGE_HASH_SIZE; i++) {
+        INIT_HLIST_HEAD(&shared_page_hash[i]);
+    }
+}
+
+
+// 共享内存区名字的哈希值
+static unsigned int shared_page_hash_name(const char* name) {
+    unsigned int hash = 0;
+    while (*name) {
+        hash = hash * 31 + (unsigned char)*name++;
+    }
+    return hash & (SHARED_PAGE_HASH_SIZE - 1);
+}
+
+
+// 共享页对应的 struct page，其中的 virtual 记录页所属的共享内存区
+static struct page* shared_page_page(void* physical_addr) {
+    return pages +
+           (((unsigned int)physical_addr & ~KERNEL_ENTRY) >> PAGE_SHIFT);
+}
+
+
+// 释放共享内存区的页与记录，pages 中可能只有前 nr_pages 页已分配
+static void shared_page_free(struct shared_page_struct* shared_page,
+                             unsigned int nr_pages) {
+    unsigned int i;
+    for (i = 0; i < nr_pages; i++) {
+        shared_page_page(shared_page->pages[i])->virtual = (void*)(-1);
+        kfree(shared_page->pages[i]);
+    }
+    kfree(shared_page->pages);
+    kfree(shared_page);
+}
+
+
+// 新建共享内存区，页逐个分配，不要求物理连续
+static struct shared_page_struct* shared_page_alloc(const char* name,
+                                                    unsigned int nr_pages) {
+    struct shared_page_struct* shared_page;
+    unsigned int i;
+    shared_page = kmalloc(sizeof(struct shared_page_struct));
+    if (shared_page == NULL) {
+        return NULL;
+    }
+    shared_page->pages = kmalloc(nr_pages * sizeof(void*));
+    if (shared_page->pages == NULL) {
+        kfree(shared_page);
+        return NULL;
+    }
+    for (i = 0; i < nr_pages; i++) {
+        shared_page->pages[i] = kmalloc(PAGE_SIZE);
+        if (shared_page->pages[i] == NULL) {
+            shared_page_free(shared_page, i);
+            return NULL;
+        }
+        kernel_memset(shared_page->pages[i], 0, PAGE_SIZE);
+        // 页表项只记录页地址，由页找到所属的区
+        shared_page_page(shared_page->pages[i])->virtual = (void*)shared_page;
+    }
+    kernel_strcpy(shared_page->name, name);
+    shared_page->count = 0;
+    shared_page->nr_pages = nr_pages;
+    hlist_add_head(&shared_page->hash,
+                   &shared_page_hash[shared_page_hash_name(name)]);
+    return shared_page;
+}
+
+
+// 共享内存区少了一个映射它的页表项，没有页表项映射时释放
+static void shared_page_put(struct shared_page_struct* shared_page) {
+    shared_page->count--;
+    if (shared_page->count == 0) {
+        hlist_del(&shared_page->hash);
+        shared_page_free(shared_page, shared_page->nr_pages);
+    }
+}
 
 
-// 创建共享页，返回虚拟地址
-void* shared_page_create(task_struct* pcb, const char* name) {
+// 创建或映射共享内存区，返回虚拟地址
+// 同名的区已存在时映射已有的区，size 不能超过它的大小
+void* shared_page_create(task_struct* pcb, const char* name,
+                         unsigned int size) {
     void* virtual_addr;
     struct shared_page_struct* shared_page;
-    // 寻找可用的虚拟地址
-    virtual_addr = (void*)0x10000;
-    while (vma_va_to_pa(pcb, virtual_addr) != NULL) {
-        virtual_addr = (void*)((unsigned int)virtual_addr + 0x1000);
+    unsigned int nr_pages;
+    unsigned int i;
+    if (size == 0) {
+        size = PAGE_SIZE;
     }
-    // 判断该共享页名是否已经存在
+    nr_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    // 判断该共享内存区是否已经存在
     shared_page = find_shared_page_by_name(name);
     if (shared_page != NULL) {
-        // 若存在，直接加引用计数
-        shared_page->count++;
+        if (nr_pages > shared_page->nr_pages) {
+            return NULL;
+        }
+        nr_pages = shared_page->nr_pages;
     } else {
         // 若不存在，创建新的记录
-        shared_page = kmalloc(sizeof(struct shared_page_struct));
-        kernel_strcpy(shared_page->name, name);
-        shared_page->count = 1;
-        shared_page->physical_addr = kmalloc(PAGE_SIZE);
-        kernel_memset(shared_page->physical_addr, 0, PAGE_SIZE);
-        list_add(&(shared_page->list), &(shared_pages.list));
-    }
-    // 设置虚拟地址映射关系
-    vma_set_mapping(pcb, virtual_addr, shared_page->physical_addr);
+        shared_page = shared_page_alloc(name, nr_pages);
+        if (shared_page == NULL) {
+            return NULL;
+        }
+    }
+    // 寻找可用的虚拟地址
+    virtual_addr = vma_alloc(pcb, nr_pages * PAGE_SIZE, PAGE_SIZE, VMA_SHARED);
+    if (virtual_addr == NULL) {
+        if (shared_page->count == 0) {
+            hlist_del(&shared_page->hash);
+            shared_page_free(shared_page, shared_page->nr_pages);
+        }
+        return NULL;
+    }
+    // 设置虚拟地址映射关系，每个页表项持有区的一个引用
+    for (i = 0; i < nr_pages; i++) {
+        vma_set_mapping(
+            pcb, (void*)((unsigned int)virtual_addr + i * PAGE_SIZE),
+            (void*)((unsigned int)shared_page->pages[i] | PTE_SHARED));
+    }
+    shared_page->count += nr_pages;
     return virtual_addr;
 }
 
 
-// 删除共享页
+// 解除共享内存区的映射，virtual_addr 必须是 shared_page_create 返回的地址
 int shared_page_delete(task_struct* pcb, void* virtual_addr) {
-    void* physical_addr;
-    struct shared_page_struct* shared_page;
-    // 获取该页对应的物理地址
-    physical_addr = vma_va_to_pa(pcb, virtual_addr);
-    if (physical_addr == NULL) {
+    struct vm_area_struct* vma;
+    unsigned int addr;
+    void* pte;
+    vma = vma_find(pcb, (unsigned int)virtual_addr);
+    if (vma == NULL || !(vma->vm_flags & VMA_SHARED) ||
+        vma->vm_start != (unsigned int)virtual_addr) {
         return 1;
     }
-    // 根据物理地址，查找对应的共享页信息
-    shared_page = find_shared_page_by_physical_addr(physical_addr);
-    if (shared_page == NULL) {
-        // 若未找到，说明是非共享页，直接返回
-        return 2;
-    }
-    // 解除映射关系
-    vma_set_mapping(pcb, virtual_addr, NULL);
-    // 清除TLB表
-    tlb_delete(pcb->pid);
-    // 计数器减1
-    shared_page->count--;
-    if (shared_page->count == 0) {
-        // 若没有进程在使用该共享页了，则删除
-        kfree(shared_page->physical_addr);
-        list_del_init(&shared_page->list);
+    for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
+        pte = (void*)((unsigned int*)((unsigned int*)pcb->vm)[get_ptd_index(
+            (void*)addr)])[get_pt_index((void*)addr)];
+        vma_set_mapping(pcb, (void*)addr, NULL);
+        shared_page_put(find_shared_page_by_pte(pte));
     }
+    // 归还虚拟地址，清除TLB表
+    vma_remove(pcb, vma);
+    tlb_delete(pcb);
     return 0;
 }
 
 
-// 根据名字遍历共享页链表，查找对应的共享页
+// 根据名字查哈希表，查找对应的共享内存区
 struct shared_page_struct* find_shared_page_by_name(const char* name) {
-    struct list_head* pos;
-    list_for_each(pos, &shared_pages.list) {
+    struct hlist_node* pos;
+    hlist_for_each(pos, &shared_page_hash[shared_page_hash_name(name)]) {
         struct shared_page_struct* shared_page =
-            list_entry(pos, struct shared_page_struct, list);
+            hlist_entry(pos, struct shared_page_struct, hash);
         if (kernel_strcmp(shared_page->name, name) == 0) {
             return shared_page;
         }
@@ -370,18 +764,10 @@ struct shared_page_struct* find_shared_page_by_name(const char* name) {
 }
 
 
-// 根据物理地址遍历共享页链表，查找对应的共享页
-struct shared_page_struct* find_shared_page_by_physical_addr(
-    void* physical_addr) {
-    struct list_head* pos;
-    list_for_each(pos, &shared_pages.list) {
-        struct shared_page_struct* shared_page =
-            list_entry(pos, struct shared_page_struct, list);
-        if (shared_page->physical_addr == physical_addr) {
-            return shared_page;
-        }
-    }
-    return NULL;
+// 根据共享页的页表项，找到所属的共享内存区，不需要查找
+struct shared_page_struct* find_shared_page_by_pte(void* pte) {
+    return (struct shared_page_struct*)shared_page_page(PTE_ADDR(pte))
+        ->virtual;
 }
 
 
@@ -403,7 +789,8 @@ void* vma_va_to_pa(task_struct* pcb, void* virtual_addr) {
     if (pte == NULL) {
         return NULL;
     }
-    return (void*)((unsigned int)pte | ((unsigned int)virtual_addr & 0xFFF));
+    return (void*)((unsigned int)PTE_ADDR(pte) |
+                   ((unsigned int)virtual_addr & 0xFFF));
 }
 
 
@@ -426,6 +813,37 @@ void vma_set_mapping(task_struct* pcb, void* virtual_addr,
 }
 
 
+// 内存池的页与大片内存的页在 struct page 的 virtual 中记录所属的区块，
+// 由物理地址可以直接找到区块，与 slab 记录页所属缓存的方式相同
+static void pool_page_set_owner(void* physical_addr, unsigned int size,
+                                memory_block_struct* memory_block) {
+    struct page* page =
+        pages + (((unsigned int)physical_addr & ~KERNEL_ENTRY) >> PAGE_SHIFT);
+    unsigned int offset;
+    for (offset = 0; offset < size; offset += PAGE_SIZE) {
+        (page++)->virtual = (void*)memory_block;
+    }
+}
+
+
+// 物理地址所在页所属的区块
+static memory_block_struct* pool_page_owner(void* physical_addr) {
+    struct page* page =
+        pages + (((unsigned int)physical_addr & ~KERNEL_ENTRY) >> PAGE_SHIFT);
+    return (memory_block_struct*)page->virtual;
+}
+
+
+// 小片内存的大小对应的内存池下标
+static int pool_index(unsigned int chunk_size) {
+    int i = 0;
+    while ((16 << i) < chunk_size) {
+        i++;
+    }
+    return i;
+}
+
+
 // 创建进程的内存池，用于堆空间的分配
 void memory_pool_create(task_struct* pcb) {
     int i;
@@ -434,9 +852,8 @@ void memory_pool_create(task_struct* pcb) {
         // 预先申请对应的内存块
         // 并做初始化
         unsigned int chunk_size;
-        pcb->user_pc_memory_blocks[i] = kmalloc(sizeof(memory_block_struct));
-        kernel_memset(pcb->user_pc_memory_blocks[i], 0,
-                      sizeof(memory_block_struct));
+        // init_memory_block 会设置全部成员，无需清零
+        pcb->user_pc_memory_blocks[i] = kmem_cache_alloc(memory_block_cachep);
         chunk_size = 16 << i;
         init_memory_block(pcb, pcb->user_pc_memory_blocks[i], chunk_size);
     }
@@ -445,24 +862,196 @@ void memory_pool_create(task_struct* pcb) {
 }
 
 
-// 删除进程的内存池
+// 删除进程的内存池，解除映射并归还全部物理页
 void memory_pool_delete(task_struct* pcb) {
     int i;
-    for (i = 0; i < 9; i++) {
+    while (pcb->user_pc_memory_blocks[8]) {
+        big_chunk_free(pcb, pcb->user_pc_memory_blocks[8]);
+    }
+    for (i = 0; i < 8; i++) {
         memory_block_struct* memory_block = pcb->user_pc_memory_blocks[i];
         // 逐项遍历内存池块
         while (memory_block) {
             memory_block_struct* next_memory_block;
             // 解除映射关系
             vma_set_mapping(pcb, memory_block->base_virtual_addr, NULL);
+            pool_page_set_owner(memory_block->base_physical_addr, PAGE_SIZE,
+                                (memory_block_struct*)(-1));
+            kfree(memory_block->base_physical_addr);
             next_memory_block = memory_block->next_memory_block;
-            kfree(memory_block);
+            kmem_cache_free(memory_block_cachep, memory_block);
             memory_block = next_memory_block;
         }
+        pcb->user_pc_memory_blocks[i] = NULL;
     }
 }
 
 
+// 把父进程内存池中的地址换算为子进程内存池中对应的地址
+// 两者的虚拟地址相同，由所在页的区块信息得到虚拟地址，再查子进程的页表
+static void* memory_pool_relocate(task_struct* child, void* addr) {
+    memory_block_struct* owner;
+    if (addr == NULL) {
+        return NULL;
+    }
+    owner = pool_page_owner(addr);
+    return vma_va_to_pa(child, (void*)((unsigned int)addr -
+                                       (unsigned int)owner->base_physical_addr +
+                                       (unsigned int)owner->base_virtual_addr));
+}
+
+
+// 把大片内存加入进程的大片内存链表
+static void big_chunk_link(task_struct* pcb, memory_block_struct* memory_block) {
+    memory_block->prev_memory_block = NULL;
+    memory_block->next_memory_block = pcb->user_pc_memory_blocks[8];
+    if (memory_block->next_memory_block) {
+        memory_block->next_memory_block->prev_memory_block = memory_block;
+    }
+    pcb->user_pc_memory_blocks[8] = memory_block;
+}
+
+
+// fork 时复制进程的内存池
+// 内核通过物理地址直接读写内存池的页，无法写时复制，因此直接复制页，
+// 再把空闲链表中的地址换算到子进程的页中
+static void memory_pool_fork(task_struct* parent, task_struct* child) {
+    int i;
+    memory_block_struct* src;
+    memory_block_struct* dst;
+    memory_block_struct** link;
+    void* physical_addr;
+    void** p;
+    for (i = 0; i < 8; i++) {
+        src = parent->user_pc_memory_blocks[i];
+        link = &(child->user_pc_memory_blocks[i]);
+        while (src) {
+            dst = kmem_cache_alloc(memory_block_cachep);
+            physical_addr = kmalloc(PAGE_SIZE);
+            kernel_memcpy(physical_addr, src->base_physical_addr, PAGE_SIZE);
+            dst->base_virtual_addr = src->base_virtual_addr;
+            dst->base_physical_addr = physical_addr;
+            dst->chunk_size = src->chunk_size;
+            dst->head = NULL;
+            dst->next_memory_block = NULL;
+            dst->prev_memory_block = NULL;
+            pool_page_set_owner(physical_addr, PAGE_SIZE, dst);
+            vma_set_mapping(child, dst->base_virtual_addr, physical_addr);
+            *link = dst;
+            link = &(dst->next_memory_block);
+            src = src->next_memory_block;
+        }
+        *link = NULL;
+        // 空闲链表头保存在第一个区块中
+        child->user_pc_memory_blocks[i]->head =
+            memory_pool_relocate(child, parent->user_pc_memory_blocks[i]->head);
+        p = (void**)child->user_pc_memory_blocks[i]->head;
+        while (p) {
+            *p = memory_pool_relocate(child, *p);
+            p = (void**)*p;
+        }
+    }
+    // 大片内存整块复制，子进程中同样使用大页映射
+    child->user_pc_memory_blocks[8] = NULL;
+    for (src = parent->user_pc_memory_blocks[8]; src;
+         src = src->next_memory_block) {
+        dst = kmem_cache_alloc(memory_block_cachep);
+        physical_addr = kmalloc(src->chunk_size);
+        kernel_memcpy(physical_addr, src->base_physical_addr, src->chunk_size);
+        dst->base_virtual_addr = src->base_virtual_addr;
+        dst->base_physical_addr = physical_addr;
+        dst->chunk_size = src->chunk_size;
+        dst->head = NULL;
+        pool_page_set_owner(physical_addr, src->chunk_size, dst);
+        big_chunk_map(child, dst->base_virtual_addr, physical_addr,
+                      dst->chunk_size);
+        big_chunk_link(child, dst);
+    }
+}
+
+
+// fork 时复制地址空间
+// 内存池的页直接复制，共享页继续共享，
+// 其余页在父子进程中都标记为写时复制，并增加页的引用计数
+int vm_fork(task_struct* parent, task_struct* child) {
+    void* ptd;
+    int i, j;
+    child->vm = ptd_create();
+    vma_fork(parent, child);
+    memory_pool_fork(parent, child);
+    ptd = parent->vm;
+    for (i = 0; i < PAGE_SIZE / sizeof(void*); i++) {
+        void* pt = (void*)(((int*)ptd)[i]);
+        if (pt == NULL) {
+            continue;
+        }
+        for (j = 0; j < PAGE_SIZE / sizeof(void*); j++) {
+            void* pte = (void*)(((int*)pt)[j]);
+            void* virtual_addr = (void*)((i << 22) | (j << 12));
+            struct shared_page_struct* shared_page;
+            struct page* page;
+            struct vm_area_struct* vma;
+            if (pte == NULL || vma_va_to_pa(child, virtual_addr) != NULL) {
+                // 空页表项，或者内存池中已复制的页
+                continue;
+            }
+            vma = vma_find(parent, (unsigned int)virtual_addr);
+            if (vma != NULL && (vma->vm_flags & VMA_FILE)) {
+                // 文件映射不被子进程继承
+                continue;
+            }
+            if ((unsigned int)pte & PTE_SWAP) {
+                // 已换出的页，父子进程引用同一个交换槽，各自换入
+                swap_dup(pte);
+                vma_set_mapping(child, virtual_addr, pte);
+                continue;
+            }
+            if ((unsigned int)pte & PTE_SHARED) {
+                // 共享页不做写时复制
+                shared_page = find_shared_page_by_pte(pte);
+                shared_page->count++;
+                vma_set_mapping(child, virtual_addr, pte);
+                continue;
+            }
+            page = pages + (((unsigned int)pte & ~KERNEL_ENTRY) >> PAGE_SHIFT);
+            inc_ref(page, 1);
+            pte = (void*)((unsigned int)pte | PTE_COW);
+            ((int*)pt)[j] = (int)pte;
+            vma_set_mapping(child, virtual_addr, pte);
+        }
+    }
+    // 父进程TLB中的可写表项需要清除，之后的写入才会触发写时复制
+    tlb_delete(parent);
+    return 0;
+}
+
+
+// 大片内存是否使用大页映射，TLB 抖动测试用来对比两种映射
+static int big_chunk_use_large_page = 1;
+
+
+// 大片内存中偏移 offset 处的页所在的大页对完全落在区块内，
+// 且虚拟地址、物理地址都按大页对的大小对齐时，返回对应的大页标志
+static unsigned int big_chunk_page_flag(void* virtual_addr,
+                                        void* physical_addr, unsigned int size,
+                                        unsigned int offset) {
+    unsigned int pair_size;
+    unsigned int start;
+    if (!big_chunk_use_large_page) {
+        return 0;
+    }
+    for (pair_size = 2 * 0x40000; pair_size >= 2 * 0x10000; pair_size >>= 2) {
+        start = offset & ~(pair_size - 1);
+        if (start + pair_size <= size &&
+            (((unsigned int)virtual_addr | (unsigned int)physical_addr) &
+             (pair_size - 1)) == 0) {
+            return (pair_size == 2 * 0x40000) ? PTE_PAGE_256K : PTE_PAGE_64K;
+        }
+    }
+    return 0;
+}
+
+
 // 用户程序的malloc，用于堆空间申请内存
 void* memory_alloc(task_struct* pcb, unsigned int size) {
     int i;
@@ -483,28 +1072,131 @@ void* memory_alloc(task_struct* pcb, unsigned int size) {
 
 
 // 用户程序的free，用于堆空间释放内存
+// 由页表得到物理地址，再由所在页记录的区块判断是小片还是大片内存
 int memory_free(task_struct* pcb, void* virtual_addr) {
+    struct vm_area_struct* vma;
+    memory_block_struct* memory_block;
+    memory_block_struct* head;
+    void* physical_addr;
+    vma = vma_find(pcb, (unsigned int)virtual_addr);
+    if (vma == NULL || !(vma->vm_flags & VMA_HEAP)) {
+        return 1;
+    }
+    physical_addr = vma_va_to_pa(pcb, virtual_addr);
+    if (physical_addr == NULL) {
+        return 1;
+    }
+    memory_block = pool_page_owner(physical_addr);
+    if (memory_block->chunk_size >= PAGE_SIZE) {
+        // 大片内存只能从起始地址整块释放
+        if (virtual_addr != memory_block->base_virtual_addr) {
+            return 1;
+        }
+        big_chunk_free(pcb, memory_block);
+        return 0;
+    }
+    if (((unsigned int)physical_addr -
+         (unsigned int)memory_block->base_physical_addr) %
+            memory_block->chunk_size !=
+        0) {
+        return 1;
+    }
+    // 释放后的空间，加入空闲列表，表头保存在该大小的第一个区块中
+    head = pcb->user_pc_memory_blocks[pool_index(memory_block->chunk_size)];
+    *(unsigned int*)physical_addr = (unsigned int)head->head;
+    head->head = physical_addr;
+    return 0;
+}
+
+
+// 把某区块的空闲片从空闲链表中摘除，返回摘除的片数
+static unsigned int unlink_block_chunks(memory_block_struct* head,
+                                        memory_block_struct* memory_block) {
+    void** link = &(head->head);
+    void* start_addr = memory_block->base_physical_addr;
+    void* end_addr = (void*)((unsigned int)start_addr + PAGE_SIZE);
+    unsigned int count = 0;
+    while (*link) {
+        if (*link >= start_addr && *link < end_addr) {
+            *link = *(void**)(*link);
+            count++;
+        } else {
+            link = (void**)(*link);
+        }
+    }
+    return count;
+}
+
+
+// 统计某区块在空闲链表中的空闲片数
+static unsigned int count_block_chunks(memory_block_struct* head,
+                                       memory_block_struct* memory_block) {
+    void* p = head->head;
+    void* start_addr = memory_block->base_physical_addr;
+    void* end_addr = (void*)((unsigned int)start_addr + PAGE_SIZE);
+    unsigned int count = 0;
+    while (p) {
+        if (p >= start_addr && p < end_addr) {
+            count++;
+        }
+        p = *(void**)p;
+    }
+    return count;
+}
+
+
+// 回收路径的回调：释放用户内存池中完全空闲的区块，至多nr_to_scan块
+// 每种大小的第一个区块保存着空闲链表头，始终保留
+static unsigned int memory_pool_shrink(unsigned int nr_to_scan) {
+    unsigned int freed = 0;
+    unsigned int task_freed;
+    unsigned int old_ie;
+    struct list_head* pos;
+    task_struct* pcb;
     int i;
-    for (i = 0; i < 8; i++) {
-        memory_block_struct* memory_block = pcb->user_pc_memory_blocks[i];
-        // 遍历内存池块
-        while (memory_block) {
-            void *start_addr, *end_addr;
-            start_addr = memory_block->base_virtual_addr;
-            end_addr = (void*)((unsigned int)start_addr + PAGE_SIZE);
-            // 根据虚拟地址，找对应的区块
-            if (virtual_addr >= start_addr && virtual_addr < end_addr) {
-                void* physical_addr = vma_va_to_pa(pcb, virtual_addr);
-                *(unsigned int*)physical_addr =
-                    (unsigned int)pcb->user_pc_memory_blocks[i]->head;
-                // 释放后的空间，加入空闲列表
-                pcb->user_pc_memory_blocks[i]->head = physical_addr;
-                return 0;
+    old_ie = disable_interrupts();
+    list_for_each(pos, &task_all) {
+        pcb = container_of(pos, task_struct, task_node);
+        if (pcb->user_mode == 0 || pcb->vm == NULL) {
+            continue;
+        }
+        task_freed = 0;
+        for (i = 0; i < 8 && freed < nr_to_scan; i++) {
+            memory_block_struct* head = pcb->user_pc_memory_blocks[i];
+            memory_block_struct* prev = head;
+            memory_block_struct* curr = head->next_memory_block;
+            while (curr && freed < nr_to_scan) {
+                if (count_block_chunks(head, curr) <
+                    PAGE_SIZE / curr->chunk_size) {
+                    // 区块中还有被使用的片
+                    prev = curr;
+                    curr = curr->next_memory_block;
+                    continue;
+                }
+                // 整块空闲，解除映射并归还物理页和虚拟地址
+                unlink_block_chunks(head, curr);
+                vma_set_mapping(pcb, curr->base_virtual_addr, NULL);
+                vma_remove(pcb, vma_find(pcb,
+                                         (unsigned int)curr->base_virtual_addr));
+                pool_page_set_owner(curr->base_physical_addr, PAGE_SIZE,
+                                    (memory_block_struct*)(-1));
+                kfree(curr->base_physical_addr);
+                prev->next_memory_block = curr->next_memory_block;
+                kmem_cache_free(memory_block_cachep, curr);
+                curr = prev->next_memory_block;
+                task_freed++;
+                freed++;
             }
-            memory_block = memory_block->next_memory_block;
+        }
+        if (task_freed) {
+            // 该进程的TLB表项中可能还有已释放区块的映射
+            tlb_delete(pcb);
         }
     }
-    return 1;
+    if (old_ie) {
+        enable_interrupts();
+    }
+    return freed;
 }
 
 
@@ -514,21 +1206,20 @@ void init_memory_block(task_struct* pcb, memory_block_struct* memory_block,
     void* virtual_addr;
     void* physical_addr;
     // 为该块分配对应的虚拟地址
-    virtual_addr = (void*)0x10000;
-    while (vma_va_to_pa(pcb, virtual_addr) != NULL) {
-        virtual_addr = (void*)((unsigned int)virtual_addr + 0x1000);
-    }
+    virtual_addr = vma_alloc(pcb, PAGE_SIZE, PAGE_SIZE, VMA_HEAP);
     // 为该块申请物理内存空间
     physical_addr = kmalloc(PAGE_SIZE);
     kernel_memset(physical_addr, 0, PAGE_SIZE);
     // 设置映射关系
     vma_set_mapping(pcb, virtual_addr, physical_addr);
+    pool_page_set_owner(physical_addr, PAGE_SIZE, memory_block);
     // 初始化块信息
     memory_block->base_virtual_addr = virtual_addr;
     memory_block->base_physical_addr = physical_addr;
     memory_block->chunk_size = chunk_size;
     memory_block->head = physical_addr;
     memory_block->next_memory_block = NULL;
+    memory_block->prev_memory_block = NULL;
     // 初始化空闲链表
     init_chunk_list(memory_block);
 }
@@ -560,42 +1251,25 @@ void init_chunk_list(memory_block_struct* memory_block) {
 // 小片内存的用户内存申请
 void* small_chunk_alloc(task_struct* pcb, memory_block_struct* memory_block) {
     void* physical_addr = memory_block->head;
-    if (physical_addr != NULL) {
-        // 空闲链表中还有剩余项可以分配
-        // 直接分配
-        void* virtual_addr;
-        memory_block_struct* curr_memory_block = memory_block;
-        while (curr_memory_block) {
-            void *start_addr, *end_addr;
-            start_addr = curr_memory_block->base_physical_addr;
-            end_addr = (void*)((unsigned int)start_addr + PAGE_SIZE);
-            if (physical_addr >= start_addr && physical_addr < end_addr) {
-                virtual_addr = physical_addr -
-                               curr_memory_block->base_physical_addr +
-                               curr_memory_block->base_virtual_addr;
-                break;
-            }
-            curr_memory_block = curr_memory_block->next_memory_block;
-        }
-        // 更新空闲表头
-        memory_block->head = (void*)(*(int*)physical_addr);
-        return virtual_addr;
-    } else {
+    memory_block_struct* owner;
+    if (physical_addr == NULL) {
         // 空闲链表中没有剩余项可以分配
-        // 申请新的内存块，再继续分配
+        // 申请新的内存块，接在第一个区块之后，第一个区块保存空闲链表头
         memory_block_struct* new_memory_block;
-        memory_block_struct* last_memory_block;
         new_memory_block =
-            (memory_block_struct*)kmalloc(sizeof(memory_block_struct));
+            (memory_block_struct*)kmem_cache_alloc(memory_block_cachep);
         init_memory_block(pcb, new_memory_block, memory_block->chunk_size);
-        memory_block->head = new_memory_block->head;
-        last_memory_block = memory_block;
-        while (last_memory_block->next_memory_block != NULL) {
-            last_memory_block = memory_block->next_memory_block;
-        }
-        last_memory_block->next_memory_block = new_memory_block;
-        return small_chunk_alloc(pcb, memory_block);
+        new_memory_block->next_memory_block = memory_block->next_memory_block;
+        memory_block->next_memory_block = new_memory_block;
+        physical_addr = new_memory_block->head;
     }
+    // 更新空闲表头
+    memory_block->head = (void*)(*(int*)physical_addr);
+    // 由所在页记录的区块换算出虚拟地址
+    owner = pool_page_owner(physical_addr);
+    return (void*)((unsigned int)physical_addr -
+                   (unsigned int)owner->base_physical_addr +
+                   (unsigned int)owner->base_virtual_addr);
 }
 
 
@@ -603,62 +1277,96 @@ void* small_chunk_alloc(task_struct* pcb, memory_block_struct* memory_block) {
 void* big_chunk_alloc(task_struct* pcb, unsigned int size) {
     void* virtual_addr;
     void* physical_addr;
-    int num_of_pages;
-    int i;
+    memory_block_struct* memory_block;
+    unsigned int align;
     size += PAGE_SIZE - 1;
     size &= ~(PAGE_SIZE - 1);
-    num_of_pages = size / PAGE_SIZE;
-    // 查找连续的可用的虚拟地址
-    virtual_addr = (void*)0x10000;
-    while (1) {
-        int found = 1;
-        for (i = 0; i < num_of_pages; i++) {
-            void* curr_virtual_addr =
-                (void*)((unsigned int)virtual_addr + i * PAGE_SIZE);
-            if (vma_va_to_pa(pcb, curr_virtual_addr) != NULL) {
-                virtual_addr = curr_virtual_addr;
-                found = 0;
-                break;
-            }
-        }
-        if (found == 1) {
-            break;
+    // 足够大时按大页对的大小对齐虚拟地址，kmalloc 的物理内存同样按大小对齐
+    align = PAGE_SIZE;
+    if (big_chunk_use_large_page) {
+        if (size >= 2 * 0x40000) {
+            align = 2 * 0x40000;
+        } else if (size >= 2 * 0x10000) {
+            align = 2 * 0x10000;
         }
     }
+    // 查找连续的可用的虚拟地址
+    virtual_addr = vma_alloc(pcb, size, align, VMA_HEAP);
+    if (virtual_addr == NULL) {
+        return NULL;
+    }
     // 申请物理内存空间
     physical_addr = kmalloc(size);
+    if (physical_addr == NULL) {
+        vma_remove(pcb, vma_find(pcb, (unsigned int)virtual_addr));
+        return NULL;
+    }
     kernel_memset(physical_addr, 0, size);
-    for (i = 0; i < num_of_pages; i++) {
-        memory_block_struct* memory_block;
-        memory_block_struct* last_memory_block;
-        void* curr_virtual_addr =
-            (void*)((unsigned int)virtual_addr + i * PAGE_SIZE);
-        void* curr_physical_addr =
-            (void*)((unsigned int)physical_addr + i * PAGE_SIZE);
-        // 设置映射关系
-        vma_set_mapping(pcb, curr_virtual_addr, curr_physical_addr);
-        // 设置内存块信息
-        memory_block = kmalloc(sizeof(memory_block_struct));
-        memory_block->base_virtual_addr = curr_virtual_addr;
-        memory_block->base_physical_addr = curr_physical_addr;
-        memory_block->chunk_size = 0;
-        memory_block->head = NULL;
-        memory_block->next_memory_block = NULL;
-        // 加入到PCB内存块链表
-        last_memory_block = pcb->user_pc_memory_blocks[8];
-        if (last_memory_block == NULL) {
-            pcb->user_pc_memory_blocks[8] = memory_block;
-        } else {
-            while (last_memory_block->next_memory_block != NULL) {
-                last_memory_block = last_memory_block->next_memory_block;
-            }
-            last_memory_block->next_memory_block = memory_block;
-        }
+    big_chunk_map(pcb, virtual_addr, physical_addr, size);
+    // 整块内存只用一个区块信息，每一页都记录它
+    memory_block = kmem_cache_alloc(memory_block_cachep);
+    memory_block->base_virtual_addr = virtual_addr;
+    memory_block->base_physical_addr = physical_addr;
+    memory_block->chunk_size = size;
+    memory_block->head = NULL;
+    pool_page_set_owner(physical_addr, size, memory_block);
+    big_chunk_link(pcb, memory_block);
+    if (align > PAGE_SIZE) {
+        // TLB 中可能留有该区域内 4KB 的无效表项，与大页表项重叠，
+        // 换一个新的 ASID 使其全部失效
+        tlb_delete(pcb);
     }
     return virtual_addr;
 }
 
 
+// 逐页映射大片内存，大页对完全落在其中的页标记为大页
+static void big_chunk_map(task_struct* pcb, void* virtual_addr,
+                          void* physical_addr, unsigned int size) {
+    unsigned int offset;
+    for (offset = 0; offset < size; offset += PAGE_SIZE) {
+        vma_set_mapping(pcb, (void*)((unsigned int)virtual_addr + offset),
+                        (void*)(((unsigned int)physical_addr + offset) |
+                                big_chunk_page_flag(virtual_addr, physical_addr,
+                                                    size, offset)));
+    }
+}
+
+
+// 释放大片内存：解除映射，物理内存整块还给 Buddy 系统（与伙伴合并），
+// 虚拟地址还给区域树（与相邻的空闲间隙合并）
+static void big_chunk_free(task_struct* pcb, memory_block_struct* memory_block) {
+    unsigned int offset;
+    struct vm_area_struct* vma;
+    for (offset = 0; offset < memory_block->chunk_size; offset += PAGE_SIZE) {
+        vma_set_mapping(
+            pcb, (void*)((unsigned int)memory_block->base_virtual_addr + offset),
+            NULL);
+    }
+    vma = vma_find(pcb, (unsigned int)memory_block->base_virtual_addr);
+    if (vma != NULL) {
+        vma_remove(pcb, vma);
+    }
+    // TLB 中可能还有该区域的（大页）表项
+    tlb_delete(pcb);
+    pool_page_set_owner(memory_block->base_physical_addr,
+                        memory_block->chunk_size, (memory_block_struct*)(-1));
+    kfree(memory_block->base_physical_addr);
+    // 从大片内存链表中摘除
+    if (memory_block->prev_memory_block) {
+        memory_block->prev_memory_block->next_memory_block =
+            memory_block->next_memory_block;
+    } else {
+        pcb->user_pc_memory_blocks[8] = memory_block->next_memory_block;
+    }
+    if (memory_block->next_memory_block) {
+        memory_block->next_memory_block->prev_memory_block =
+            memory_block->prev_memory_block;
+    }
+    kmem_cache_free(memory_block_cachep, memory_block);
+}
+
+
 // 虚拟内存地址测试程序
 void vma_proc() {
     int i;
@@ -712,6 +1420,7 @@ void page_share_proc_1() {
     const char* name = "share_page";
     asm volatile(
         "move $a0, %1\n\t"
+        "move $a1, $zero\n\t"
         "li $v0, 50\n\t"
         "syscall\n\t"
         "move %0, $v0"
@@ -757,6 +1466,7 @@ void page_share_proc_2() {
     const char* name_no_use = "share_page_no_use";
     asm volatile(
         "move $a0, %1\n\t"
+        "move $a1, $zero\n\t"
         "li $v0, 50\n\t"
         "syscall\n\t"
         "move %0, $v0"
@@ -764,6 +1474,7 @@ void page_share_proc_2() {
         : "r"(name_no_use));
     asm volatile(
         "move $a0, %1\n\t"
+        "move $a1, $zero\n\t"
         "li $v0, 50\n\t"
         "syscall\n\t"
         "move %0, $v0"
@@ -815,6 +1526,93 @@ void buffer_proc_print() {
 }
 
 
+// 共享内存区测试的大小
+#define SHARE_BENCH_SIZE (1024 * 1024)
+
+
+// 测试程序中通过系统调用创建或映射共享内存区
+static unsigned int* user_shared_create(const char* name, unsigned int size) {
+    unsigned int* shared;
+    asm volatile(
+        "move $a0, %1\n\t"
+        "move $a1, %2\n\t"
+        "li $v0, 50\n\t"
+        "syscall\n\t"
+        "move %0, $v0"
+        : "=r"(shared)
+        : "r"(name), "r"(size));
+    return shared;
+}
+
+
+// 测试程序中通过系统调用解除共享内存区的映射
+static void user_shared_delete(void* virtual_addr) {
+    asm volatile(
+        "move $a0, %0\n\t"
+        "li $v0, 51\n\t"
+        "syscall\n\t"
+        :
+        : "r"(virtual_addr));
+}
+
+
+// 共享内存区测试程序
+// 创建 1MB 的共享内存区并写满，再按名字映射一次，从第二个映射读回校验，
+// 统计创建、映射与解除映射的开销
+void share_bench_proc() {
+    const char* name = "share_bench";
+    unsigned int* first;
+    unsigned int* second;
+    unsigned int start, create_cycles, attach_cycles, delete_cycles;
+    unsigned int i, errors = 0;
+    unsigned int old_ie;
+    // 计时期间关中断，时钟中断会把 Count 清零
+    old_ie = disable_interrupts();
+    start = get_cp0_count();
+    first = user_shared_create(name, SHARE_BENCH_SIZE);
+    create_cycles = get_cp0_count() - start;
+    if (old_ie) {
+        enable_interrupts();
+    }
+    if (first == NULL) {
+        kernel_printf("[share_bench_proc]create failed\n");
+    } else {
+        for (i = 0; i < SHARE_BENCH_SIZE / sizeof(unsigned int); i++) {
+            first[i] = i;
+        }
+        old_ie = disable_interrupts();
+        start = get_cp0_count();
+        second = user_shared_create(name, 0);
+        attach_cycles = get_cp0_count() - start;
+        if (old_ie) {
+            enable_interrupts();
+        }
+        for (i = 0; i < SHARE_BENCH_SIZE / sizeof(unsigned int); i++) {
+            if (second[i] != i) {
+                errors++;
+            }
+        }
+        old_ie = disable_interrupts();
+        start = get_cp0_count();
+        user_shared_delete(second);
+        user_shared_delete(first);
+        delete_cycles = get_cp0_count() - start;
+        if (old_ie) {
+            enable_interrupts();
+        }
+        kernel_printf("[share_bench_proc]%d KB at %x and %x, %d errors\n",
+                      SHARE_BENCH_SIZE / 1024, first, second, errors);
+        kernel_printf("[share_bench_proc]create: %d cycles, attach: %d "
+                      "cycles, delete both: %d cycles\n",
+                      create_cycles, attach_cycles, delete_cycles);
+    }
+    // 退出进程
+    asm volatile(
+        "li $v0, 16\n\t"
+        "syscall\n\t");
+}
+
+
 // 用户程序内存申请测试程序
 void buffer_proc() {
     unsigned int* buffer[17];
@@ -858,4 +1656,248 @@ void buffer_proc() {
         "syscall\n\t");
 }
 
+
+// fork 测试程序的主体，运行在用户地址空间的栈上
+static void fork_proc_main() {
+    int value = 100;
+    int* data = (int*)0x9000;
+    int pid;
+    int i;
+    // 先写入一页数据，fork 后由父子进程共享
+    for (i = 0; i < 4; i++) {
+        data[i] = i;
+    }
+    asm volatile(
+        "li $v0, 17\n\t"
+        "syscall\n\t"
+        "move %0, $v0"
+        : "=r"(pid));
+    if (pid == 0) {
+        // 子进程写入，触发写时复制
+        value = 200;
+        data[0] = 1000;
+        kernel_printf("[fork_proc]child: value=%d, data[0]=%d, pa=%x\n", value,
+                      data[0], vma_va_to_pa(get_current_task(), data));
+    } else {
+        sleep(1000 * 1000 * 10);
+        // 父进程中的数据不应被子进程修改
+        kernel_printf("[fork_proc]parent: child pid=%d, value=%d, data[0]=%d, "
+                      "pa=%x\n",
+                      pid, value, data[0],
+                      vma_va_to_pa(get_current_task(), data));
+    }
+    // 退出进程
+    asm volatile(
+        "li $v0, 16\n\t"
+        "syscall\n\t");
+}
+
+
+// fork 与写时复制的测试程序
+// 内核栈位于 task_union 中，无法在父子进程间共享，
+// 因此先把栈切换到用户地址空间（按需分配的低地址页）
+void fork_proc() {
+    asm volatile(
+        "li $sp, 0xFF00\n\t"
+        "jal fork_proc_main\n\t"
+        "nop\n\t");
+}
+
+
+// TLB 抖动测试的访问跨度与轮数
+#define TLB_THRASH_SIZE (512 * 1024)
+#define TLB_THRASH_ROUNDS 16
+
+
+// 以 8KB 为步长依次访问 nr_pairs 个页对，返回平均每次访问的周期数
+static unsigned int tlb_thrash_walk(unsigned int* buffer, int nr_pairs) {
+    unsigned int start, cycles;
+    unsigned int sum = 0;
+    int round, i;
+    start = get_cp0_count();
+    for (round = 0; round < TLB_THRASH_ROUNDS; round++) {
+        for (i = 0; i < nr_pairs; i++) {
+            sum += buffer[i * (2 * PAGE_SIZE / sizeof(unsigned int))];
+        }
+    }
+    cycles = get_cp0_count() - start;
+    buffer[0] = sum;
+    return cycles / (TLB_THRASH_ROUNDS * nr_pairs);
+}
+
+
+// 测试程序中通过系统调用申请用户堆内存
+static unsigned int* user_malloc(unsigned int size) {
+    unsigned int* buffer;
+    asm volatile(
+        "move $a0, %1\n\t"
+        "li $v0, 60\n\t"
+        "syscall\n\t"
+        "move %0, $v0"
+        : "=r"(buffer)
+        : "r"(size));
+    return buffer;
+}
+
+
+// 测试程序中通过系统调用释放用户堆内存
+static int user_free(void* virtual_addr) {
+    int ret;
+    asm volatile(
+        "move $a0, %1\n\t"
+        "li $v0, 61\n\t"
+        "syscall\n\t"
+        "move %0, $v0"
+        : "=r"(ret)
+        : "r"(virtual_addr));
+    return ret;
+}
+
+
+// TLB 抖动测试程序
+// TLB 共32项，每项映射一对页。访问16个页对时全部命中，
+// 访问64个页对时几乎每次都缺失，两者之差即为一次 TLB Refill 的开销
+// 再以大页映射同样大小的内存，64个页对只占用一项 TLB
+void tlb_thrash_proc() {
+    unsigned int* buffer;
+    unsigned int* large_buffer;
+    unsigned int hit_cycles, miss_cycles, large_cycles;
+    unsigned int old_ie;
+    // 申请两块大内存，第一块只用 4KB 页映射
+    big_chunk_use_large_page = 0;
+    buffer = user_malloc(TLB_THRASH_SIZE);
+    big_chunk_use_large_page = 1;
+    large_buffer = user_malloc(TLB_THRASH_SIZE);
+    // 计时期间关中断，时钟中断会把 Count 清零
+    old_ie = disable_interrupts();
+    tlb_thrash_walk(buffer, 16);
+    hit_cycles = tlb_thrash_walk(buffer, 16);
+    miss_cycles = tlb_thrash_walk(buffer, TLB_THRASH_SIZE / (2 * PAGE_SIZE));
+    tlb_thrash_walk(large_buffer, TLB_THRASH_SIZE / (2 * PAGE_SIZE));
+    large_cycles =
+        tlb_thrash_walk(large_buffer, TLB_THRASH_SIZE / (2 * PAGE_SIZE));
+    if (old_ie) {
+        enable_interrupts();
+    }
+    kernel_printf("[tlb_thrash_proc]hit: %d cycles, miss: %d cycles, "
+                  "refill: %d cycles\n",
+                  hit_cycles, miss_cycles, miss_cycles - hit_cycles);
+    kernel_printf("[tlb_thrash_proc]large pages: %d cycles\n", large_cycles);
+    // 退出进程
+    asm volatile(
+        "li $v0, 16\n\t"
+        "syscall\n\t");
+}
+
+// 用户堆分配测试的对象数、对象大小与每段的次数
+#define VMA_BENCH_OBJECTS 10000
+#define VMA_BENCH_SIZE 256
+#define VMA_BENCH_STEP 1000
+
+
+// 用户堆分配测试程序
+// 连续 malloc 一万个对象，按每一千次统计平均开销，观察开销随堆增长的变化，
+// 最后全部 free，统计平均开销
+void vma_bench_proc() {
+    unsigned int start, cycles;
+    unsigned int old_ie;
+    unsigned int** objects;
+    int i, j, failed = 0;
+    // 对象指针表本身是一块大片内存
+    objects = (unsigned int**)user_malloc(VMA_BENCH_OBJECTS * sizeof(void*));
+    kernel_printf("[vma_bench_proc]%d mallocs of %d bytes\n",
+                  VMA_BENCH_OBJECTS, VMA_BENCH_SIZE);
+    for (i = 0; i < VMA_BENCH_OBJECTS; i += VMA_BENCH_STEP) {
+        // 计时期间关中断，时钟中断会把 Count 清零
+        old_ie = disable_interrupts();
+        start = get_cp0_count();
+        for (j = i; j < i + VMA_BENCH_STEP; j++) {
+            objects[j] = user_malloc(VMA_BENCH_SIZE);
+        }
+        cycles = get_cp0_count() - start;
+        if (old_ie) {
+            enable_interrupts();
+        }
+        kernel_printf("\t%d-%d : %d cycles per call\n", i,
+                      i + VMA_BENCH_STEP, cycles / VMA_BENCH_STEP);
+    }
+    old_ie = disable_interrupts();
+    start = get_cp0_count();
+    for (i = 0; i < VMA_BENCH_OBJECTS; i++) {
+        failed += user_free(objects[i]);
+    }
+    cycles = get_cp0_count() - start;
+    if (old_ie) {
+        enable_interrupts();
+    }
+    kernel_printf("[vma_bench_proc]free : %d cycles per call, %d failed\n",
+                  cycles / VMA_BENCH_OBJECTS, failed);
+    user_free(objects);
+    // 退出进程
+    asm volatile(
+        "li $v0, 16\n\t"
+        "syscall\n\t");
+}
+
+
+// 文件映射测试程序
+// 只读映射参数指定的文件，逐字节求和，与 cat 的结果对照，
+// 并统计第一次访问（缺页映射页缓存）与再次访问的开销
+void mmap_proc(unsigned int argc, void* args) {
+    char* filename = (char*)args;
+    unsigned char* data;
+    unsigned int length = 0x100000;
+    unsigned int start, first_cycles, second_cycles;
+    unsigned int sum = 0;
+    unsigned int old_ie;
+    int i;
+    asm volatile(
+        "move $a0, %1\n\t"
+        "move $a1, $zero\n\t"
+        "move $a2, %2\n\t"
+        "li $a3, 1\n\t"
+        "li $v0, 80\n\t"
+        "syscall\n\t"
+        "move %0, $v0"
+        : "=r"(data)
+        : "r"(filename), "r"(length));
+    if (data == NULL) {
+        kernel_printf("[mmap_proc]can not map %s\n", filename);
+    } else {
+        // 只访问映射区域的第一页，区域长度不超过文件长度
+        old_ie = disable_interrupts();
+        start = get_cp0_count();
+        for (i = 0; i < PAGE_SIZE; i++) {
+            sum += data[i];
+        }
+        first_cycles = get_cp0_count() - start;
+        start = get_cp0_count();
+        for (i = 0; i < PAGE_SIZE; i++) {
+            sum -= data[i];
+        }
+        second_cycles = get_cp0_count() - start;
+        if (old_ie) {
+            enable_interrupts();
+        }
+        for (i = 0; i < PAGE_SIZE; i++) {
+            sum += data[i];
+        }
+        kernel_printf("[mmap_proc]%s mapped at %x, first page sum %x\n",
+                      filename, (unsigned int)data, sum);
+        kernel_printf("[mmap_proc]first touch: %d cycles, again: %d cycles\n",
+                      first_cycles, second_cycles);
+        asm volatile(
+            "move $a0, %0\n\t"
+            "li $v0, 81\n\t"
+            "syscall\n\t"
+            :
+            : "r"(data));
+    }
+    kfree(filename);
+    // 退出进程
+    asm volatile(
+        "li $v0, 16\n\t"
+        "syscall\n\t");
+}
+
 #pragma GCC pop_options
\ No newline at end of file
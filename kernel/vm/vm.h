@@ -1,25 +1,55 @@
 ﻿#ifndef _VM_H
 #define _VM_H
 
+#include <zjunix/buddy.h>
 #include <zjunix/list.h>
 #include <zjunix/pc.h>
 #include <zjunix/type.h>
 #include <zjunix/utils.h>
 
 
-// 页面大小
-#define PAGE_SIZE 4096
-
-
-// 共享页结构
+// PTE 中存放的是用户页的内核虚拟地址，页对齐，低位用作标志
+// 写时复制：该页被多个进程共享，映射为只读，写入时再复制
+#define PTE_COW 0x1
+// 大页：该页所在的 64KB/256KB 大页对按大小对齐且物理连续，
+// TLB 中用一项（配合 PageMask）映射整个大页对
+#define PTE_PAGE_64K 0x2
+#define PTE_PAGE_256K 0x4
+#define PTE_PAGE_MASK 0x6
+// 只读：TLB 中不设置D位，写入时在 TLB Modified 中处理（文件映射的页）
+#define PTE_RDONLY 0x8
+// 已换出：PTE 中不是页地址，而是交换槽号，访问时在 tlb_refill 中换入
+#define PTE_SWAP 0x10
+// 访问位：TLB Refill 加载该页时设置，时钟算法清除，用于选择换出的页
+#define PTE_ACCESSED 0x20
+// 共享页：页属于某个共享内存区，页的 struct page 记录所属的区
+#define PTE_SHARED 0x40
+// 取出 PTE 中的页地址
+#define PTE_ADDR(pte) ((void*)((unsigned int)(pte) & ~(PAGE_SIZE - 1)))
+// PTE 中有物理页（非空且未换出）
+#define PTE_PRESENT(pte) \
+    ((pte) != NULL && !((unsigned int)(pte) & PTE_SWAP))
+// 交换槽号与已换出的 PTE 的相互转换
+#define SWAP_ENTRY(slot) ((void*)(((slot) << 12) | PTE_SWAP))
+#define SWAP_SLOT(pte) ((unsigned int)(pte) >> 12)
+
+
+// 共享内存区结构，由若干不要求物理连续的页组成
+// count: 映射该区的页表项数，为0时释放该区
+// hash: 按名字组织的哈希表链表
 struct shared_page_struct {
     char name[256];
     int count;
-    void* physical_addr;
-    struct list_head list;
+    unsigned int nr_pages;
+    void** pages;
+    struct hlist_node hash;
 };
 
 
+// 共享内存区名字哈希表的大小
+#define SHARED_PAGE_HASH_SIZE 64
+
+
 // 内存池内存块信息
 typedef struct _memory_block_struct memory_block_struct;
 struct _memory_block_struct {
@@ -28,9 +58,49 @@ struct _memory_block_struct {
     unsigned int chunk_size;
     void* head;
     memory_block_struct* next_memory_block;
+    // 大片内存链表是双向的，释放时直接摘除
+    memory_block_struct* prev_memory_block;
 };
 
 
+struct file;
+
+
+// 虚拟内存区域：进程中一段已使用的虚拟地址 [vm_start, vm_end)
+// 按起始地址组织在进程的红黑树 mm_rb 中
+// gap: 与前一个区域（或地址0）之间的空闲间隙
+// max_gap: 以该节点为根的子树中最大的 gap，用于首次适配查找
+// vm_file, vm_offset, vm_prot: 文件映射区域对应的文件、文件内偏移与权限
+struct vm_area_struct {
+    unsigned int vm_start;
+    unsigned int vm_end;
+    unsigned int vm_flags;
+    unsigned int gap;
+    unsigned int max_gap;
+    struct rb_node vm_rb;
+    struct file* vm_file;
+    unsigned int vm_offset;
+    unsigned int vm_prot;
+};
+
+
+// 区域类型
+#define VMA_LOW 0x1
+#define VMA_HEAP 0x2
+#define VMA_SHARED 0x4
+#define VMA_FILE 0x8
+
+
+// mmap 的权限
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+
+
+// 低地址区（程序映像、栈与按需分配的零页）的上界，以及用户地址空间的上界
+#define VMA_LOW_END 0x10000
+#define VMA_USER_END 0x80000000
+
+
 // 初始化虚拟内存地址机制
 void init_vm();
 
@@ -51,6 +121,10 @@ void vm_print(void* vm);
 void set_active_asid(unsigned int asid);
 
 
+// 切换到进程的地址空间，必要时为其分配新的 ASID
+void vm_activate(task_struct* pcb);
+
+
 // 创建页目录
 void* ptd_create();
 
@@ -71,8 +145,16 @@ void pt_delete(task_struct* pcb, void* pt);
 void tlb_refill(unsigned int status, unsigned int cause, context* pt_context);
 
 
+// TLB Modified 异常处理程序，处理写时复制页的写入
+void tlb_modified(unsigned int status, unsigned int cause, context* pt_context);
+
+
 // 删除某个进程的TLB表项
-void tlb_delete(unsigned int asid);
+void tlb_delete(task_struct* pcb);
+
+
+// 打印 ASID 分配与 TLB 清空的统计
+void tlb_stat();
 
 
 // 根据虚拟地址，获得页目录项下标
@@ -91,25 +173,25 @@ unsigned int get_entry_lo(void* pte);
 unsigned int get_entry_hi(void* addr);
 
 
-// 初始化共享页链表
+// 初始化共享内存区的哈希表
 void init_shared_page();
 
 
-// 创建共享页，返回虚拟地址
-void* shared_page_create(task_struct* pcb, const char* name);
+// 创建或映射共享内存区，返回虚拟地址
+void* shared_page_create(task_struct* pcb, const char* name,
+                         unsigned int size);
 
 
-// 删除共享页
+// 解除共享内存区的映射
 int shared_page_delete(task_struct* pcb, void* virtual_addr);
 
 
-// 根据名字遍历共享页链表，查找对应的共享页
+// 根据名字查哈希表，查找对应的共享内存区
 struct shared_page_struct* find_shared_page_by_name(const char* name);
 
 
-// 根据物理地址遍历共享页链表，查找对应的共享页
-struct shared_page_struct* find_shared_page_by_physical_addr(
-    void* physical_addr);
+// 根据共享页的页表项，找到所属的共享内存区
+struct shared_page_struct* find_shared_page_by_pte(void* pte);
 
 
 // 根据虚拟地址，查页表获取对应的物理地址
@@ -153,6 +235,96 @@ void* small_chunk_alloc(task_struct* pcb, memory_block_struct* memory_block);
 void* big_chunk_alloc(task_struct* pcb, unsigned int size);
 
 
+// 初始化虚拟内存区域的缓存
+void init_vma();
+
+
+// 为进程建立区域树，并保留低地址区
+void vma_init(task_struct* pcb);
+
+
+// 插入区域 [start, end)，与已有区域重叠时返回 NULL
+struct vm_area_struct* vma_insert(task_struct* pcb, unsigned int start,
+                                  unsigned int end, unsigned int flags);
+
+
+// 删除区域
+void vma_remove(task_struct* pcb, struct vm_area_struct* vma);
+
+
+// 查找包含 addr 的区域
+struct vm_area_struct* vma_find(task_struct* pcb, unsigned int addr);
+
+
+// 查找长度为 length、按 align 对齐的空闲地址，失败返回 0
+unsigned int vma_get_unmapped_area(task_struct* pcb, unsigned int length,
+                                   unsigned int align);
+
+
+// 查找空闲地址并插入区域，返回区域起始地址
+void* vma_alloc(task_struct* pcb, unsigned int length, unsigned int align,
+                unsigned int flags);
+
+
+// fork 时复制区域树
+int vma_fork(task_struct* parent, task_struct* child);
+
+
+// 删除进程的全部区域
+void vma_delete_all(task_struct* pcb);
+
+
+// 把文件映射到进程中，返回映射的虚拟地址
+void* vm_mmap(task_struct* pcb, const char* filename, unsigned int offset,
+              unsigned int length, unsigned int prot);
+
+
+// 解除文件映射
+int vm_munmap(task_struct* pcb, void* virtual_addr);
+
+
+// 进程退出时解除全部文件映射
+void mmap_exit(task_struct* pcb);
+
+
+// 文件映射区域的缺页，返回新的页表项
+void* mmap_fault(task_struct* pcb, struct vm_area_struct* vma,
+                 void* virtual_addr);
+
+
+// 写入文件映射区域的只读页，允许写入时返回0
+int mmap_write_fault(task_struct* pcb, struct vm_area_struct* vma,
+                     void* pte);
+
+
+// 初始化交换机制，使用交换分区
+void init_swap();
+
+
+// 启用 RAM 盘作为交换设备
+int swap_ramdisk_on();
+
+
+// 回收路径的回调，用时钟算法换出进程的页
+unsigned int swap_out(unsigned int nr_to_scan);
+
+
+// 把已换出的页读回，返回新的页表项
+void* swap_in(void* pte);
+
+
+// 释放已换出的页表项引用的交换槽
+void swap_free(void* pte);
+
+
+// 已换出的页表项被 fork 复制
+void swap_dup(void* pte);
+
+
+// 打印交换的统计
+void swap_stat();
+
+
 // 虚拟内存地址测试程序
 void vma_proc();
 
@@ -0,0 +1,210 @@
+#include "vm.h"
+#include <driver/vga.h>
+#include <zjunix/slab.h>
+#include <zjunix/utils.h>
+
+
+// 虚拟内存区域的专用 slab 缓存
+static struct kmem_cache* vma_cachep;
+
+
+// 初始化虚拟内存区域的缓存
+void init_vma() {
+    vma_cachep = kmem_cache_create("vm_area", sizeof(struct vm_area_struct), 0,
+                                   NULL);
+}
+
+
+// 红黑树的增强回调：由区域之前的间隙与左右子树重新计算 max_gap
+static void vma_augment(struct rb_node* node, void* data) {
+    struct vm_area_struct* vma = rb_entry(node, struct vm_area_struct, vm_rb);
+    struct vm_area_struct* child;
+    unsigned int max_gap = vma->gap;
+    if (node->rb_left) {
+        child = rb_entry(node->rb_left, struct vm_area_struct, vm_rb);
+        if (child->max_gap > max_gap) {
+            max_gap = child->max_gap;
+        }
+    }
+    if (node->rb_right) {
+        child = rb_entry(node->rb_right, struct vm_area_struct, vm_rb);
+        if (child->max_gap > max_gap) {
+            max_gap = child->max_gap;
+        }
+    }
+    vma->max_gap = max_gap;
+}
+
+
+// 区域之前的间隙变化后，更新从该节点到根的路径上的 max_gap
+static void vma_gap_update(struct vm_area_struct* vma) {
+    rb_augment_erase_end(&vma->vm_rb, vma_augment, NULL);
+}
+
+
+// 为进程建立空的区域树，并保留低地址区
+// 低地址区存放程序映像、栈与按需分配的零页
+void vma_init(task_struct* pcb) {
+    pcb->mm_rb.rb_node = NULL;
+    vma_insert(pcb, 0, VMA_LOW_END, VMA_LOW);
+}
+
+
+// 插入区域 [start, end)，与已有区域重叠时返回 NULL
+struct vm_area_struct* vma_insert(task_struct* pcb, unsigned int start,
+                                  unsigned int end, unsigned int flags) {
+    struct rb_node** link = &pcb->mm_rb.rb_node;
+    struct rb_node* parent = NULL;
+    struct vm_area_struct* prev = NULL;
+    struct vm_area_struct* next = NULL;
+    struct vm_area_struct* vma;
+    // 按起始地址查找插入位置，同时得到前后相邻的区域
+    while (*link) {
+        parent = *link;
+        vma = rb_entry(parent, struct vm_area_struct, vm_rb);
+        if (end <= vma->vm_start) {
+            next = vma;
+            link = &parent->rb_left;
+        } else if (start >= vma->vm_end) {
+            prev = vma;
+            link = &parent->rb_right;
+        } else {
+            return NULL;
+        }
+    }
+    vma = kmem_cache_alloc(vma_cachep);
+    if (vma == NULL) {
+        return NULL;
+    }
+    vma->vm_start = start;
+    vma->vm_end = end;
+    vma->vm_flags = flags;
+    vma->vm_file = NULL;
+    vma->vm_offset = 0;
+    vma->vm_prot = 0;
+    vma->gap = start - (prev ? prev->vm_end : 0);
+    vma->max_gap = vma->gap;
+    rb_link_node(&vma->vm_rb, parent, link);
+    rb_insert_color(&vma->vm_rb, &pcb->mm_rb);
+    rb_augment_insert(&vma->vm_rb, vma_augment, NULL);
+    // 后一个区域之前的间隙被新区域占去一部分
+    if (next) {
+        next->gap = next->vm_start - end;
+        vma_gap_update(next);
+    }
+    return vma;
+}
+
+
+// 删除区域，它占用的地址并入后一个区域之前的间隙
+void vma_remove(task_struct* pcb, struct vm_area_struct* vma) {
+    struct rb_node* next_node = rb_next(&vma->vm_rb);
+    struct rb_node* deepest = rb_augment_erase_begin(&vma->vm_rb);
+    rb_erase(&vma->vm_rb, &pcb->mm_rb);
+    rb_augment_erase_end(deepest, vma_augment, NULL);
+    if (next_node) {
+        struct vm_area_struct* next =
+            rb_entry(next_node, struct vm_area_struct, vm_rb);
+        next->gap = next->vm_start - (vma->vm_start - vma->gap);
+        vma_gap_update(next);
+    }
+    kmem_cache_free(vma_cachep, vma);
+}
+
+
+// 查找包含 addr 的区域，没有则返回 NULL
+struct vm_area_struct* vma_find(task_struct* pcb, unsigned int addr) {
+    struct rb_node* node = pcb->mm_rb.rb_node;
+    while (node) {
+        struct vm_area_struct* vma =
+            rb_entry(node, struct vm_area_struct, vm_rb);
+        if (addr < vma->vm_start) {
+            node = node->rb_left;
+        } else if (addr >= vma->vm_end) {
+            node = node->rb_right;
+        } else {
+            return vma;
+        }
+    }
+    return NULL;
+}
+
+
+// 首次适配查找长度为 length、按 align 对齐的空闲地址，失败返回 0
+// 左子树中有足够大的间隙时一定在左边，否则看本节点之前的间隙，再看右子树
+// 对齐时按 length + align - PAGE_SIZE 查找，保证对齐后仍然放得下
+unsigned int vma_get_unmapped_area(task_struct* pcb, unsigned int length,
+                                   unsigned int align) {
+    struct rb_node* node = pcb->mm_rb.rb_node;
+    struct rb_node* last;
+    struct vm_area_struct* vma;
+    unsigned int need = length + align - PAGE_SIZE;
+    unsigned int addr;
+    if (node &&
+        rb_entry(node, struct vm_area_struct, vm_rb)->max_gap >= need) {
+        while (node) {
+            vma = rb_entry(node, struct vm_area_struct, vm_rb);
+            if (node->rb_left &&
+                rb_entry(node->rb_left, struct vm_area_struct, vm_rb)
+                        ->max_gap >= need) {
+                node = node->rb_left;
+                continue;
+            }
+            if (vma->gap >= need) {
+                addr = vma->vm_start - vma->gap;
+                return (addr + align - 1) & ~(align - 1);
+            }
+            node = node->rb_right;
+        }
+    }
+    // 最后一个区域之后的空间
+    last = rb_last(&pcb->mm_rb);
+    addr = last ? rb_entry(last, struct vm_area_struct, vm_rb)->vm_end : 0;
+    addr = (addr + align - 1) & ~(align - 1);
+    if (addr == 0 || addr > VMA_USER_END || VMA_USER_END - addr < length) {
+        return 0;
+    }
+    return addr;
+}
+
+
+// 查找空闲地址并插入区域，返回区域起始地址，失败返回 NULL
+void* vma_alloc(task_struct* pcb, unsigned int length, unsigned int align,
+                unsigned int flags) {
+    unsigned int addr = vma_get_unmapped_area(pcb, length, align);
+    if (addr == 0 || vma_insert(pcb, addr, addr + length, flags) == NULL) {
+        return NULL;
+    }
+    return (void*)addr;
+}
+
+
+// fork 时复制区域树，文件映射不被子进程继承
+int vma_fork(task_struct* parent, task_struct* child) {
+    struct rb_node* node;
+    child->mm_rb.rb_node = NULL;
+    for (node = rb_first(&parent->mm_rb); node; node = rb_next(node)) {
+        struct vm_area_struct* vma =
+            rb_entry(node, struct vm_area_struct, vm_rb);
+        if (vma->vm_flags & VMA_FILE) {
+            continue;
+        }
+        if (vma_insert(child, vma->vm_start, vma->vm_end, vma->vm_flags) ==
+            NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// 删除进程的全部区域
+void vma_delete_all(task_struct* pcb) {
+    struct rb_node* node;
+    while ((node = rb_first(&pcb->mm_rb)) != NULL) {
+        rb_erase(node, &pcb->mm_rb);
+        kmem_cache_free(vma_cachep,
+                        rb_entry(node, struct vm_area_struct, vm_rb));
+    }
+}
+
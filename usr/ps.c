@@ -7,11 +7,15 @@
 #include <zjunix/buddy.h>
 #include <zjunix/fs/fat.h>
 #include <zjunix/semaphore.h>
+#include <zjunix/shrinker.h>
 #include <zjunix/slab.h>
 #include <zjunix/time.h>
 #include <zjunix/utils.h>
+#include <zjunix/vfs/ext2.h>
 #include <zjunix/vfs/vfs.h>
+#include <zjunix/vfs/vfscache.h>
 #include <zjunix/vm.h>
+#include <zjunix/vmalloc.h>
 #include "../usr/ls.h"
 #include "exec.h"
 #include "myvi.h"
@@ -61,6 +65,42 @@ void create_vruntime_test() {
   task_create("nice_minus_two", empty_test, 0, 0, -2, 1);
 }
 
+#define MM_FOOTPRINT_OBJS 64
+
+// allocate the objects of the VFS and scheduler hot paths with kmalloc
+// and count the page frames they really consume
+void mm_footprint_test() {
+  static unsigned int obj_size[] = {
+      sizeof(struct dentry), sizeof(struct inode), sizeof(struct vfs_page),
+      sizeof(semaphore_waiting_process_queue_struct),
+      sizeof(struct ext2_group_desc), sizeof(union task_union)};
+  static char *obj_name[] = {"dentry", "inode", "vfs_page", "sem_wait",
+                             "group_desc", "task_union"};
+  void *objs[MM_FOOTPRINT_OBJS];
+  unsigned int i, j;
+  unsigned int free_before, used, rounded;
+  unsigned int total_used = 0, total_rounded = 0;
+
+  kernel_printf("object size pages pages(page-rounded)\n");
+  for (i = 0; i < sizeof(obj_size) / sizeof(obj_size[0]); i++) {
+    free_before = buddy_free_pages();
+    for (j = 0; j < MM_FOOTPRINT_OBJS; j++) {
+      objs[j] = kmalloc(obj_size[i]);
+    }
+    used = free_before - buddy_free_pages();
+    rounded = MM_FOOTPRINT_OBJS *
+              ((obj_size[i] + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT);
+    kernel_printf("%s %d %d %d\n", obj_name[i], obj_size[i], used, rounded);
+    total_used += used;
+    total_rounded += rounded;
+    for (j = 0; j < MM_FOOTPRINT_OBJS; j++) {
+      kfree(objs[j]);
+    }
+  }
+  kernel_printf("total %d pages, %d pages if rounded to pages\n", total_used,
+                total_rounded);
+}
+
 void get_a_str(char *a, char **p) {
   while (**p == ' ') {
     **p = 0;
@@ -164,6 +204,29 @@ void parse_cmd() {
     buddy_info();
   } else if (kernel_strcmp(ps_buffer, "mmtest") == 0) {
     kernel_printf("kmalloc : %x, size = 1KB\n", kmalloc(1024));
+  } else if (kernel_strcmp(ps_buffer, "slabinfo") == 0) {
+    slab_info();
+  } else if (kernel_strcmp(ps_buffer, "mmfootprint") == 0) {
+    mm_footprint_test();
+  } else if (kernel_strcmp(ps_buffer, "buddybench") == 0) {
+    buddy_bench();
+  } else if (kernel_strcmp(ps_buffer, "slabbench") == 0) {
+    slab_bench();
+  } else if (kernel_strcmp(ps_buffer, "schedbench") == 0) {
+    sched_bench();
+  } else if (kernel_strcmp(ps_buffer, "membench") == 0) {
+    mem_bench();
+  } else if (kernel_strcmp(ps_buffer, "colourbench") == 0) {
+    slab_colour_bench("dentry", sizeof(struct dentry));
+    slab_colour_bench("inode", sizeof(struct inode));
+  } else if (kernel_strcmp(ps_buffer, "reclaim") == 0) {
+    // run every shrinker until none of them can release more
+    reclaim_pages(~0);
+    shrinker_info();
+  } else if (kernel_strcmp(ps_buffer, "vmallocinfo") == 0) {
+    vmalloc_info();
+  } else if (kernel_strcmp(ps_buffer, "vmalloctest") == 0) {
+    vmalloc_test();
   } else if (kernel_strcmp(ps_buffer, "ps") == 0) {
     result = print_proc();
     kernel_printf("ps return with %d\n", result);
@@ -186,7 +249,19 @@ void parse_cmd() {
     kernel_printf("run vruntime test\n");
     create_vruntime_test();
   }
-  else if (kernel_strcmp(ps_buffer, "proc") == 0) {
+  else if (kernel_strcmp(ps_buffer, "schedstat") == 0) {
+    sched_stat();
+  } else if (kernel_strcmp(ps_buffer, "tick") == 0) {
+    if (kernel_strcmp(param, "static") == 0) {
+      sched_set_tick_mode(0);
+    } else if (kernel_strcmp(param, "dynamic") == 0) {
+      sched_set_tick_mode(1);
+    } else {
+      kernel_printf("usage: tick static|dynamic\n");
+    }
+  } else if (kernel_strcmp(ps_buffer, "pidstress") == 0) {
+    pid_stress();
+  } else if (kernel_strcmp(ps_buffer, "proc") == 0) {
     result = proc_demo_create();
     kernel_printf("proc return with %d\n", result);
   } else if (kernel_strcmp(ps_buffer, "test") == 0) {
@@ -253,6 +328,27 @@ void parse_cmd() {
     task_create("page_share_proc_1", page_share_proc_1, 0, 0, 0, 1);
     sleep(1000 * 1000 * 10);
     task_create("page_share_proc_2", page_share_proc_2, 0, 0, 0, 1);
+  } else if (kernel_strcmp(ps_buffer, "sharebench") == 0) {
+    task_create("share_bench_proc", share_bench_proc, 0, 0, 0, 1);
+  } else if (kernel_strcmp(ps_buffer, "tlbthrash") == 0) {
+    task_create("tlb_thrash_proc", tlb_thrash_proc, 0, 0, 0, 1);
+  } else if (kernel_strcmp(ps_buffer, "vmabench") == 0) {
+    task_create("vma_bench_proc", vma_bench_proc, 0, 0, 0, 1);
+  } else if (kernel_strcmp(ps_buffer, "swapon") == 0) {
+    if (swap_ramdisk_on() != 0) {
+      kernel_printf("swap device already on\n");
+    }
+  } else if (kernel_strcmp(ps_buffer, "swapstat") == 0) {
+    swap_stat();
+  } else if (kernel_strcmp(ps_buffer, "swaptest") == 0) {
+    task_create("swap_test_proc", swap_test_proc, 0, 0, 0, 1);
+  } else if (kernel_strcmp(ps_buffer, "mmap") == 0) {
+    // the task outlives ps_buffer, it frees the copy itself
+    char *filename = kmalloc(64);
+    kernel_strcpy(filename, param);
+    task_create("mmap_proc", mmap_proc, 1, filename, 0, 1);
+  } else if (kernel_strcmp(ps_buffer, "fork") == 0) {
+    task_create("fork_proc", fork_proc, 0, 0, 0, 1);
   } else if (kernel_strcmp(ps_buffer, "buffer") == 0) {
     unsigned int init_gp;
     asm volatile("la %0, _gp\n\t" : "=r"(init_gp));
@@ -265,6 +361,11 @@ void parse_cmd() {
     unsigned int init_gp;
     asm volatile("la %0, _gp\n\t" : "=r"(init_gp));
     task_create("producer_proc", producer_proc, 0, 0, 0, 1);
+  } else if (kernel_strcmp(ps_buffer, "pingpong") == 0) {
+    semaphore_create("ping", 0);
+    semaphore_create("pong", 0);
+    task_create("pong_proc", pong_proc, 0, 0, 0, 0);
+    task_create("ping_proc", ping_proc, 0, 0, 0, 0);
   } else {
     kernel_puts(ps_buffer, 0xfff, 0);
     kernel_puts(": command not found\n", 0xfff, 0);
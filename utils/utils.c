@@ -1,28 +1,129 @@
+#include <arch.h>
 #include <driver/vga.h>
+#include <intr.h>
 #include <zjunix/utils.h>
 
-void* kernel_memcpy(void* dest, void* src, int len) {
-    char* deststr = dest;
-    char* srcstr = src;
-    while (len--) {
-        *deststr = *srcstr;
-        deststr++;
-        srcstr++;
+// unaligned word access, gcc emits lwl/lwr for it
+struct unaligned_word {
+    unsigned int w;
+} __attribute__((packed));
+
+#pragma GCC push_options
+#pragma GCC optimize("O2")
+// there is no libc to fall back on, so keep gcc from turning the loops
+// below back into memcpy/memset calls
+#define NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+// copies forward, so overlapping buffers are fine as long as dest < src
+// (vga scrolling and ext2 dirent shifting rely on this)
+NO_LIBCALL void* kernel_memcpy(void* dest, void* src, int len) {
+    unsigned char* deststr = dest;
+    unsigned char* srcstr = src;
+    unsigned int* destw;
+    unsigned int t0, t1, t2, t3, t4, t5, t6, t7;
+
+    if (len >= 16) {
+        while ((unsigned int)deststr & 3) {
+            *deststr++ = *srcstr++;
+            len--;
+        }
+        destw = (unsigned int*)deststr;
+        if (((unsigned int)srcstr & 3) == 0) {
+            unsigned int* srcw = (unsigned int*)srcstr;
+            // one cache line per iteration, all loads before the stores
+            while (len >= 32) {
+                t0 = srcw[0];
+                t1 = srcw[1];
+                t2 = srcw[2];
+                t3 = srcw[3];
+                t4 = srcw[4];
+                t5 = srcw[5];
+                t6 = srcw[6];
+                t7 = srcw[7];
+                destw[0] = t0;
+                destw[1] = t1;
+                destw[2] = t2;
+                destw[3] = t3;
+                destw[4] = t4;
+                destw[5] = t5;
+                destw[6] = t6;
+                destw[7] = t7;
+                srcw += 8;
+                destw += 8;
+                len -= 32;
+            }
+            while (len >= 4) {
+                *destw++ = *srcw++;
+                len -= 4;
+            }
+            srcstr = (unsigned char*)srcw;
+        } else {
+            struct unaligned_word* srcw = (struct unaligned_word*)srcstr;
+            while (len >= 16) {
+                t0 = srcw[0].w;
+                t1 = srcw[1].w;
+                t2 = srcw[2].w;
+                t3 = srcw[3].w;
+                destw[0] = t0;
+                destw[1] = t1;
+                destw[2] = t2;
+                destw[3] = t3;
+                srcw += 4;
+                destw += 4;
+                len -= 16;
+            }
+            while (len >= 4) {
+                *destw++ = (srcw++)->w;
+                len -= 4;
+            }
+            srcstr = (unsigned char*)srcw;
+        }
+        deststr = (unsigned char*)destw;
+    }
+    while (len-- > 0) {
+        *deststr++ = *srcstr++;
     }
     return dest;
 }
 
-#pragma GCC push_options
-#pragma GCC optimize("O2")
-void* kernel_memset(void* dest, int b, int len) {
+// only the low byte of b is used, as in the C library memset
+NO_LIBCALL void* kernel_memset(void* dest, int b, int len) {
 #ifdef MEMSET_DEBUG
     kernel_printf("memset:%x,%x,len%x,", (int)dest, b, len);
 #endif  // ! MEMSET_DEBUG
-    char content = b ? -1 : 0;
-    char* deststr = dest;
-    while (len--) {
-        *deststr = content;
-        deststr++;
+    unsigned char content = b;
+    unsigned char* deststr = dest;
+    unsigned int* destw;
+    unsigned int w;
+
+    if (len >= 16) {
+        w = content | (content << 8);
+        w |= w << 16;
+        while ((unsigned int)deststr & 3) {
+            *deststr++ = content;
+            len--;
+        }
+        destw = (unsigned int*)deststr;
+        while (len >= 32) {
+            destw[0] = w;
+            destw[1] = w;
+            destw[2] = w;
+            destw[3] = w;
+            destw[4] = w;
+            destw[5] = w;
+            destw[6] = w;
+            destw[7] = w;
+            destw += 8;
+            len -= 32;
+        }
+        while (len >= 4) {
+            *destw++ = w;
+            len -= 4;
+        }
+        deststr = (unsigned char*)destw;
+    }
+    while (len-- > 0) {
+        *deststr++ = content;
     }
 #ifdef MEMSET_DEBUG
     kernel_printf("%x\n", (int)deststr);
@@ -91,3 +192,52 @@ void sleep(int cycle) {
     while (cycle--)
         ;
 }
+
+#define MEM_BENCH_BUF 4096
+#define MEM_BENCH_ROUNDS 8
+
+static unsigned char mem_bench_src[MEM_BENCH_BUF + 32] __attribute__((aligned(32)));
+static unsigned char mem_bench_dst[MEM_BENCH_BUF + 32] __attribute__((aligned(32)));
+
+// bytes per 100 cycles for memcpy and memset at several sizes and
+// src/dest misalignments, interrupts stay off while timing
+void mem_bench() {
+    static int bench_size[5] = {16, 64, 256, 1024, 4096};
+    static int bench_off[4][2] = {{0, 0}, {1, 1}, {0, 1}, {2, 0}};
+    unsigned int start, cycles, old_ie;
+    int i, j, round;
+
+    kernel_memset(mem_bench_src, 0x5a, sizeof(mem_bench_src));
+    kernel_printf("mem bench: bytes per 100 cycles\n");
+    kernel_printf("\tsize  dst+ src+  memcpy  memset\n");
+    for (i = 0; i < 5; i++) {
+        for (j = 0; j < 4; j++) {
+            unsigned char* dst = mem_bench_dst + bench_off[j][0];
+            unsigned char* src = mem_bench_src + bench_off[j][1];
+            int size = bench_size[i];
+            unsigned int copy_rate, set_rate;
+
+            old_ie = disable_interrupts();
+            // warm the cache first so both kernels see the same state
+            kernel_memcpy(dst, src, size);
+            start = get_cp0_count();
+            for (round = 0; round < MEM_BENCH_ROUNDS; round++) {
+                kernel_memcpy(dst, src, size);
+            }
+            cycles = get_cp0_count() - start;
+            copy_rate = cycles ? size * MEM_BENCH_ROUNDS * 100 / cycles : 0;
+
+            start = get_cp0_count();
+            for (round = 0; round < MEM_BENCH_ROUNDS; round++) {
+                kernel_memset(dst, round, size);
+            }
+            cycles = get_cp0_count() - start;
+            set_rate = cycles ? size * MEM_BENCH_ROUNDS * 100 / cycles : 0;
+            if (old_ie) {
+                enable_interrupts();
+            }
+            kernel_printf("\t%d    %d    %d     %d     %d\n", size, bench_off[j][0], bench_off[j][1], copy_rate,
+                          set_rate);
+        }
+    }
+}